@@ -63,6 +63,20 @@ class Device:
 
         return str(event)
 
+    def next_events(self, n):
+        """ Returns up to n events from the queue. The list is empty if the
+        queue is empty.
+        """
+
+        events = []
+
+        while len(events) < n and not self.event_queue.empty():
+            event = self.event_queue.get_nowait()
+            Device.logger.info('EVENT_LIFECYCLE_FETCHED:{}', event)
+            events.append(str(event))
+
+        return events
+
 class PassiveDevice(threading.Thread):
     logger = Log.get_logger('PassiveDevice', StandardWriter)
 
@@ -171,6 +185,12 @@ class NameServiceAPI:
 
         raise AttributeError('Device id {} not found'.format(did))
 
+    def next_events(self, did, n):
+        if did in self.devices:
+            return self.devices[did].next_events(n)
+
+        raise AttributeError('Device id {} not found'.format(did))
+
 class NameService(threading.Thread):
     """ Keeps track of all devices and the gateway in the test.
     """
@@ -1,34 +1,194 @@
 import threading
 import socket
+import struct
 import time
 import json
 from log import Log, StandardWriter
 
+# starts a msgpack message, followed by its length as a big endian 32 bit
+# integer. The byte is never used by msgpack and cannot start json.
+FRAME_MARKER = '\xc1'
+
+class MessagePack():
+    """ A minimal MessagePack codec for the types that json has.
+    """
+
+    FIXED = {
+        0xca: '>f', 0xcb: '>d',
+        0xcc: '>B', 0xcd: '>H', 0xce: '>I', 0xcf: '>Q',
+        0xd0: '>b', 0xd1: '>h', 0xd2: '>i', 0xd3: '>q'
+    }
+
+    CONSTANTS = { 0xc0: None, 0xc2: False, 0xc3: True }
+
+    @staticmethod
+    def _header(length, fix, tag):
+        if length <= 15:
+            return chr(fix | length)
+        if length <= 0xffff:
+            return chr(tag) + struct.pack('>H', length)
+        return chr(tag + 1) + struct.pack('>I', length)
+
+    @staticmethod
+    def _pack_int(value):
+        if -32 <= value <= 0x7f:
+            return struct.pack('b' if value < 0 else 'B', value)
+
+        if value >= 0:
+            sizes = ((0xcc, 0xff), (0xcd, 0xffff), (0xce, 0xffffffff), (0xcf, None))
+        else:
+            sizes = ((0xd0, -0x80), (0xd1, -0x8000), (0xd2, -0x80000000), (0xd3, None))
+
+        for tag, limit in sizes:
+            if limit is None or abs(value) <= abs(limit):
+                return chr(tag) + struct.pack(MessagePack.FIXED[tag], value)
+
+    @staticmethod
+    def pack(value):
+        if value is None:
+            return '\xc0'
+        if value is True or value is False:
+            return '\xc3' if value else '\xc2'
+        if isinstance(value, (int, long)):
+            return MessagePack._pack_int(value)
+        if isinstance(value, float):
+            return '\xcb' + struct.pack('>d', value)
+        if isinstance(value, unicode):
+            value = value.encode('utf-8')
+        if isinstance(value, str):
+            if 31 < len(value) <= 0xff:
+                return '\xd9' + chr(len(value)) + value
+            return MessagePack._header(len(value), 0xa0, 0xda) + value
+        if isinstance(value, (list, tuple)):
+            return MessagePack._header(len(value), 0x90, 0xdc) + ''.join(
+                    MessagePack.pack(v) for v in value)
+        if isinstance(value, dict):
+            return MessagePack._header(len(value), 0x80, 0xde) + ''.join(
+                    MessagePack.pack(k) + MessagePack.pack(v)
+                    for k, v in value.iteritems())
+
+        raise TypeError('Cannot pack {}'.format(type(value)))
+
+    @staticmethod
+    def _unpack(data, offset):
+        tag = ord(data[offset])
+        offset += 1
+
+        if tag <= 0x7f:
+            return tag, offset
+        if tag >= 0xe0:
+            return tag - 0x100, offset
+        if tag in MessagePack.CONSTANTS:
+            return MessagePack.CONSTANTS[tag], offset
+        if tag in MessagePack.FIXED:
+            fmt = MessagePack.FIXED[tag]
+            return (struct.unpack_from(fmt, data, offset)[0],
+                    offset + struct.calcsize(fmt))
+
+        if tag & 0xe0 == 0xa0:
+            length = tag & 0x1f
+        elif tag & 0xe0 == 0x80:
+            length = tag & 0x0f
+        elif 0xd9 <= tag <= 0xdf:
+            fmt = { 0xd9: '>B', 0xda: '>H', 0xdb: '>I', 0xdc: '>H',
+                    0xdd: '>I', 0xde: '>H', 0xdf: '>I' }[tag]
+            length = struct.unpack_from(fmt, data, offset)[0]
+            offset += struct.calcsize(fmt)
+        else:
+            raise ValueError('Cannot unpack tag {}'.format(hex(tag)))
+
+        if tag & 0xe0 == 0xa0 or 0xd9 <= tag <= 0xdb:
+            if offset + length > len(data):
+                raise ValueError('String out of bounds')
+            return data[offset:offset + length].decode('utf-8'), offset + length
+
+        if tag & 0xf0 == 0x90 or tag in (0xdc, 0xdd):
+            values = []
+            for _ in range(length):
+                value, offset = MessagePack._unpack(data, offset)
+                values.append(value)
+            return values, offset
+
+        values = {}
+        for _ in range(length):
+            key, offset = MessagePack._unpack(data, offset)
+            values[key], offset = MessagePack._unpack(data, offset)
+        return values, offset
+
+    @staticmethod
+    def unpack(data):
+        value, offset = MessagePack._unpack(data, 0)
+
+        if offset != len(data):
+            raise ValueError('Trailing bytes after message')
+
+        return value
+
+def encode_message(message, binary):
+    """ Frames message as length prefixed msgpack if binary, and as a line of
+    json otherwise.
+    """
+
+    if binary:
+        payload = MessagePack.pack(message)
+        return FRAME_MARKER + struct.pack('>I', len(payload)) + payload
+
+    return json.dumps(message) + '\n'
+
+def read_message(conn):
+    """ Reads the next message from the file like conn. Returns it still
+    encoded together with whether it is msgpack, or None at the end of the
+    stream.
+    """
+
+    first = conn.read(1)
+
+    if first == '':
+        return None, False
+
+    if first == FRAME_MARKER:
+        header = conn.read(4)
+        length = struct.unpack('>I', header)[0] if len(header) == 4 else -1
+        payload = conn.read(length) if length >= 0 else ''
+
+        if len(payload) != length:
+            return None, True
+
+        return payload, True
+
+    return first + conn.readline(), False
+
+def decode_message(payload, binary):
+    return MessagePack.unpack(payload) if binary else json.loads(payload)
+
 class Stub():
-    """ Wraps the socket request to support RMI.
+    """ Wraps the socket request to support RMI. Requests are sent as json, or
+    as msgpack if wire is 'msgpack'.
     """
 
     logger = Log.get_logger('Stub', StandardWriter)
 
-    def __init__(self, address):
+    def __init__(self, address, wire='json'):
         self.address = tuple(address)
+        self.binary = wire == 'msgpack'
 
     def _rmi(self, method, *args):
         sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         sock.connect(self.address)
         conn = sock.makefile(mode='rw')
 
-        payload = json.dumps({
+        payload = {
             'method': method,
             'args': args
-        })
+        }
 
         Stub.logger.debug('{}: <<<< {}', sock.getsockname(), payload)
 
-        conn.write(payload + '\n')
+        conn.write(encode_message(payload, self.binary))
         conn.flush()
 
-        response = json.loads(conn.readline())
+        response, binary = read_message(conn)
+        response = decode_message(response, binary)
         Stub.logger.debug('{}: >>>> {}', sock.getsockname(), response)
 
         if 'result' in response:
@@ -61,42 +221,50 @@ class Request(threading.Thread):
         self.delay = delay
         self.daemon = True
 
-    def process_request(self, request):
+    def process_request(self, request, binary):
         Request.logger.debug('{}:>>>> {}', self.addr, repr(request))
 
         try:
-            data = json.loads(request)
+            data = decode_message(request, binary)
             method = data['method']
             args = data['args']
             result = getattr(self.api, method)(*args)
-            result = json.dumps({ 'result': result })
-            Request.logger.debug('{}:<<<< {}', self.addr, repr(result))
-
-            return result
+            result = { 'result': result }
         except Exception as e:
-            result = json.dumps({
+            # an error is a regular reply, e.g. next_event on an empty queue
+            # when the gateway pipelines its requests
+            result = {
                 'error': { 'name': type(e).__name__, 'args': [e.message] }
-            })
-            Request.logger.error('{}:<<<< {}', self.addr, repr(result))
-            return result
+            }
+
+        Request.logger.debug('{}:<<<< {}', self.addr, repr(result))
+        return encode_message(result, binary)
 
     def run(self):
         try:
             worker = self.conn.makefile(mode='rw')
-            request = worker.readline()
 
-            if self.delay > 0:
-                # wait both before and after the processing
-                Request.logger.debug('{}:Delay {} s', self.addr, self.delay)
-                time.sleep(self.delay)
+            # requests are newline delimited json or length prefixed msgpack,
+            # keep serving them until the client closes the connection and
+            # answer each in the encoding it came in
+            while True:
+                request, binary = read_message(worker)
+
+                if request is None:
+                    break
+
+                if self.delay > 0:
+                    # wait both before and after the processing
+                    Request.logger.debug('{}:Delay {} s', self.addr, self.delay)
+                    time.sleep(self.delay)
 
-            result = self.process_request(request)
+                result = self.process_request(request, binary)
 
-            if self.delay > 0:
-                time.sleep(self.delay)
+                if self.delay > 0:
+                    time.sleep(self.delay)
 
-            worker.write(result + '\n')
-            worker.flush()
+                worker.write(result)
+                worker.flush()
         except Exception as e:
             Request.logger.error('The gateway connection has died: {}: {}',
                     type(e), e);
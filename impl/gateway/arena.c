@@ -0,0 +1,101 @@
+#include <string.h>
+#include "arena.h"
+#include "log.h"
+
+/**
+ * The usable memory of a block starts right after its header.
+ */
+#define __ARENA_HEADER ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+arena_block_t* __arena_block_new(size_t size)
+{
+    arena_block_t* block = malloc(__ARENA_HEADER + size);
+
+    if (block == NULL) {
+        return NULL;
+    }
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+void arena_init(arena_t* arena)
+{
+    log_verbose("arena_init:arena=%p", arena);
+
+    arena->head = NULL;
+    arena->current = NULL;
+}
+
+/**
+ * Returns size bytes from the arena, zeroed if zero is set, or NULL if no
+ * memory could be allocated. Blocks left over from before the last reset are
+ * used before new ones are allocated.
+ */
+void* arena_alloc(arena_t* arena, size_t size, int zero)
+{
+    log_verbose("arena_alloc:arena=%p, size=%zu, zero=%d", arena, size, zero);
+
+    arena_block_t* block = arena->current;
+    void* ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    while (block != NULL && block->used + size > block->size) {
+        block = block->next;
+    }
+
+    if (block == NULL) {
+        block = __arena_block_new(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+
+        if (block == NULL) {
+            return NULL;
+        }
+
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    arena->current = block;
+    ptr = (char*) block + __ARENA_HEADER + block->used;
+    block->used += size;
+
+    if (zero) {
+        memset(ptr, 0, size);
+    }
+
+    return ptr;
+}
+
+/**
+ * Releases everything allocated from the arena at once.
+ */
+void arena_reset(arena_t* arena)
+{
+    log_verbose("arena_reset:arena=%p", arena);
+
+    for (arena_block_t* block = arena->head; block != NULL; block = block->next) {
+        block->used = 0;
+    }
+
+    arena->current = arena->head;
+}
+
+void arena_free(arena_t* arena)
+{
+    log_verbose("arena_free:arena=%p", arena);
+
+    arena_block_t* block = arena->head;
+
+    while (block != NULL) {
+        arena_block_t* next = block->next;
+
+        free(block);
+        block = next;
+    }
+
+    arena_init(arena);
+}
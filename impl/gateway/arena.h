@@ -0,0 +1,35 @@
+#ifndef __ARENA_h__
+#define __ARENA_h__
+
+#include <stdlib.h>
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN 16
+
+typedef struct arena_block_s arena_block_t;
+typedef struct arena_s arena_t;
+
+struct arena_block_s {
+    arena_block_t* next;
+    size_t size;
+    size_t used;
+};
+
+/**
+ * Bump allocator. Memory is not freed piece by piece but all at once with
+ * arena_reset, which keeps the blocks for the next round.
+ */
+struct arena_s {
+    arena_block_t* head;
+    arena_block_t* current;
+};
+
+void arena_init(arena_t* arena);
+
+void* arena_alloc(arena_t* arena, size_t size, int zero);
+
+void arena_reset(arena_t* arena);
+
+void arena_free(arena_t* arena);
+
+#endif
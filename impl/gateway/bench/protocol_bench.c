@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "log.h"
+#include "err.h"
+#include "protocol.h"
+#include "machine.h"
+
+/**
+ * Microbenchmarks of the protocol functions on the messages the gateway sees
+ * the most, or the largest of them. Built and run by make bench, which links
+ * with the allocator wrapped so that allocations can be counted.
+ */
+
+#define BENCH_MIN_NS 200000000ULL
+#define BENCH_BUF_SIZE 65536
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+static unsigned long long bench_allocs = 0;
+static unsigned long long bench_bytes = 0;
+
+void* __wrap_malloc(size_t size)
+{
+    ++bench_allocs;
+    bench_bytes += size;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+    ++bench_allocs;
+    bench_bytes += nmemb * size;
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    ++bench_allocs;
+    bench_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+typedef void (*bench_fn)(void* arg);
+
+typedef struct {
+    char* buf;
+    int len;
+    protocol_value_t* value;
+} bench_message_t;
+
+static char bench_out[BENCH_BUF_SIZE];
+
+unsigned long long bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Runs fn on arg in rounds of doubling length until a round takes at least
+ * BENCH_MIN_NS, and reports the cost of one call in the last round.
+ */
+void bench_run(char* name, bench_fn fn, void* arg)
+{
+    unsigned long long n = 1;
+
+    while (1) {
+        unsigned long long allocs = bench_allocs;
+        unsigned long long bytes = bench_bytes;
+        unsigned long long start = bench_now();
+        unsigned long long elapsed;
+
+        for (unsigned long long i = 0; i < n; ++i) {
+            fn(arg);
+        }
+
+        elapsed = bench_now() - start;
+
+        if (elapsed >= BENCH_MIN_NS) {
+            printf("%-28s %12.1f ns/op %10.2f allocs/op %12.1f B/op\n",
+                    name,
+                    (double) elapsed / n,
+                    (double) (bench_allocs - allocs) / n,
+                    (double) (bench_bytes - bytes) / n);
+            return;
+        }
+
+        n *= 2;
+    }
+}
+
+void bench_parse(void* arg)
+{
+    bench_message_t* message = arg;
+    protocol_value_t* value;
+
+    if (protocol_parse(&value, message->buf, message->len)) {
+        exit(1);
+    }
+
+    protocol_free_parse(value);
+}
+
+void bench_parse_arena(void* arg)
+{
+    static arena_t arena;
+    static int is_init = 0;
+    bench_message_t* message = arg;
+    protocol_value_t* value;
+
+    if (!is_init) {
+        arena_init(&arena);
+        is_init = 1;
+    }
+
+    arena_reset(&arena);
+
+    if (protocol_parse_arena(&value, message->buf, message->len, &arena)) {
+        exit(1);
+    }
+}
+
+void bench_scan_result(void* arg)
+{
+    bench_message_t* message = arg;
+    protocol_scalar_t scalar;
+
+    protocol_scan_result(message->buf, message->len, &scalar);
+}
+
+void bench_build_request(void* arg)
+{
+    protocol_value_t* request;
+    protocol_value_t* did;
+
+    protocol_build_string(&did, arg);
+    protocol_build_request(&request, "next_event", 1, did);
+    protocol_free_build(request);
+}
+
+void bench_to_json(void* arg)
+{
+    protocol_to_json(arg, bench_out);
+}
+
+void bench_serialize(void* arg)
+{
+    protocol_serialize(arg, bench_out, sizeof(bench_out));
+}
+
+void bench_get_key(void* arg)
+{
+    protocol_value_t* result;
+
+    protocol_get_key(arg, &result, "result");
+}
+
+void bench_get_devices(void* arg)
+{
+    struct sockaddr_storage* devices[MACHINE_MAX_DEVICES];
+    size_t len;
+
+    if (protocol_get_devices(arg, devices, &len)) {
+        exit(1);
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        free(devices[i]);
+    }
+}
+
+void bench_message_init(bench_message_t* message, char* buf)
+{
+    message->buf = buf;
+    message->len = strlen(buf);
+
+    if (protocol_parse(&message->value, buf, message->len)) {
+        fprintf(stderr, "cannot parse %s\n", buf);
+        exit(1);
+    }
+}
+
+/**
+ * A hostnames reply with MACHINE_MAX_DEVICES devices.
+ */
+char* bench_hostnames()
+{
+    char* buf = malloc(BENCH_BUF_SIZE);
+    size_t len = sprintf(buf, "{\"result\": [");
+
+    for (int i = 0; i < MACHINE_MAX_DEVICES; ++i) {
+        len += sprintf(buf + len, "%s[\"127.0.0.1\", %d]", i > 0 ? ", " : "", 5000 + i);
+    }
+
+    sprintf(buf + len, "]}");
+
+    return buf;
+}
+
+int main()
+{
+    bench_message_t status;
+    bench_message_t next_event;
+    bench_message_t error;
+    bench_message_t hostnames;
+    protocol_value_t* devices;
+    protocol_value_t* request;
+
+    bench_message_init(&status, "{\"result\": 1}");
+    bench_message_init(&next_event, "{\"result\": \"0f8c2b4e-6d1a-4c3b-9e2f-7a5d8b1c3e60\"}");
+    bench_message_init(&error,
+            "{\"error\": {\"name\": \"EventError\", \"args\": [\"Cannot get next event: queue is empty.\"]}}");
+    bench_message_init(&hostnames, bench_hostnames());
+    protocol_get_key(hostnames.value, &devices, "result");
+    protocol_build_request(&request, "status", 0);
+
+    bench_run("parse status", bench_parse, &status);
+    bench_run("parse next_event", bench_parse, &next_event);
+    bench_run("parse error", bench_parse, &error);
+    bench_run("parse hostnames", bench_parse, &hostnames);
+    bench_run("parse_arena hostnames", bench_parse_arena, &hostnames);
+    bench_run("scan_result status", bench_scan_result, &status);
+    bench_run("scan_result next_event", bench_scan_result, &next_event);
+    bench_run("build_request next_event", bench_build_request, "device-0");
+    bench_run("to_json status", bench_to_json, request);
+    bench_run("serialize status", bench_serialize, request);
+    bench_run("serialize hostnames", bench_serialize, hostnames.value);
+    bench_run("get_key status", bench_get_key, status.value);
+    bench_run("get_key error", bench_get_key, error.value);
+    bench_run("get_devices hostnames", bench_get_devices, devices);
+
+    return 0;
+}
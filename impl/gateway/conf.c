@@ -18,6 +18,12 @@ void config_init(config_data_t* config)
     config->io = 0;
     config->logserver_port = 0;
     config->nameservice_port = 0;
+    config->keep_alive = 0;
+    config->pipeline = 0;
+    config->batch = 1;
+    config->shards = 1;
+    config->encoding = PROTOCOL_JSON;
+    config->stats = 0;
 }
 
 /**
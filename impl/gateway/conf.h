@@ -14,6 +14,12 @@ struct config_data_s {
     char test_manager_address[128];
     int logserver_port;
     int nameservice_port;
+    int keep_alive;
+    int pipeline;
+    int batch;
+    int shards;
+    int encoding;
+    int stats;
 };
 
 void config_init(config_data_t* config);
@@ -1,9 +1,135 @@
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include "uv.h"
 #include "log.h"
 #include "dispatcher.h"
 #include "machine.h"
 #include "state.h"
 #include "event_handler.h"
+#include "uring.h"
+#include "fs.h"
+#include "pool.h"
+#include "err.h"
+
+/**
+ * Builds the request for the next event, or for up to config->batch events if
+ * batching.
+ */
+void __dispatcher_build_next_event(config_data_t* config, protocol_value_t** request)
+{
+    log_verbose("__dispatcher_build_next_event:config=%p, request=%p", config, request);
+
+    int r;
+
+    if (config->batch > 1) {
+        protocol_value_t* batch_value;
+
+        r = protocol_build_int(&batch_value, config->batch);
+        log_check_r(r, "__dispatcher_build_next_event:protocol_build_int");
+
+        r = protocol_build_request(request, "next_events", 1, batch_value);
+    }
+    else {
+        r = protocol_build_request(request, "next_event", 0);
+    }
+
+    log_check_r(r, "__dispatcher_build_next_event:protocol_build_request");
+}
+
+/**
+ * Returns the next event request encoded, to be written as it is for the rest
+ * of the run. Without batching the request has no arguments and comes from
+ * the cache of net.
+ */
+net_encoded_t* __dispatcher_encode_next_event(config_data_t* config)
+{
+    log_verbose("__dispatcher_encode_next_event:config=%p", config);
+
+    int r;
+    net_encoded_t* encoded;
+    protocol_value_t* request;
+
+    if (config->batch <= 1) {
+        r = net_get_cached_request("next_event", config->encoding, &encoded);
+        log_check_r(r, "__dispatcher_encode_next_event:net_get_cached_request");
+
+        return encoded;
+    }
+
+    encoded = malloc(sizeof(net_encoded_t));
+    __dispatcher_build_next_event(config, &request);
+
+    r = net_encode(request, config->encoding, encoded);
+    log_check_r(r, "__dispatcher_encode_next_event:net_encode");
+
+    protocol_free_build(request);
+
+    return encoded;
+}
+
+/**
+ * Reads the events out of the next_event(s) response in device->read_payload
+ * into device->events and releases the response.
+ */
+void __dispatcher_get_events(net_tcp_context_sync_t* device)
+{
+    log_verbose("__dispatcher_get_events:device=%p", device);
+
+    int r;
+    protocol_value_t* response = device->read_payload;
+
+    r = protocol_get_result_events(response, &device->read_result, device->events, NET_MAX_EVENTS);
+    if (r < 0) {
+        log_check_r(r, "__dispatcher_get_events:protocol_get_result_events");
+    }
+    device->events_len = r;
+    protocol_free_parse(response);
+}
+
+/**
+ * Hands the events of the next_event(s) response in device->read_payload to
+ * the event handler. With the preemptive handler the device is not processed
+ * until the thread pool is done with every event.
+ */
+void __dispatcher_handle_events(config_data_t* config, net_tcp_context_sync_t* device)
+{
+    log_verbose("__dispatcher_handle_events:config=%p, device=%p", config, device);
+
+    __dispatcher_get_events(device);
+
+    if (device->events_len > 0 && strcmp(config->eventhandler, "preemptive") == 0) {
+        pthread_mutex_lock(&device->mutex);
+        device->is_processed = 0;
+        device->events_pending = device->events_len;
+        pthread_mutex_unlock(&device->mutex);
+    }
+
+    for (int k = 0; k < device->events_len; ++k) {
+        log_event_retrieved(&device->events[k]);
+        log_event_dispatched(&device->events[k]);
+
+        if (strcmp(config->eventhandler, "serial") == 0) {
+            event_handler_serial(config->cpu, config->io);
+            log_event_done(&device->events[k]);
+        }
+        else if (strcmp(config->eventhandler, "preemptive") == 0) {
+            pthread_mutex_lock(&event_handler_lock);
+            while (event_handler_queue_size > EVENT_HANDLER_MAX_QUEUE_SIZE) {
+                log_debug("__dispatcher_handle_events:waiting for free thread");
+                pthread_cond_wait(&event_handler_cond, &event_handler_lock);
+            }
+            event_handler_preemptive(device, k);
+            pthread_mutex_unlock(&event_handler_lock);
+        }
+        else {
+            log_error("__dispatcher_handle_events:no support for eventhandler \"%s\"", config->eventhandler);
+            exit(1);
+        }
+    }
+}
 
 /**
  * The serial dispatcher only process one device and one event at a time.
@@ -17,14 +143,13 @@ void dispatcher_serial(config_data_t* config, protocol_value_t* devices)
     size_t devices_len;
     net_tcp_context_sync_t* devices_context[MACHINE_MAX_DEVICES];
     char* ts_addr = (char*) config->test_manager_address;
-    protocol_value_t* status_request;
-    protocol_value_t* get_event_request;
+    net_encoded_t* status_request;
+    net_encoded_t* get_event_request;
 
-    r = protocol_build_request(&status_request, "status", 0);
-    log_check_r(r, "dispatcher_serial:protocol_build_request");
+    r = net_get_cached_request("status", config->encoding, &status_request);
+    log_check_r(r, "dispatcher_serial:net_get_cached_request");
 
-    r = protocol_build_request(&get_event_request, "next_event", 0);
-    log_check_r(r, "dispatcher_serial:protocol_build_request");
+    get_event_request = __dispatcher_encode_next_event(config);
 
     devices_len = protocol_get_length(devices);
 
@@ -43,14 +168,13 @@ void dispatcher_serial(config_data_t* config, protocol_value_t* devices)
 
         r = net_tcp_context_sync_init(context, ts_addr, device_port, config);
         log_check_r(r, "net_tcp_context_sync_init");
+        context->use_scan = 1;
 
         devices_context[j] = context;
     }
 
     while (1) {
         net_tcp_context_sync_t* device = devices_context[i];
-        protocol_value_t* response;
-        protocol_value_t* result;
         int status_ok;
 
         i = (i + 1) % devices_len;
@@ -62,98 +186,778 @@ void dispatcher_serial(config_data_t* config, protocol_value_t* devices)
         }
         pthread_mutex_unlock(&device->mutex);
 
-        device->write_payload = status_request;
+        device->write_encoded = status_request;
         r = net_call_sync(device);
         log_check_uv_r(r, "dispatcher_serial:net_call_sync");
 
-        response = device->read_payload;
-        protocol_check_response_error(response);
-        r = protocol_get_key(response, &result, "result");
-        log_check_r(r, "dispatcher_serial:protocol_get_key");
-
-        status_ok = protocol_get_int(result);
+        status_ok = protocol_get_result_int(device->read_payload, &device->read_result);
         protocol_free_parse(device->read_payload);
 
+        if (status_ok < 0) {
+            log_check_r(status_ok, "dispatcher_serial:protocol_get_result_int");
+        }
+
         if (status_ok) {
-            device->write_payload = get_event_request;
+            device->write_encoded = get_event_request;
             r = net_call_sync(device);
             log_check_uv_r(r, "dispatcher_serial:net_call_sync");
 
-            response = device->read_payload;
-            protocol_check_response_error(response);
-            r = protocol_get_key(response, &result, "result");
-            log_check_r(r, "dispatcher_serial:protocol_get_key");
+            __dispatcher_handle_events(config, device);
+        }
+    }
+}
+
+/**
+ * A device of the epoll dispatcher and the request it has in flight. The
+ * request points at bytes that are serialized once and shared by all devices.
+ */
+typedef struct {
+    net_tcp_context_sync_t sync;
+    int is_connected;
+    int is_parked;
+    int is_status;
+    char* request;
+    size_t request_len;
+    size_t request_offset;
+} __epoll_device_t;
+
+void __epoll_watch(int epfd, __epoll_device_t* device, int op, uint32_t events)
+{
+    log_verbose("__epoll_watch:epfd=%d, device=%p, op=%d, events=%u", epfd, device, op, events);
+
+    int r;
+    struct epoll_event ev = { .events = events, .data.ptr = device };
+
+    r = epoll_ctl(epfd, op, device->sync.sock, &ev);
+
+    if (r < 0) {
+        log_check_uv_r(-errno, "__epoll_watch:epoll_ctl");
+    }
+}
+
+/**
+ * Sends as much of the request in flight as the socket takes, and waits for
+ * the socket to turn writable if some of it is left.
+ */
+void __epoll_flush(int epfd, __epoll_device_t* device)
+{
+    log_verbose("__epoll_flush:epfd=%d, device=%p", epfd, device);
+
+    int r;
+
+    r = net_send_nonblocking(&device->sync, device->request, device->request_len, &device->request_offset);
 
-            r = protocol_get_string(result, (char*) &device->event);
-            log_check_r(r, "dispatcher_serial:protocol_get_string");
+    if (r == -EAGAIN) {
+        __epoll_watch(epfd, device, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+        return;
+    }
 
-            log_event_retrieved((char*) device->event);
-            log_event_dispatched((char*) device->event);
+    log_check_uv_r(r, "__epoll_flush:net_send_nonblocking");
+    __epoll_watch(epfd, device, EPOLL_CTL_MOD, EPOLLIN);
+}
 
-            if (strcmp(config->eventhandler, "serial") == 0) {
-                event_handler_serial(config->cpu, config->io);
-                log_event_done((char*) device->event);
+void __epoll_send(int epfd, __epoll_device_t* device, net_encoded_t* request, int is_status)
+{
+    log_verbose("__epoll_send:epfd=%d, device=%p, request=%p, is_status=%d", epfd, device, request, is_status);
+
+    device->request = request->buf;
+    device->request_len = request->len;
+    device->request_offset = 0;
+    device->is_status = is_status;
+    __epoll_flush(epfd, device);
+}
+
+/**
+ * The epoll dispatcher is single threaded like the serial dispatcher, but
+ * keeps a connection and one request in flight per device on non-blocking
+ * sockets. Responses are handled as they arrive, so a slow device does not
+ * hold up the others. Connections are always kept alive.
+ */
+void dispatcher_epoll(config_data_t* config, protocol_value_t* devices)
+{
+    log_verbose("dispatcher_epoll:config=%p, devices=%p", config, devices);
+
+    int r;
+    int epfd;
+    int parked = 0;
+    int devices_len = protocol_get_length(devices);
+    __epoll_device_t* devices_context[MACHINE_MAX_DEVICES];
+    struct epoll_event events[DISPATCHER_EPOLL_MAX_EVENTS];
+    char* ts_addr = (char*) config->test_manager_address;
+    net_encoded_t* status_request;
+    net_encoded_t* next_request;
+
+    if (devices_len < 0) {
+        log_check_r(devices_len, "dispatcher_epoll:protocol_get_length");
+    }
+
+    r = net_get_cached_request("status", config->encoding, &status_request);
+    log_check_r(r, "dispatcher_epoll:net_get_cached_request");
+
+    next_request = __dispatcher_encode_next_event(config);
+
+    epfd = epoll_create1(0);
+
+    if (epfd < 0) {
+        log_check_uv_r(-errno, "dispatcher_epoll:epoll_create1");
+    }
+
+    for (int i = 0; i < devices_len; ++i) {
+        protocol_value_t* port_value;
+        int device_port;
+        __epoll_device_t* device = malloc(sizeof(__epoll_device_t));
+
+        r = protocol_get_at(devices, &port_value, i);
+        log_check_r(r, "dispatcher_epoll:protocol_get_at");
+
+        device_port = protocol_get_int(port_value);
+        if (device_port < 0) {
+            log_check_r(device_port, "dispatcher_epoll:protocol_get_int");
+        }
+
+        r = net_tcp_context_sync_init(&device->sync, ts_addr, device_port, config);
+        log_check_r(r, "dispatcher_epoll:net_tcp_context_sync_init");
+        device->sync.use_scan = 1;
+
+        r = net_connect_nonblocking(&device->sync);
+        log_check_uv_r(r, "dispatcher_epoll:net_connect_nonblocking");
+
+        device->is_connected = 0;
+        device->is_parked = 0;
+        device->request_len = 0;
+        device->request_offset = 0;
+        devices_context[i] = device;
+
+        __epoll_watch(epfd, device, EPOLL_CTL_ADD, EPOLLOUT);
+    }
+
+    while (1) {
+        // devices waiting for the thread pool are checked on every round
+        int n = epoll_wait(epfd, events, DISPATCHER_EPOLL_MAX_EVENTS, parked > 0 ? 1 : -1);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_check_uv_r(-errno, "dispatcher_epoll:epoll_wait");
+        }
+
+        for (int i = 0; i < n; ++i) {
+            __epoll_device_t* device = (__epoll_device_t*) events[i].data.ptr;
+            int status_ok;
+
+            if (!device->is_connected) {
+                r = net_connect_error(&device->sync);
+                log_check_uv_r(r, "dispatcher_epoll:connect");
+
+                device->is_connected = 1;
+                __epoll_send(epfd, device, status_request, 1);
+                continue;
+            }
+
+            if (device->request_offset < device->request_len) {
+                __epoll_flush(epfd, device);
+                continue;
+            }
+
+            r = net_recv_nonblocking(&device->sync);
+
+            if (r == -EAGAIN) {
+                continue;
             }
-            else if (strcmp(config->eventhandler, "preemptive") == 0) {
-                pthread_mutex_lock(&event_handler_lock);
-                while (event_handler_queue_size > EVENT_HANDLER_MAX_QUEUE_SIZE) {
-                    log_debug("dispatcher_serial:waiting for free thread");
-                    pthread_cond_wait(&event_handler_cond, &event_handler_lock);
+
+            log_check_uv_r(r, "dispatcher_epoll:net_recv_nonblocking");
+            device->request_len = 0;
+
+            if (!device->is_status) {
+                __dispatcher_handle_events(config, &device->sync);
+
+                pthread_mutex_lock(&device->sync.mutex);
+                device->is_parked = !device->sync.is_processed;
+                pthread_mutex_unlock(&device->sync.mutex);
+
+                if (device->is_parked) {
+                    ++parked;
+                }
+                else {
+                    __epoll_send(epfd, device, status_request, 1);
                 }
-                event_handler_preemptive(device);
-                pthread_mutex_unlock(&event_handler_lock);
+
+                continue;
+            }
+
+            status_ok = protocol_get_result_int(device->sync.read_payload, &device->sync.read_result);
+            protocol_free_parse(device->sync.read_payload);
+
+            if (status_ok < 0) {
+                log_check_r(status_ok, "dispatcher_epoll:protocol_get_result_int");
+            }
+
+            if (status_ok) {
+                __epoll_send(epfd, device, next_request, 0);
             }
             else {
-                log_error("dispatcher_serial:no support for eventhandler \"%s\"", config->eventhandler);
-                exit(1);
+                __epoll_send(epfd, device, status_request, 1);
+            }
+        }
+
+        for (int i = 0; parked > 0 && i < devices_len; ++i) {
+            __epoll_device_t* device = devices_context[i];
+            int is_processed;
+
+            if (!device->is_parked) {
+                continue;
             }
 
+            pthread_mutex_lock(&device->sync.mutex);
+            is_processed = device->sync.is_processed;
+            pthread_mutex_unlock(&device->sync.mutex);
+
+            if (is_processed) {
+                device->is_parked = 0;
+                --parked;
+                __epoll_send(epfd, device, status_request, 1);
+            }
         }
     }
+}
+
+#ifdef GATEWAY_URING
+
+/**
+ * What a submission of the uring dispatcher was for. It is kept in the low
+ * bits of the user data next to the device pointer.
+ */
+#define DISPATCHER_URING_CONNECT 1
+#define DISPATCHER_URING_SEND 2
+#define DISPATCHER_URING_RECV 3
+#define DISPATCHER_URING_OPEN 4
+#define DISPATCHER_URING_WRITE 5
+#define DISPATCHER_URING_CLOSE 6
+#define DISPATCHER_URING_OP_MASK 7
+
+/**
+ * A device of the uring dispatcher. With the cooperative event handler the
+ * events are handled one at a time, and event_index is the one whose file is
+ * being written.
+ */
+typedef struct {
+    net_tcp_context_sync_t sync;
+    int index;
+    int is_parked;
+    int is_status;
+    int event_index;
+    int fd;
+    char* content;
+    char path[FS_MAX_BUF];
+} __uring_device_t;
+
+/**
+ * Per test state of the uring dispatcher.
+ */
+typedef struct {
+    uring_t ring;
+    config_data_t* config;
+    int has_fixed_buffers;
+    int is_timeout_armed;
+    int parked;
+    net_encoded_t* status_request;
+    net_encoded_t* next_request;
+} __uring_dispatcher_t;
+
+/**
+ * Returns a submission entry for op on device, submitting the queue first if
+ * it is full.
+ */
+struct io_uring_sqe* __uring_sqe(__uring_dispatcher_t* dispatcher, __uring_device_t* device, int op)
+{
+    log_verbose("__uring_sqe:dispatcher=%p, device=%p, op=%d", dispatcher, device, op);
+
+    int r;
+    struct io_uring_sqe* sqe = uring_get_sqe(&dispatcher->ring);
+
+    if (sqe == NULL) {
+        r = uring_submit(&dispatcher->ring, 0);
+        log_check_uv_r(r, "__uring_sqe:uring_submit");
+        sqe = uring_get_sqe(&dispatcher->ring);
+    }
 
-    protocol_free_build(status_request);
-    protocol_free_build(get_event_request);
+    sqe->user_data = (uintptr_t) device | op;
+
+    return sqe;
 }
 
 /**
- * The cooperative dispatcher utilizes the I/O-wait-time that occurs when a tcp
- * package is being transfered to process other devices and events.
+ * Reads into what is left of the device buffer, through its registered buffer
+ * if there is one.
  */
-void dispatcher_cooperative(config_data_t* config, protocol_value_t* devices)
+void __uring_recv(__uring_dispatcher_t* dispatcher, __uring_device_t* device)
 {
-    log_verbose("dispatcher_cooperative:config=%p, devices=%p", config, devices);
+    log_verbose("__uring_recv:dispatcher=%p, device=%p", dispatcher, device);
+
+    struct io_uring_sqe* sqe = __uring_sqe(dispatcher, device, DISPATCHER_URING_RECV);
+    net_tcp_context_sync_t* sync = &device->sync;
+
+    sqe->opcode = dispatcher->has_fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+    sqe->fd = sync->sock;
+    sqe->addr = (uintptr_t) (sync->buf + sync->buf_len);
+    sqe->len = NET_MAX_SIZE - sync->buf_len;
+    sqe->buf_index = device->index;
+}
+
+/**
+ * Sends a request linked to the read of its response, so that both go to the
+ * kernel in the same submission.
+ */
+void __uring_send(__uring_dispatcher_t* dispatcher, __uring_device_t* device, int is_status)
+{
+    log_verbose("__uring_send:dispatcher=%p, device=%p, is_status=%d", dispatcher, device, is_status);
+
+    struct io_uring_sqe* sqe = __uring_sqe(dispatcher, device, DISPATCHER_URING_SEND);
+    net_encoded_t* request = is_status ? dispatcher->status_request : dispatcher->next_request;
+
+    device->is_status = is_status;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = device->sync.sock;
+    sqe->addr = (uintptr_t) request->buf;
+    sqe->len = request->len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->flags = IOSQE_IO_LINK;
+
+    __uring_recv(dispatcher, device);
+}
+
+/**
+ * Handles the events of the device from event_index on with the cooperative
+ * event handler. The CPU work is done right away and the file is written
+ * through the ring, after which the next event is handled. Polls the device
+ * again when all events are done.
+ */
+void __uring_handle_events(__uring_dispatcher_t* dispatcher, __uring_device_t* device)
+{
+    log_verbose("__uring_handle_events:dispatcher=%p, device=%p", dispatcher, device);
+
+    config_data_t* config = dispatcher->config;
+    net_tcp_context_sync_t* sync = &device->sync;
+
+    while (device->event_index < sync->events_len) {
+        protocol_event_t* event = &sync->events[device->event_index];
+
+        log_event_retrieved(event);
+        log_event_dispatched(event);
+        event_handler_do_cpu(config->cpu);
+
+        if (config->io > 0.0) {
+            struct io_uring_sqe* sqe = __uring_sqe(dispatcher, device, DISPATCHER_URING_OPEN);
+
+            event_handler_make_io_path(device->path);
+            event_handler_fill_io_buffer(config->io, &device->content);
+
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t) device->path;
+            sqe->open_flags = O_WRONLY | O_CREAT;
+            sqe->len = 0644;
+            return;
+        }
+
+        log_event_done(event);
+        ++(device->event_index);
+    }
+
+    __uring_send(dispatcher, device, 1);
+}
+
+/**
+ * Writes the event file of the device and closes it once the file is open.
+ */
+void __uring_write(__uring_dispatcher_t* dispatcher, __uring_device_t* device)
+{
+    log_verbose("__uring_write:dispatcher=%p, device=%p", dispatcher, device);
+
+    struct io_uring_sqe* sqe = __uring_sqe(dispatcher, device, DISPATCHER_URING_WRITE);
+
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = device->fd;
+    sqe->addr = (uintptr_t) device->content;
+    sqe->len = strlen(device->content);
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = __uring_sqe(dispatcher, device, DISPATCHER_URING_CLOSE);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = device->fd;
+}
+
+/**
+ * Handles a complete response of the device.
+ */
+void __uring_on_response(__uring_dispatcher_t* dispatcher, __uring_device_t* device)
+{
+    log_verbose("__uring_on_response:dispatcher=%p, device=%p", dispatcher, device);
+
+    int status_ok;
+    config_data_t* config = dispatcher->config;
+    net_tcp_context_sync_t* sync = &device->sync;
+
+    if (!device->is_status) {
+        if (strcmp(config->eventhandler, "cooperative") == 0) {
+            __dispatcher_get_events(sync);
+            device->event_index = 0;
+            __uring_handle_events(dispatcher, device);
+            return;
+        }
+
+        __dispatcher_handle_events(config, sync);
+
+        pthread_mutex_lock(&sync->mutex);
+        device->is_parked = !sync->is_processed;
+        pthread_mutex_unlock(&sync->mutex);
+
+        if (device->is_parked) {
+            ++(dispatcher->parked);
+        }
+        else {
+            __uring_send(dispatcher, device, 1);
+        }
+
+        return;
+    }
+
+    status_ok = protocol_get_result_int(sync->read_payload, &sync->read_result);
+    protocol_free_parse(sync->read_payload);
+
+    if (status_ok < 0) {
+        log_check_r(status_ok, "__uring_on_response:protocol_get_result_int");
+    }
+
+    __uring_send(dispatcher, device, !status_ok);
+}
+
+/**
+ * Handles one completion.
+ */
+void __uring_on_complete(__uring_dispatcher_t* dispatcher, uint64_t user_data, int res)
+{
+    log_verbose("__uring_on_complete:dispatcher=%p, user_data=%lu, res=%d", dispatcher, user_data, res);
+
+    int r;
+    int op = user_data & DISPATCHER_URING_OP_MASK;
+    __uring_device_t* device = (__uring_device_t*) (uintptr_t) (user_data & ~(uint64_t) DISPATCHER_URING_OP_MASK);
+
+    if (device == NULL) {
+        // the timeout that wakes the dispatcher up for parked devices
+        dispatcher->is_timeout_armed = 0;
+        return;
+    }
+
+    if (res < 0 && op == DISPATCHER_URING_RECV && res == -ECANCELED) {
+        // the linked send failed and reports the error itself
+        return;
+    }
+
+    if (res < 0) {
+        log_check_uv_r(res, "__uring_on_complete");
+    }
+
+    switch (op) {
+        case DISPATCHER_URING_CONNECT:
+            __uring_send(dispatcher, device, 1);
+            break;
+        case DISPATCHER_URING_SEND:
+            if ((size_t) res != (device->is_status ? dispatcher->status_request : dispatcher->next_request)->len) {
+                log_check_r(EBNDS, "__uring_on_complete:send");
+            }
+            break;
+        case DISPATCHER_URING_RECV:
+            if (res == 0) {
+                log_check_r(ECLSD, "__uring_on_complete:recv");
+            }
+
+            device->sync.buf_len += res;
+            r = net_parse_buffered(&device->sync);
+
+            if (r == -EAGAIN) {
+                __uring_recv(dispatcher, device);
+                break;
+            }
+
+            log_check_r(r, "__uring_on_complete:net_parse_buffered");
+            __uring_on_response(dispatcher, device);
+            break;
+        case DISPATCHER_URING_OPEN:
+            device->fd = res;
+            __uring_write(dispatcher, device);
+            break;
+        case DISPATCHER_URING_WRITE:
+            break;
+        case DISPATCHER_URING_CLOSE:
+            free(device->content);
+            unlink(device->path);
+            log_event_done(&device->sync.events[device->event_index]);
+            ++(device->event_index);
+            __uring_handle_events(dispatcher, device);
+            break;
+    }
+}
+
+/**
+ * The uring dispatcher works like the epoll dispatcher, but every connect,
+ * send and read, and the file writes of the cooperative event handler, go
+ * through one io_uring. A request is linked to the read of its response, and
+ * the queue is submitted once per round together with the wait for
+ * completions, so a round costs one system call however many devices it
+ * serves. The device buffers are registered with the ring if the memory lock
+ * limit allows it.
+ */
+void dispatcher_uring(config_data_t* config, protocol_value_t* devices)
+{
+    log_verbose("dispatcher_uring:config=%p, devices=%p", config, devices);
+
+    int r;
+    int devices_len = protocol_get_length(devices);
+    __uring_device_t* devices_context[MACHINE_MAX_DEVICES];
+    struct iovec iovecs[MACHINE_MAX_DEVICES];
+    char* ts_addr = (char*) config->test_manager_address;
+    __uring_dispatcher_t* dispatcher = malloc(sizeof(__uring_dispatcher_t));
+    struct __kernel_timespec timeout = { .tv_sec = 0, .tv_nsec = 1000000 };
+
+    if (devices_len < 0) {
+        log_check_r(devices_len, "dispatcher_uring:protocol_get_length");
+    }
+
+    r = uring_init(&dispatcher->ring, URING_ENTRIES);
+    log_check_uv_r(r, "dispatcher_uring:uring_init");
+
+    dispatcher->config = config;
+    dispatcher->is_timeout_armed = 0;
+    dispatcher->parked = 0;
+
+    r = net_get_cached_request("status", config->encoding, &dispatcher->status_request);
+    log_check_r(r, "dispatcher_uring:net_get_cached_request");
+
+    dispatcher->next_request = __dispatcher_encode_next_event(config);
+
+    for (int i = 0; i < devices_len; ++i) {
+        protocol_value_t* port_value;
+        int device_port;
+        __uring_device_t* device = malloc(sizeof(__uring_device_t));
+
+        r = protocol_get_at(devices, &port_value, i);
+        log_check_r(r, "dispatcher_uring:protocol_get_at");
+
+        device_port = protocol_get_int(port_value);
+        if (device_port < 0) {
+            log_check_r(device_port, "dispatcher_uring:protocol_get_int");
+        }
+
+        r = net_tcp_context_sync_init(&device->sync, ts_addr, device_port, config);
+        log_check_r(r, "dispatcher_uring:net_tcp_context_sync_init");
+        device->sync.use_scan = 1;
+
+        device->sync.sock = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (device->sync.sock < 0) {
+            log_check_uv_r(-errno, "dispatcher_uring:socket");
+        }
+
+        device->index = i;
+        device->is_parked = 0;
+        devices_context[i] = device;
+        iovecs[i].iov_base = device->sync.buf;
+        iovecs[i].iov_len = NET_MAX_SIZE;
+    }
+
+    r = uring_register_buffers(&dispatcher->ring, iovecs, devices_len);
+    dispatcher->has_fixed_buffers = r == 0;
+
+    if (r) {
+        log_debug("dispatcher_uring:could not register buffers (%d), reading without them", r);
+    }
+
+    for (int i = 0; i < devices_len; ++i) {
+        __uring_device_t* device = devices_context[i];
+        struct io_uring_sqe* sqe = __uring_sqe(dispatcher, device, DISPATCHER_URING_CONNECT);
+
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = device->sync.sock;
+        sqe->addr = (uintptr_t) device->sync.addr;
+        sqe->off = sizeof(struct sockaddr_in);
+    }
+
+    while (1) {
+        struct io_uring_cqe* cqe;
+
+        // devices waiting for the thread pool are checked every millisecond
+        if (dispatcher->parked > 0 && !dispatcher->is_timeout_armed) {
+            struct io_uring_sqe* sqe = __uring_sqe(dispatcher, NULL, 0);
+
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uintptr_t) &timeout;
+            sqe->len = 1;
+            dispatcher->is_timeout_armed = 1;
+        }
+
+        r = uring_submit(&dispatcher->ring, 1);
+        log_check_uv_r(r, "dispatcher_uring:uring_submit");
+
+        while ((cqe = uring_peek_cqe(&dispatcher->ring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+
+            uring_cqe_seen(&dispatcher->ring);
+            __uring_on_complete(dispatcher, user_data, res);
+        }
+
+        for (int i = 0; dispatcher->parked > 0 && i < devices_len; ++i) {
+            __uring_device_t* device = devices_context[i];
+            int is_processed;
+
+            if (!device->is_parked) {
+                continue;
+            }
+
+            pthread_mutex_lock(&device->sync.mutex);
+            is_processed = device->sync.is_processed;
+            pthread_mutex_unlock(&device->sync.mutex);
+
+            if (is_processed) {
+                device->is_parked = 0;
+                --(dispatcher->parked);
+                __uring_send(dispatcher, device, 1);
+            }
+        }
+    }
+}
+
+#endif
+
+/**
+ * Starts the cooperative dispatch machine on loop for every device whose index
+ * falls in shard, out of shards.
+ */
+void __dispatcher_cooperative_start(
+        config_data_t* config,
+        protocol_value_t* devices,
+        const state_t* coop_dispatch,
+        uv_loop_t* loop,
+        int shard,
+        int shards)
+{
+    log_verbose("__dispatcher_cooperative_start:config=%p, devices=%p, loop=%p, shard=%d, shards=%d", config, devices, loop, shard, shards);
 
     int r;
-    uv_loop_t* loop = uv_default_loop();
-    state_t* coop_dispatch = machine_cooperative_dispatch();
     char* ts_addr = (char*) config->test_manager_address;
     int devices_length = protocol_get_length(devices);
+    net_encoded_t* next_request = __dispatcher_encode_next_event(config);
 
     if (devices_length < 0) {
         log_check_r(devices_length, "protocol_get_length");
     }
 
-    for (int i = 0; i < devices_length; ++i) {
+    for (int i = shard; i < devices_length; i += shards) {
         machine_coop_context_t* context = malloc(sizeof(machine_coop_context_t));
         protocol_value_t* port_value;
         int device_port;
 
         r = protocol_get_at(devices, &port_value, i);
-        log_check_r(r, "dispatcher_cooperative:protocol_get_at");
+        log_check_r(r, "__dispatcher_cooperative_start:protocol_get_at");
 
         device_port = protocol_get_int(port_value);
         if (device_port < 0) {
-            log_check_r(device_port, "dispatcher_cooperative:protocol_get_int");
+            log_check_r(device_port, "__dispatcher_cooperative_start:protocol_get_int");
         }
 
         r = net_tcp_context_init((net_tcp_context_t*) context, loop, ts_addr, device_port);
-        log_check_uv_r(r, "dispatcher_cooperative:net_tcp_context_init");
+        log_check_uv_r(r, "__dispatcher_cooperative_start:net_tcp_context_init");
 
         context->req_count = 0;
+        context->pipeline_pending = 0;
+        context->events_len = 0;
+        context->event_index = 0;
         context->config = config;
+        context->next_request = next_request;
+        context->tcp.keep_alive = config->keep_alive;
+        context->tcp.encoding = config->encoding;
+        context->tcp.use_arena = 1;
+        context->tcp.use_scan = 1;
 
         state_machine_run(coop_dispatch, context);
     }
+}
+
+/**
+ * One thread of the sharded cooperative dispatcher, with a loop of its own.
+ * The loop also keeps the read buffer pool of the shard.
+ */
+typedef struct {
+    config_data_t* config;
+    protocol_value_t* devices;
+    const state_t* coop_dispatch;
+    int shard;
+    uv_loop_t loop;
+    uv_thread_t thread;
+} __coop_shard_t;
+
+void __dispatcher_cooperative_shard(void* arg)
+{
+    log_verbose("__dispatcher_cooperative_shard:arg=%p", arg);
+
+    int r;
+    __coop_shard_t* shard = (__coop_shard_t*) arg;
+    config_data_t* config = shard->config;
+
+    r = log_init_thread();
+    log_check_uv_r(r, "__dispatcher_cooperative_shard:log_init_thread");
+
+    __dispatcher_cooperative_start(config, shard->devices, shard->coop_dispatch, &shard->loop, shard->shard, config->shards);
+    uv_run(&shard->loop, UV_RUN_DEFAULT);
+
+    pool_delete(&shard->loop);
+}
+
+/**
+ * The cooperative dispatcher utilizes the I/O-wait-time that occurs when a tcp
+ * package is being transfered to process other devices and events. With more
+ * than one shard the devices are split over as many threads, each running
+ * its own loop. The state machine is only read once built, so the shards
+ * share it.
+ */
+void dispatcher_cooperative(config_data_t* config, protocol_value_t* devices)
+{
+    log_verbose("dispatcher_cooperative:config=%p, devices=%p", config, devices);
+
+    int r;
+    uv_loop_t* loop = uv_default_loop();
+    const state_t* coop_dispatch = machine_cooperative_dispatch();
+    __coop_shard_t* shards;
+
+    if (config->shards == 1) {
+        __dispatcher_cooperative_start(config, devices, coop_dispatch, loop, 0, 1);
+        uv_run(loop, UV_RUN_DEFAULT);
+        pool_delete(loop);
+        return;
+    }
+
+    shards = calloc(config->shards, sizeof(__coop_shard_t));
+
+    for (int i = 0; i < config->shards; ++i) {
+        shards[i].config = config;
+        shards[i].devices = devices;
+        shards[i].coop_dispatch = coop_dispatch;
+        shards[i].shard = i;
+
+        r = uv_loop_init(&shards[i].loop);
+        log_check_uv_r(r, "dispatcher_cooperative:uv_loop_init");
+
+        r = uv_thread_create(&shards[i].thread, __dispatcher_cooperative_shard, &shards[i]);
+        log_check_uv_r(r, "dispatcher_cooperative:uv_thread_create");
+    }
+
+    for (int i = 0; i < config->shards; ++i) {
+        r = uv_thread_join(&shards[i].thread);
+        log_check_uv_r(r, "dispatcher_cooperative:uv_thread_join");
+    }
 
-    uv_run(loop, UV_RUN_DEFAULT);
+    free(shards);
 }
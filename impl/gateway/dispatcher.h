@@ -6,8 +6,17 @@
 #include "protocol.h"
 #include "conf.h"
 
+#define DISPATCHER_EPOLL_MAX_EVENTS 64
+#define DISPATCHER_MAX_SHARDS 64
+
 void dispatcher_serial(config_data_t* config, protocol_value_t* devices);
 
+void dispatcher_epoll(config_data_t* config, protocol_value_t* devices);
+
+#ifdef GATEWAY_URING
+void dispatcher_uring(config_data_t* config, protocol_value_t* devices);
+#endif
+
 void dispatcher_cooperative(config_data_t* config, protocol_value_t* devices);
 
 #endif
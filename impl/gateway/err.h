@@ -7,6 +7,9 @@
 #define EPTCL -4
 #define ENFND -5
 #define EBNDS -6
+#define ECLSD -7
+#define EMPCK -8
+#define ENSCL -9
 
 #define GW_ERRNO_MAP(XX) \
     XX(ENULL, "null pointer") \
@@ -15,6 +18,9 @@
     XX(EPTCL, "bad json protocol") \
     XX(ENFND, "not found") \
     XX(EBNDS, "out of bounds") \
+    XX(ECLSD, "connection closed") \
+    XX(EMPCK, "cannot parse msgpack") \
+    XX(ENSCL, "result is not a scalar") \
 
 const char* gw_strerror(int err);
 
@@ -85,7 +85,8 @@ void event_handler_make_io_path(char* buf)
 {
     static int count = 0;
 
-    sprintf(buf, "EVENT_HANDLER_IO_FILE_%d", count++);
+    // called from the thread pool and from every shard of the dispatcher
+    sprintf(buf, "EVENT_HANDLER_IO_FILE_%d", __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED));
 }
 
 void __do_io_sync(double intensity)
@@ -128,32 +129,53 @@ void event_handler_preemptive_init(config_data_t* config)
     event_handler_pool = thpool_init(config->tp_size);
 }
 
+/**
+ * One event of a device handed to the thread pool. The device is processed
+ * when all of its events are done.
+ */
+typedef struct {
+    net_tcp_context_sync_t* device;
+    int index;
+} __preemptive_work_t;
+
 void __do_preemptive_work(void* args)
 {
-    log_debug("__do_preemptive_work:args=%p");
+    log_debug("__do_preemptive_work:args=%p", args);
 
     pthread_mutex_lock(&event_handler_lock);
     --event_handler_queue_size;
     pthread_cond_signal(&event_handler_cond);
     pthread_mutex_unlock(&event_handler_lock);
 
-    net_tcp_context_sync_t* device = (net_tcp_context_sync_t*) args;
+    __preemptive_work_t* work = (__preemptive_work_t*) args;
+    net_tcp_context_sync_t* device = work->device;
     config_data_t* config = device->config;
 
     event_handler_do_cpu(config->cpu);
     __do_io_sync(config->io);
-    log_event_done((char*) device->event);
+    log_event_done(&device->events[work->index]);
 
     pthread_mutex_lock(&device->mutex);
-    device->is_processed = 1;
+    if (--device->events_pending == 0) {
+        device->is_processed = 1;
+    }
     pthread_mutex_unlock(&device->mutex);
+
+    free(work);
 }
 
-void event_handler_preemptive(net_tcp_context_sync_t* device)
+/**
+ * Hands event index of device to the thread pool. The caller marks the device
+ * as not processed and sets events_pending before handing over its events.
+ */
+void event_handler_preemptive(net_tcp_context_sync_t* device, int index)
 {
-    log_debug("event_handler_preemptive:device=%p", device);
+    log_debug("event_handler_preemptive:device=%p, index=%d", device, index);
+
+    __preemptive_work_t* work = malloc(sizeof(__preemptive_work_t));
 
+    work->device = device;
+    work->index = index;
     ++event_handler_queue_size;
-    device->is_processed = 0;
-    thpool_add_work(event_handler_pool, (void*) __do_preemptive_work, (void*) device);
+    thpool_add_work(event_handler_pool, (void*) __do_preemptive_work, (void*) work);
 }
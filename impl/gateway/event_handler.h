@@ -25,6 +25,6 @@ void event_handler_serial(double cpu_intensity, double io_intensity);
 
 void event_handler_preemptive_init(config_data_t* config);
 
-void event_handler_preemptive(net_tcp_context_sync_t* device);
+void event_handler_preemptive(net_tcp_context_sync_t* device, int index);
 
 #endif
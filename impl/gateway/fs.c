@@ -52,18 +52,18 @@ void __fs_on_open(uv_fs_t* req)
 }
 
 /**
- * Appends context->content to file context->path and closes it. The state with
- * edge edge_name is run after close.
+ * Appends context->content to file context->path and closes it. The state at
+ * edge is run after close.
  */
-int fs_append(fs_context_t* context, char* edge_name)
+int fs_append(fs_context_t* context, int edge)
 {
-    log_verbose("fs_append:context=%p, edge_name=\"%s\"", context, edge_name);
+    log_verbose("fs_append:context=%p, edge=\"%s\"", context, state_edge_name(edge));
 
     uv_loop_t* loop = context->loop;
     char* path = context->path;
     uv_fs_t* req = malloc(sizeof(uv_fs_t));
 
-    context->next_edge = edge_name;
+    context->next_edge = edge;
     req->data = context;
 
     return uv_fs_open(loop, req, path, UV_FS_O_WRONLY | UV_FS_O_CREAT, 0644, __fs_on_open);
@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include "log.h"
+#include "err.h"
 #include "state.h"
 #include "net.h"
 #include "conf.h"
@@ -10,6 +12,9 @@
 
 static machine_server_context_t server_context;
 static machine_boot_context_t boot_context;
+static uv_loop_t server_loop;
+static uv_signal_t exit_signals[2];
+static uv_sem_t test_started;
 
 void usage()
 {
@@ -21,7 +26,9 @@ void usage()
         "            The architecture of the event dispatcher. Can be one of the following:.\n"
         "                serial\n"
         "                preemptive\n"
-        "                cooperative\n\n"
+        "                cooperative\n"
+        "                epoll (serial and preemptive event handlers only)\n"
+        "                uring (if built with io_uring, see the Makefile)\n\n"
         "        -e <architecture>\n"
         "            The architecture of the event handler. Same alternatives as for the dispatcher.\n\n"
         "        -c <value>\n"
@@ -36,27 +43,114 @@ void usage()
         "            The port of the log server.\n\n"
         "        -p <value>\n"
         "            The size of the thread pool. Defaults to 10.\n\n"
+        "        -k\n"
+        "            Keep device connections open between requests instead of\n"
+        "            connecting once per request. Requests are newline delimited.\n\n"
+        "        -r <depth>\n"
+        "            Pipeline depth of the cooperative dispatcher. Writes the status\n"
+        "            request and depth next_event requests without waiting for the\n"
+        "            replies. Implies -k. Defaults to 0 (off).\n\n"
+        "        -b <size>\n"
+        "            Fetch up to size events per request with next_events instead\n"
+        "            of one per next_event. Defaults to 1.\n\n"
+        "        -s <shards>\n"
+        "            Split the devices of the cooperative dispatcher over this many\n"
+        "            threads, each running its own event loop. Defaults to 1.\n\n"
+        "        -w <encoding>\n"
+        "            The encoding of the requests the gateway sends, json or msgpack.\n"
+        "            Msgpack messages are length prefixed instead of newline\n"
+        "            delimited. Replies always come in the encoding of the request.\n"
+        "            Defaults to json.\n\n"
+        "        -m\n"
+        "            Count how often each state is entered, how long it runs and\n"
+        "            which edges it leaves by. The counters are printed on exit and\n"
+        "            returned by the get_stats method of the gateway server.\n\n"
         "";
 
     printf("%s\n", usage_str);
 }
 
-void on_handle_close(uv_handle_t* handle)
+/**
+ * Converts the summed state counters to a protocol type object, an array with
+ * an object for every state that has been run.
+ */
+int stats_to_protocol_type(protocol_value_t** protocol)
 {
-    log_verbose("on_handle_close:handle=%p", handle);
+    log_verbose("stats_to_protocol_type:protocol=%p", protocol);
 
-    free(handle);
+    state_stats_t* stats = malloc(sizeof(state_stats_t));
+
+    if (stats == NULL) {
+        return ENULL;
+    }
+
+    state_stats_collect(stats);
+    *protocol = json_array_new(0);
+
+    for (int i = 0; i < STATE_MAX_STATES; ++i) {
+        const state_t* state = state_get_by_id(i);
+        protocol_value_t* state_val;
+        protocol_value_t* histogram;
+        protocol_value_t* edges;
+
+        if (state == NULL || stats->entries[i] == 0) {
+            continue;
+        }
+
+        histogram = json_array_new(STATE_STATS_BUCKETS);
+        edges = json_object_new(0);
+
+        for (int j = 0; j < STATE_STATS_BUCKETS; ++j) {
+            json_array_push(histogram, json_integer_new(stats->histogram[i][j]));
+        }
+
+        for (int j = 0; j < STATE_EDGE_MAX; ++j) {
+            if (stats->transitions[i][j] > 0) {
+                json_object_push(edges, state_edge_name(j), json_integer_new(stats->transitions[i][j]));
+            }
+        }
+
+        state_val = json_object_new(0);
+        json_object_push(state_val, "state", json_string_new(state->name));
+        json_object_push(state_val, "entries", json_integer_new(stats->entries[i]));
+        json_object_push(state_val, "ns", json_integer_new(stats->ns[i]));
+        json_object_push(state_val, "histogram", histogram);
+        json_object_push(state_val, "edges", edges);
+        json_array_push(*protocol, state_val);
+    }
+
+    free(stats);
+
+    return 0;
 }
-void close_boot_process(uv_idle_t* handle)
+
+/**
+ * Exits on SIGINT and SIGTERM, so that the state counters are printed. Runs
+ * on the server loop rather than in a signal handler, so printing may
+ * allocate and take locks.
+ */
+void on_exit_signal(uv_signal_t* handle, int signum)
 {
-    log_verbose("close_boot_process:handle=%p", handle);
+    log_verbose("on_exit_signal:handle=%p, signum=%d", handle, signum);
+
+    exit(128 + signum);
+}
+
+/**
+ * Serves requests to the gateway server, for as long as the gateway runs.
+ * The log socket of the thread is never closed, as the thread lives as long
+ * as the process.
+ */
+void run_server(void* arg)
+{
+    log_verbose("run_server:arg=%p", arg);
 
     int r;
-    uv_tcp_t* server_handle = server_context.tcp.handle;
 
-    uv_close((uv_handle_t*) server_handle, on_handle_close);
-    r = uv_idle_stop(handle);
-    log_check_uv_r(r, "uv_idle_stop");
+    r = log_init_thread();
+    log_check_uv_r(r, "run_server:log_init_thread");
+
+    uv_run(&server_loop, UV_RUN_DEFAULT);
 }
 
 protocol_value_t* on_request(protocol_value_t* request)
@@ -66,36 +160,34 @@ protocol_value_t* on_request(protocol_value_t* request)
     int r;
     protocol_value_t* response = NULL;
 
-    if (protocol_has_key(request, "method") && protocol_has_key(request, "args")) {
-        protocol_value_t* method;
-        protocol_value_t* result;
-        char method_str[NET_MAX_SIZE] = { 0 };
+    protocol_value_t* method = protocol_find_key(request, &protocol_key_method);
 
-        r = protocol_get_key(request, &method, "method");
-        log_check_r(r, "protocol_get_key");
+    if (method != NULL && protocol_find_key(request, &protocol_key_args) != NULL) {
+        protocol_value_t* result;
+        protocol_string_t method_str;
 
-        r = protocol_get_string(method, (char*) &method_str);
-        log_check_r(r, "protocol_get_string");
+        r = protocol_get_string_view(method, &method_str);
+        log_check_r(r, "protocol_get_string_view");
 
-        if (strcmp(method_str, "get_timestamp") == 0) {
+        if (protocol_string_equals(&method_str, "get_timestamp")) {
             r = protocol_build_int(&result, get_timestamp());
             log_check_r(r, "protocol_build_int");
 
             r = protocol_build_response_success(&response, result);
             log_check_r(r, "protocol_build_response_success");
         }
-        else if (strcmp(method_str, "start_test") == 0) {
-            uv_idle_t* handle = malloc(sizeof(uv_idle_t));
-            uv_loop_t* loop = uv_default_loop();
+        else if (protocol_string_equals(&method_str, "get_stats")) {
+            r = stats_to_protocol_type(&result);
+            log_check_r(r, "stats_to_protocol_type");
 
+            r = protocol_build_response_success(&response, result);
+            log_check_r(r, "protocol_build_response_success");
+        }
+        else if (protocol_string_equals(&method_str, "start_test")) {
             r = protocol_build_int(&result, 0);
             log_check_r(r, "protocol_build_int");
 
-            r = uv_idle_init(loop, handle);
-            log_check_uv_r(r, "uv_idle_init");
-
-            r = uv_idle_start(handle, close_boot_process);
-            log_check_uv_r(r, "uv_idle_start");
+            uv_sem_post(&test_started);
 
             r = protocol_build_response_success(&response, result);
             log_check_r(r, "protocol_build_response_success");
@@ -119,18 +211,43 @@ void prepare_test(config_data_t* config, protocol_value_t** devices)
 
     int r;
     uv_loop_t* loop = uv_default_loop();
-    state_t* boot_process;
-    state_t* server;
+    uv_thread_t server_thread;
+    const state_t* boot_process;
+    const state_t* server;
+    int signums[2] = { SIGINT, SIGTERM };
 
     r = log_init(loop, config->test_manager_address, config->logserver_port);
     log_check_uv_r(r, "log_init");
 
+    r = uv_sem_init(&test_started, 0);
+    log_check_uv_r(r, "uv_sem_init");
+
+    r = uv_loop_init(&server_loop);
+    log_check_uv_r(r, "uv_loop_init");
+
+    if (config->stats) {
+        for (int i = 0; i < 2; ++i) {
+            r = uv_signal_init(&server_loop, &exit_signals[i]);
+            log_check_uv_r(r, "uv_signal_init");
+
+            r = uv_signal_start(&exit_signals[i], on_exit_signal, signums[i]);
+            log_check_uv_r(r, "uv_signal_start");
+        }
+    }
+
+    // the server keeps running on a thread of its own during the test, so
+    // that get_stats is answered while the dispatcher runs
     boot_process = machine_boot_process(&boot_context, loop, config, (net_tcp_context_t*) &server_context);
-    server = machine_tcp_server(&server_context, loop, on_request);
+    server = machine_tcp_server(&server_context, &server_loop, on_request);
 
     state_machine_run(server, &server_context);
+
+    r = uv_thread_create(&server_thread, run_server, NULL);
+    log_check_uv_r(r, "uv_thread_create");
+
     state_machine_run(boot_process, &boot_context);
     uv_run(loop, UV_RUN_DEFAULT);
+    uv_sem_wait(&test_started);
 
     // delete states
 
@@ -158,6 +275,18 @@ void start_test(config_data_t* config, protocol_value_t* devices)
     else if (strcmp(dispatcher_type, "cooperative") == 0) {
         dispatcher_cooperative(config, devices);
     }
+    else if (strcmp(dispatcher_type, "epoll") == 0) {
+        dispatcher_epoll(config, devices);
+    }
+#ifdef GATEWAY_URING
+    else if (strcmp(dispatcher_type, "uring") == 0) {
+        dispatcher_uring(config, devices);
+    }
+#endif
+    else {
+        log_error("start_test:no support for dispatcher \"%s\"", dispatcher_type);
+        exit(1);
+    }
 }
 
 int main(int argc, char** argv)
@@ -175,11 +304,17 @@ int main(int argc, char** argv)
         return 0;
     }
 
-    while ((input_flag = getopt(argc, argv, "hd:e:c:i:p:t:l:n:")) != -1) {
+    while ((input_flag = getopt(argc, argv, "hkmd:e:c:i:p:t:l:n:r:b:s:w:")) != -1) {
         switch (input_flag) {
             case 'h':
                 usage();
                 return 0;
+            case 'k':
+                config.keep_alive = 1;
+                break;
+            case 'm':
+                config.stats = 1;
+                break;
             case 'd':
                 config.dispatcher = optarg;
                 break;
@@ -210,12 +345,58 @@ int main(int argc, char** argv)
                 break;
             case 'n':
                 config.nameservice_port = atoi(optarg);
+                break;
+            case 'r':
+                config.pipeline = atoi(optarg);
+
+                if (config.pipeline < 0 || config.pipeline >= NET_MAX_PIPELINE) {
+                    log_error("pipeline depth must be between 0 and %d", NET_MAX_PIPELINE - 1);
+                    return 1;
+                }
+
+                config.keep_alive = config.keep_alive || config.pipeline > 0;
+                break;
+            case 'b':
+                config.batch = atoi(optarg);
+
+                if (config.batch < 1 || config.batch > NET_MAX_EVENTS) {
+                    log_error("batch size must be between 1 and %d", NET_MAX_EVENTS);
+                    return 1;
+                }
+
+                break;
+            case 's':
+                config.shards = atoi(optarg);
+
+                if (config.shards < 1 || config.shards > DISPATCHER_MAX_SHARDS) {
+                    log_error("number of shards must be between 1 and %d", DISPATCHER_MAX_SHARDS);
+                    return 1;
+                }
+
+                break;
+            case 'w':
+                if (strcmp(optarg, "json") == 0) {
+                    config.encoding = PROTOCOL_JSON;
+                }
+                else if (strcmp(optarg, "msgpack") == 0) {
+                    config.encoding = PROTOCOL_MSGPACK;
+                }
+                else {
+                    log_error("encoding must be json or msgpack");
+                    return 1;
+                }
+
                 break;
             default:
                 break;
         }
     }
 
+    if (config.stats) {
+        state_stats_enable();
+        atexit(state_stats_print);
+    }
+
     prepare_test(&config, &devices);
     start_test(&config, devices);
 
@@ -8,11 +8,13 @@
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <errno.h>
 #include "log.h"
 #include "uv.h"
 #include "err.h"
 
 int udp_sock = -1;
+__thread int thread_udp_sock = -1;
 struct sockaddr_in remote_addr;
 
 /**
@@ -66,6 +68,24 @@ int log_init(uv_loop_t* loop, const char* address, const int port)
     return 0;
 }
 
+/**
+ * Gives the calling thread a udp socket of its own to the log server set up
+ * by log_init, so that threads running their own loops do not share one.
+ * Returns -errno if the socket cannot be created.
+ */
+int log_init_thread()
+{
+    log_verbose("log_init_thread");
+
+    thread_udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (thread_udp_sock < 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
 /**
  * Returns the current timestamp in ms.
  */
@@ -111,8 +131,9 @@ void on_send_cb(uv_udp_send_t* req, int status)
 void log_send(char* message)
 {
     int r = 0;
+    int sock = thread_udp_sock >= 0 ? thread_udp_sock : udp_sock;
 
-    r = sendto(udp_sock, message, strlen(message), 0, (struct sockaddr*) &remote_addr, sizeof(remote_addr));
+    r = sendto(sock, message, strlen(message), 0, (struct sockaddr*) &remote_addr, sizeof(remote_addr));
 
     if (r == -1) {
         printf("ERROR:log_send:sendto:-1");
@@ -143,17 +164,29 @@ void log_write(const char* level, const char* format, ...)
     }
 }
 
-void log_event_retrieved(char* event_id)
+/**
+ * Logs the lifecycle step of event. This is the only place event ids are
+ * turned back into text.
+ */
+void __log_event(const char* step, protocol_event_t* event)
+{
+    char event_id[PROTOCOL_EVENT_STR_LEN];
+
+    protocol_format_event(event, event_id);
+    log_info("gateway:EVENT_LIFECYCLE_%s:%s", step, event_id);
+}
+
+void log_event_retrieved(protocol_event_t* event)
 {
-    log_info("gateway:EVENT_LIFECYCLE_RETRIEVED:%s", event_id);
+    __log_event("RETRIEVED", event);
 }
 
-void log_event_dispatched(char* event_id)
+void log_event_dispatched(protocol_event_t* event)
 {
-    log_info("gateway:EVENT_LIFECYCLE_DISPATCHED:%s", event_id);
+    __log_event("DISPATCHED", event);
 }
 
-void log_event_done(char* event_id)
+void log_event_done(protocol_event_t* event)
 {
-    log_info("gateway:EVENT_LIFECYCLE_DONE:%s", event_id);
+    __log_event("DONE", event);
 }
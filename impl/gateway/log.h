@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include "uv.h"
+#include "protocol.h"
 
 #ifndef LOGLEVEL
 #define LOGLEVEL 4
@@ -16,17 +17,19 @@ void log_check_r(int r, char* msg);
 
 int log_init(uv_loop_t* loop, const char* address, const int port);
 
+int log_init_thread();
+
 unsigned long long get_timestamp();
 
 void log_format(char* buf, const char* level, const char* format, va_list args);
 
 void log_write(const char* level, const char* format, ...);
 
-void log_event_retrieved(char* event_id);
+void log_event_retrieved(protocol_event_t* event);
 
-void log_event_dispatched(char* event_id);
+void log_event_dispatched(protocol_event_t* event);
 
-void log_event_done(char* event_id);
+void log_event_done(protocol_event_t* event);
 
 #define log_error(M, ...) log_write("ERROR", M, ##__VA_ARGS__)
 #define log_info(M, ...) log_write("INFO", M, ##__VA_ARGS__)
@@ -7,71 +7,146 @@
 #include "err.h"
 #include "event_handler.h"
 
-void __tcp_request_connecting(state_t* state, void* payload)
+/**
+ * The tcp request machine connects, writes context->write_payload, reads the
+ * reply and closes the connection. It is a part of other machines, so its
+ * states are named with a prefix, and the machine it is part of gives the
+ * callback and the edges of the done state.
+ */
+#define MACHINE_TCP_REQUEST(XX, prefix, done, ...) \
+    XX(prefix##_tcp_request_connecting, __tcp_request_connecting, \
+            STATE_TO(CONNECT, prefix##_tcp_request_writing)) \
+    XX(prefix##_tcp_request_writing, __tcp_request_writing, \
+            STATE_TO(DONE, prefix##_tcp_request_reading)) \
+    XX(prefix##_tcp_request_reading, __tcp_request_reading, \
+            STATE_TO(DONE, prefix##_tcp_request_closing)) \
+    XX(prefix##_tcp_request_closing, __tcp_request_closing, \
+            STATE_TO(DONE, prefix##_tcp_request_done)) \
+    XX(prefix##_tcp_request_done, done, __VA_ARGS__)
+
+#define MACHINE_BOOT_PROCESS(XX) \
+    XX(boot_process_verify_config, __boot_process_verify_config, \
+            STATE_TO(START, boot_tcp_request_connecting)) \
+    XX(boot_process_check_verification, __boot_process_check_verification, \
+            STATE_TO(DONE, boot_process_get_devices)) \
+    XX(boot_process_get_devices, __boot_process_get_devices, \
+            STATE_TO(START, boot_tcp_request_connecting)) \
+    XX(boot_process_done, __boot_process_done, ) \
+    MACHINE_TCP_REQUEST(XX, boot, __boot_process_tcp_done, \
+            STATE_TO(VERIFICATION_RESPONSE, boot_process_check_verification) \
+            STATE_TO(DEVICES_RESPONSE, boot_process_done))
+
+#define MACHINE_TCP_SERVER(XX) \
+    XX(server_listening, __server_listening, \
+            STATE_TO(CONNECT, server_connecting)) \
+    XX(server_connecting, __server_connecting, \
+            STATE_TO(PROCESS, server_processing) \
+            STATE_TO(DISCONNECT, server_disconnecting)) \
+    XX(server_processing, __server_processing, \
+            STATE_TO(DONE, server_write_done)) \
+    XX(server_write_done, __server_write_done, \
+            STATE_TO(READ, server_connecting)) \
+    XX(server_disconnecting, __server_disconnecting, \
+            STATE_TO(CLEAN, server_cleaning)) \
+    XX(server_cleaning, __server_cleaning, )
+
+#define MACHINE_COOPERATIVE_DISPATCH(XX) \
+    XX(coop_dispatch_status, __coop_dispatch_status, \
+            STATE_TO(STATUS, coop_tcp_request_connecting) \
+            STATE_TO(READ, coop_tcp_request_reading)) \
+    XX(coop_dispatch_next_event, __coop_dispatch_next_event, \
+            STATE_TO(NEXT_EVENT, coop_tcp_request_connecting)) \
+    XX(coop_dispatch_process, __coop_dispatch_process, \
+            STATE_TO(HANDLE, coop_dispatch_handle_event) \
+            STATE_TO(DONE, coop_dispatch_status)) \
+    XX(coop_dispatch_handle_event, __coop_dispatch_handle_event, \
+            STATE_TO(HANDLE_IO, coop_dispatch_handle_io) \
+            STATE_TO(DONE, coop_dispatch_event_done)) \
+    XX(coop_dispatch_handle_io, __coop_dispatch_handle_io, \
+            STATE_TO(HANDLE_IO, coop_dispatch_handle_io) \
+            STATE_TO(DONE, coop_dispatch_event_done)) \
+    XX(coop_dispatch_event_done, __coop_dispatch_event_done, \
+            STATE_TO(NEXT, coop_dispatch_handle_event) \
+            STATE_TO(DONE, coop_dispatch_status)) \
+    MACHINE_TCP_REQUEST(XX, coop, __coop_dispatch_tcp_done, \
+            STATE_TO(READ, coop_tcp_request_reading) \
+            STATE_TO(STATUS_OK, coop_dispatch_next_event) \
+            STATE_TO(STATUS_NOT_OK, coop_dispatch_status) \
+            STATE_TO(PROCESS, coop_dispatch_process))
+
+enum {
+    MACHINE_STATES_BASE = STATE_BASE_MACHINE - 1,
+    MACHINE_BOOT_PROCESS(STATE_ID)
+    MACHINE_TCP_SERVER(STATE_ID)
+    MACHINE_COOPERATIVE_DISPATCH(STATE_ID)
+    MACHINE_STATES
+};
+
+_Static_assert(MACHINE_STATES <= STATE_BASE_TEST, "more machine states than machine state ids");
+
+/**
+ * Connects to the remote host. A kept alive context that is still connected
+ * goes straight to writing.
+ */
+void __tcp_request_connecting(const state_t* state, void* payload)
 {
     log_verbose("__tcp_request_connecting:state=%p, payload=%p", state, payload);
 
     int r;
     net_tcp_context_t* context = net_get_context(state, payload);
 
-    r = net_connect(context, "connect");
+    if (context->keep_alive && context->handle != NULL) {
+        state_run_next(state, STATE_EDGE_CONNECT, context);
+        return;
+    }
+
+    r = net_connect(context, STATE_EDGE_CONNECT);
     log_check_uv_r(r, "req_connect");
 }
 
-void __tcp_request_writing(state_t* state, void* payload)
+void __tcp_request_writing(const state_t* state, void* payload)
 {
     log_verbose("__tcp_request_writing:state=%p, payload=%p", state, payload);
 
     int r;
     net_tcp_context_t* context = net_get_context(state, payload);
 
-    r = net_write(context, "done");
+    r = net_serialize(context);
+    log_check_r(r, "net_serialize");
+
+    r = net_write(context, STATE_EDGE_DONE);
     log_check_uv_r(r, "net_write");
 }
 
-void __tcp_request_reading(state_t* state, void* payload)
+void __tcp_request_reading(const state_t* state, void* payload)
 {
     log_verbose("__tcp_request_reading:state=%p, payload=%p", state, payload);
 
     net_tcp_context_t* context = net_get_context(state, payload);
-    net_read(context, "done", NULL);
+    net_read(context, STATE_EDGE_DONE, STATE_EDGE_NONE);
 }
 
-void __tcp_request_closing(state_t* state, void* payload)
+/**
+ * Closes the connection, unless the context is kept alive in which case the
+ * connection is left open for the next request.
+ */
+void __tcp_request_closing(const state_t* state, void* payload)
 {
     log_verbose("__tcp_request_closing:state=%p, payload=%p", state, payload);
 
     int r = 0;
     net_tcp_context_t* context = net_get_context(state, payload);
 
-    r = net_disconnect(context, "done");
-    log_check_uv_r(r, "net_disconnect");
-}
+    if (context->keep_alive) {
+        state_run_next(state, STATE_EDGE_DONE, context);
+        return;
+    }
 
-state_t* machine_tcp_request(state_lookup_t* lookup, state_callback done)
-{
-    log_verbose("__machine_tcp_request:lookup=%p, done=%p", lookup, done);
-
-    const state_initializer_t si[] = {
-        { .name = "tcp_request_connecting", .callback = __tcp_request_connecting },
-        { .name = "tcp_request_writing", .callback = __tcp_request_writing },
-        { .name = "tcp_request_reading", .callback = __tcp_request_reading },
-        { .name = "tcp_request_closing", .callback = __tcp_request_closing },
-        { .name = "tcp_request_done", .callback = done }
-    };
-    const edge_initializer_t ei[] = {
-        { .name = "connect", .from = "tcp_request_connecting", .to = "tcp_request_writing" },
-        { .name = "done", .from = "tcp_request_writing", .to = "tcp_request_reading" },
-        { .name = "done", .from = "tcp_request_reading", .to = "tcp_request_closing" },
-        { .name = "done", .from = "tcp_request_closing", .to = "tcp_request_done" }
-    };
-    const int nsi = sizeof(si) / sizeof(si[0]);
-    const int nei = sizeof(ei) / sizeof(ei[0]);
-
-    return state_machine_build(si, nsi, ei, nei, lookup);
+    r = net_disconnect(context, STATE_EDGE_DONE);
+    log_check_uv_r(r, "net_disconnect");
 }
 
-void __boot_process_verify_config(state_t* state, void* payload) {
+void __boot_process_verify_config(const state_t* state, void* payload) {
     log_verbose("__boot_process_verify_config:state=%p, payload=%p", state, payload);
 
     int r;
@@ -98,27 +173,21 @@ void __boot_process_verify_config(state_t* state, void* payload) {
     log_check_r(r, "protocol_build_request");
 
     ((net_tcp_context_t*) context)->write_payload = request;
-    state_run_next(state, "start", context);
+    state_run_next(state, STATE_EDGE_START, context);
 }
 
-void __boot_process_check_verification(state_t* state, void* payload) {
+void __boot_process_check_verification(const state_t* state, void* payload) {
     log_verbose("__boot_process_check_verification:state=%p, payload=%p", state, payload);
 
-    int r;
     net_tcp_context_t* context = (net_tcp_context_t*) payload;
     protocol_value_t* response = context->read_payload;
+    protocol_value_t* result_obj;
 
-    protocol_free_build(context->write_payload);
     protocol_check_response_error(response);
+    result_obj = protocol_find_key(response, &protocol_key_result);
 
-    if (protocol_has_key(response, "result")) {
-        protocol_value_t* result_obj;
-        int result;
-
-        r = protocol_get_key(response, &result_obj, "result");
-        log_check_r(r, "protocol_get_key");
-
-        result = protocol_get_bool(result_obj);
+    if (result_obj != NULL) {
+        int result = protocol_get_bool(result_obj);
 
         if (result < 0) {
             log_check_r(result, "protocol_get_bool");
@@ -127,7 +196,7 @@ void __boot_process_check_verification(state_t* state, void* payload) {
         if (result == 1) {
             log_info("config verification ok!");
             protocol_free_parse(response);
-            state_run_next(state, "done", context);
+            state_run_next(state, STATE_EDGE_DONE, context);
         }
         else {
             log_error("config verification not ok!");
@@ -139,7 +208,7 @@ void __boot_process_check_verification(state_t* state, void* payload) {
     }
 }
 
-void __boot_process_get_devices(state_t* state, void* payload) {
+void __boot_process_get_devices(const state_t* state, void* payload) {
     log_verbose("__boot_process_get_devices:state=%p, payload=%p", state, payload);
 
     int r;
@@ -150,38 +219,39 @@ void __boot_process_get_devices(state_t* state, void* payload) {
     log_check_r(r, "protocol_build_request");
 
     context->write_payload = request;
-    state_run_next(state, "start", context);
+    state_run_next(state, STATE_EDGE_START, context);
 }
 
-void __boot_process_done(state_t* state, void* payload) {
+void __boot_process_done(const state_t* state, void* payload) {
     log_verbose("__boot_process_done:state=%p, payload=%p", state, payload);
 
     machine_boot_context_t* context = (machine_boot_context_t*) payload;
     protocol_value_t* response = ((net_tcp_context_t*) context)->read_payload;
-    protocol_value_t* request = ((net_tcp_context_t*) context)->write_payload;
 
     protocol_check_response_error(response);
-    protocol_free_build(request);
 }
 
-void __boot_process_tcp_done(state_t* state, void* payload) {
+void __boot_process_tcp_done(const state_t* state, void* payload) {
     log_verbose("__boot_process_tcp_done:state=%p, payload=%p", state, payload);
 
     machine_boot_context_t* context = (machine_boot_context_t*) payload;
     static int count = 0;
 
     if (count++ == 0) {
-        state_run_next(state, "verification_response", context);
+        state_run_next(state, STATE_EDGE_VERIFICATION_RESPONSE, context);
     } else {
-        state_run_next(state, "devices_response", context);
+        state_run_next(state, STATE_EDGE_DEVICES_RESPONSE, context);
     }
 }
 
+MACHINE_BOOT_PROCESS(STATE_DECLARE)
+MACHINE_BOOT_PROCESS(STATE_DEFINE)
+
 /**
  * Create a boot state machine that initiates the gateway with its surrounding
  * test systems.
  */
-state_t* machine_boot_process(
+const state_t* machine_boot_process(
         machine_boot_context_t* context,
         uv_loop_t* loop,
         config_data_t* config,
@@ -195,32 +265,9 @@ state_t* machine_boot_process(
             server_context);
 
     int r;
-    state_t* boot_process;
-    state_lookup_t lookup;
     char* nameservice_address;
     int nameservice_port;
 
-    const state_initializer_t si[] = {
-        { .name = "boot_process_verify_config", .callback = __boot_process_verify_config },
-        { .name = "boot_process_check_verification", .callback = __boot_process_check_verification },
-        { .name = "boot_process_get_devices", .callback = __boot_process_get_devices },
-        { .name = "boot_process_done", .callback = __boot_process_done }
-    };
-    const edge_initializer_t ei[] = {
-        { .name = "start", .from = "boot_process_verify_config", .to = "tcp_request_connecting" },
-        { .name = "verification_response", .from = "tcp_request_done", .to = "boot_process_check_verification" },
-        { .name = "done", .from = "boot_process_check_verification", .to = "boot_process_get_devices" },
-        { .name = "start", .from = "boot_process_get_devices", .to = "tcp_request_connecting" },
-        { .name = "devices_response", .from = "tcp_request_done", .to = "boot_process_done" }
-    };
-    const int nsi = sizeof(si) / sizeof(si[0]);
-    const int nei = sizeof(ei) / sizeof(ei[0]);
-
-    lookup_init(&lookup);
-    machine_tcp_request(&lookup, __boot_process_tcp_done);
-    boot_process = state_machine_build(si, nsi, ei, nei, &lookup);
-    lookup_clear(&lookup);
-
     nameservice_address = (char*) config->test_manager_address;
     nameservice_port = config->nameservice_port;
 
@@ -229,22 +276,23 @@ state_t* machine_boot_process(
 
     context->config = config;
     context->server_context = server_context;
+    context->tcp.encoding = config->encoding;
 
-    return boot_process;
+    return &boot_process_verify_config;
 }
 
-void __server_listening(state_t* state, void* payload)
+void __server_listening(const state_t* state, void* payload)
 {
     log_verbose("__server_listening:state=%p, payload=%p", state, payload);
 
     int r;
     net_tcp_context_t* context = net_get_context(state, payload);
 
-    r = net_listen(context, "connect");
+    r = net_listen(context, STATE_EDGE_CONNECT);
     log_check_uv_r(r, "net_listen");
 }
 
-void __server_connecting(state_t* state, void* payload)
+void __server_connecting(const state_t* state, void* payload)
 {
     log_verbose("__server_connecting:state=%p, payload=%p", state, payload);
 
@@ -261,22 +309,24 @@ void __server_connecting(state_t* state, void* payload)
 
     if (r) {
         log_error("could not accept connection (%d)", r);
-        r = net_disconnect((net_tcp_context_t*) client_context, "disconnect");
+        r = net_disconnect((net_tcp_context_t*) client_context, STATE_EDGE_DISCONNECT);
         log_check_uv_r(r, "net_disconnect");
     }
 
     ((net_tcp_context_t*) client_context)->handle = client_handle;
     ((net_tcp_context_t*) client_context)->state = state;
-    ((net_tcp_context_t*) client_context)->buf_len = NET_MAX_SIZE;
+    ((net_tcp_context_t*) client_context)->buf_size = NET_MAX_SIZE;
     ((net_tcp_context_t*) client_context)->buf = calloc(1, NET_MAX_SIZE);
+    arena_init(&((net_tcp_context_t*) client_context)->arena);
+    ((net_tcp_context_t*) client_context)->use_arena = 1;
 
     client_context->on_request = server_context->on_request;
     client_handle->data = client_context;
-    r = net_read((net_tcp_context_t*) client_context, "process", "disconnect");
+    r = net_read((net_tcp_context_t*) client_context, STATE_EDGE_PROCESS, STATE_EDGE_DISCONNECT);
     log_check_uv_r(r, "net_read");
 }
 
-void __server_processing(state_t* state, void* payload)
+void __server_processing(const state_t* state, void* payload)
 {
     log_verbose("__server_processing:state=%p, payload=%p", state, payload);
 
@@ -296,56 +346,75 @@ void __server_processing(state_t* state, void* payload)
         response = (*on_request)(request);
     }
 
-    protocol_free_parse(request);
+    net_free_read_payload((net_tcp_context_t*) context);
     ((net_tcp_context_t*) context)->write_payload = response;
-    net_write((net_tcp_context_t*) context, "done");
+    r = net_serialize((net_tcp_context_t*) context);
+
+    // a response that is too large to send is answered with an error instead
+    if (r == EBNDS) {
+        log_error("__server_processing:response larger than %d bytes", NET_MAX_MESSAGE_SIZE);
+
+        r = protocol_build_response_error(&response, "ProtocolError", "Response too large");
+        log_check_r(r, "protocol_build_response_error");
+
+        ((net_tcp_context_t*) context)->write_payload = response;
+        r = net_serialize((net_tcp_context_t*) context);
+    }
+
+    log_check_r(r, "__server_processing:net_serialize");
+
+    r = net_write((net_tcp_context_t*) context, STATE_EDGE_DONE);
+    log_check_uv_r(r, "__server_processing:net_write");
 }
 
-void __server_write_done(state_t* state, void* payload)
+void __server_write_done(const state_t* state, void* payload)
 {
     log_verbose("__server_write_done:state=%p, payload=%p", state, payload);
 
     int r;
     net_tcp_context_t* context = net_get_context(state, payload);
-    state_t* connecting_state = NULL;
+    const state_t* connecting_state = NULL;
 
-    if (context->write_payload != NULL) {
-        protocol_free_build(context->write_payload);
-    }
-
-    r = state_next(context->state, &connecting_state, "read");
+    r = state_next(context->state, &connecting_state, STATE_EDGE_READ);
     log_check_r(r, "state_next");
 
-    // reset state without running the callback
+    // reset state without running the callback and wait for the next request
     context->state = connecting_state;
+    r = net_read(context, STATE_EDGE_PROCESS, STATE_EDGE_DISCONNECT);
+    log_check_uv_r(r, "net_read");
 }
 
-void __server_disconnecting(state_t* state, void* payload)
+void __server_disconnecting(const state_t* state, void* payload)
 {
     log_verbose("__server_disconnecting:state=%p, payload=%p", state, payload);
 
     int r;
     net_tcp_context_t* context = net_get_context(state, payload);
 
-    r = net_disconnect(context, "clean");
+    r = net_disconnect(context, STATE_EDGE_CLEAN);
     log_check_uv_r(r, "net_disconnect");
 }
 
-void __server_cleaning(state_t* state, void* payload)
+void __server_cleaning(const state_t* state, void* payload)
 {
     log_verbose("__server_cleaning:state=%p, payload=%p", state, payload);
 
     net_tcp_context_t* context = net_get_context(state, payload);
 
     free(context->buf);
+    ring_free(&context->rbuf);
+    arena_free(&context->arena);
     free(context);
 }
 
+MACHINE_TCP_SERVER(STATE_DECLARE)
+MACHINE_TCP_SERVER(STATE_DEFINE)
+
 /**
  * Creates a tcp server state machine that listens for tcp connections, reads
  * their data and responds according to on_request.
  */
-state_t* machine_tcp_server(
+const state_t* machine_tcp_server(
         machine_server_context_t* context,
         uv_loop_t* loop,
         request_callback on_request)
@@ -353,68 +422,60 @@ state_t* machine_tcp_server(
     log_verbose("machine_tcp_server:context=%p, loop=%p, on_request=%p", context, loop, on_request);
 
     int r;
-    state_t* server;
-    state_lookup_t lookup;
-
-    const state_initializer_t si[] = {
-        { .name = "server_listening", .callback = __server_listening },
-        { .name = "server_connecting", .callback = __server_connecting },
-        { .name = "server_processing", .callback = __server_processing },
-        { .name = "server_write_done", .callback = __server_write_done },
-        { .name = "server_disconnecting", .callback = __server_disconnecting },
-        { .name = "server_cleaning", .callback = __server_cleaning },
-    };
-    const edge_initializer_t ei[] = {
-        { .name = "connect", .from = "server_listening", .to = "server_connecting" },
-        { .name = "process", .from = "server_connecting", .to = "server_processing" },
-        { .name = "disconnect", .from = "server_connecting", .to = "server_disconnecting" },
-        { .name = "done", .from = "server_processing", .to = "server_write_done" },
-        { .name = "read", .from = "server_write_done", .to = "server_connecting" },
-        { .name = "clean", .from = "server_disconnecting", .to = "server_cleaning" }
-    };
-    const int nsi = sizeof(si) / sizeof(si[0]);
-    const int nei = sizeof(ei) / sizeof(ei[0]);
-
-    lookup_init(&lookup);
-    server = state_machine_build(si, nsi, ei, nei, &lookup);
-    lookup_clear(&lookup);
 
     r = net_tcp_context_init((net_tcp_context_t*) context, loop, LOCAL_ETH_ADDR, SERVER_PORT);
     log_check_uv_r(r, "net_tcp_context_init");
 
     context->on_request = on_request;
 
-    return server;
+    return &server_listening;
 }
 
-void __coop_dispatch_status(state_t* state, void* payload)
+/**
+ * Polls the device status. When pipelining, the status request is followed by
+ * config->pipeline next_event requests without waiting for any reply, and the
+ * state goes back to reading until every reply of the round has been handled.
+ * The requests never change, so they are written from bytes encoded once.
+ */
+void __coop_dispatch_status(const state_t* state, void* payload)
 {
     log_verbose("__coop_dispatch_status:state=%p, payload=%p", state, payload);
 
     int r;
+    machine_coop_context_t* coop_context = (machine_coop_context_t*) payload;
     net_tcp_context_t* context = net_get_context(state, payload);
-    protocol_value_t* request;
+    config_data_t* config = coop_context->config;
 
-    r = protocol_build_request(&request, "status", 0);
-    log_check_r(r, "__coop_dispatch_status:protocol_build_request");
+    if (coop_context->pipeline_pending > 0) {
+        state_run_next(state, STATE_EDGE_READ, context);
+        return;
+    }
 
-    context->write_payload = request;
-    state_run_next(state, "status", context);
+    r = net_get_cached_request("status", context->encoding, &context->write_encoded);
+    log_check_r(r, "__coop_dispatch_status:net_get_cached_request");
+
+    if (config->pipeline > 0) {
+        for (int i = 0; i < config->pipeline; ++i) {
+            context->write_queue[i] = coop_context->next_request;
+        }
+
+        context->write_queue_len = config->pipeline;
+        coop_context->pipeline_pending = config->pipeline + 1;
+        coop_context->req_count = 0;
+    }
+
+    state_run_next(state, STATE_EDGE_STATUS, context);
 }
 
-void __coop_dispatch_next_event(state_t* state, void* payload)
+void __coop_dispatch_next_event(const state_t* state, void* payload)
 {
     log_verbose("__coop_dispatch_next_event:state=%p, payload=%p", state, payload);
 
-    int r;
+    machine_coop_context_t* coop_context = (machine_coop_context_t*) payload;
     net_tcp_context_t* context = net_get_context(state, payload);
-    protocol_value_t* request;
-
-    r = protocol_build_request(&request, "next_event", 0);
-    log_check_r(r, "__coop_dispatch_next_event:protocol_build_request");
 
-    context->write_payload = request;
-    state_run_next(state, "next_event", context);
+    context->write_encoded = coop_context->next_request;
+    state_run_next(state, STATE_EDGE_NEXT_EVENT, context);
 }
 
 void __start_worker(uv_work_t* req)
@@ -431,7 +492,7 @@ void __start_worker(uv_work_t* req)
 
     machine_coop_context_t* context = (machine_coop_context_t*) req->data;
     config_data_t* config = context->config;
-    char* event = context->event;
+    protocol_event_t* event = &context->events[context->event_index];
 
     event_handler_serial(config->cpu, config->io);
     log_event_done(event);
@@ -443,46 +504,71 @@ void __work_done(uv_work_t* req, int status)
 
     log_check_uv_r(status, "__work_done");
     machine_coop_context_t* context = (machine_coop_context_t*) req->data;
-    state_t* state = ((net_tcp_context_t*) context)->state;
+    const state_t* state = ((net_tcp_context_t*) context)->state;
 
-    state_run_next(state, "done", context);
+    state_run_next(state, STATE_EDGE_DONE, context);
     free(req);
 }
 
 /**
- * Processes the event. If the eventhandler is set to serial, this state will
- * block the entire event loop. If cooperative, the event loop will continue.
+ * Reads the event, or the batch of events, out of the reply. The events are
+ * then handled one at a time.
  */
-void __coop_dispatch_process(state_t* state, void* payload)
+void __coop_dispatch_process(const state_t* state, void* payload)
 {
     log_verbose("__coop_dispatch_process:state=%p, payload=%p", state, payload);
 
     int r;
     machine_coop_context_t* context = (machine_coop_context_t*) payload;
-    protocol_value_t* response = ((net_tcp_context_t*) context)->read_payload;
-    protocol_value_t* result;
-    config_data_t* config = context->config;
+    net_tcp_context_t* tcp = (net_tcp_context_t*) context;
 
-    ((net_tcp_context_t*) context)->state = state;
+    r = protocol_get_result_events(tcp->read_payload, &tcp->read_result, context->events, NET_MAX_EVENTS);
+    if (r < 0) {
+        log_check_r(r, "__coop_dispatch_process:protocol_get_result_events");
+    }
+
+    context->events_len = r;
+    context->event_index = 0;
+    net_free_read_payload((net_tcp_context_t*) context);
 
-    r = protocol_get_key(response, &result, "result");
-    log_check_r(r, "__coop_dispatch_process:protocol_get_key");
+    for (int i = 0; i < context->events_len; ++i) {
+        log_event_retrieved(&context->events[i]);
+    }
 
-    r = protocol_get_string(result, (char*) &context->event);
-    log_check_r(r, "__coop_dispatch_process:protocol_get_string");
+    if (context->events_len == 0) {
+        state_run_next(state, STATE_EDGE_DONE, context);
+    }
+    else {
+        state_run_next(state, STATE_EDGE_HANDLE, context);
+    }
+}
 
-    log_event_retrieved((char*) context->event);
+/**
+ * Handles the event at context->event_index. If the eventhandler is set to
+ * serial, this state will block the entire event loop. If cooperative, the
+ * event loop will continue.
+ */
+void __coop_dispatch_handle_event(const state_t* state, void* payload)
+{
+    log_verbose("__coop_dispatch_handle_event:state=%p, payload=%p", state, payload);
+
+    int r;
+    machine_coop_context_t* context = (machine_coop_context_t*) payload;
+    config_data_t* config = context->config;
+    protocol_event_t* event = &context->events[context->event_index];
+
+    ((net_tcp_context_t*) context)->state = state;
 
     if (strcmp(config->eventhandler, "serial") == 0) {
-        log_event_dispatched((char*) context->event);
+        log_event_dispatched(event);
         event_handler_serial(config->cpu, config->io);
-        log_event_done((char*) context->event);
-        state_run_next(state, "done", context);
+        log_event_done(event);
+        state_run_next(state, STATE_EDGE_DONE, context);
     }
     else if (strcmp(config->eventhandler, "cooperative") == 0) {
 	double io = config->io;
 
-        log_event_dispatched((char*) context->event);
+        log_event_dispatched(event);
         event_handler_do_cpu(config->cpu); // the cpu will block here
 
 	if (io > 0.0) {
@@ -493,12 +579,12 @@ void __coop_dispatch_process(state_t* state, void* payload)
             context->fs.data = context; // point back up again
 
             log_debug("doing io");
-            r = fs_append(&context->fs, "handle_io");
-            log_check_uv_r(r, "__coop_dispatch_process:fs_append");
+            r = fs_append(&context->fs, STATE_EDGE_HANDLE_IO);
+            log_check_uv_r(r, "__coop_dispatch_handle_event:fs_append");
 	}
         else {
-            log_event_done((char*) context->event);
-            state_run_next(state, "done", context);
+            log_event_done(event);
+            state_run_next(state, STATE_EDGE_DONE, context);
         }
     }
     else if (strcmp(config->eventhandler, "preemptive") == 0) {
@@ -506,18 +592,18 @@ void __coop_dispatch_process(state_t* state, void* payload)
         uv_loop_t* loop = context->tcp.loop;
 
         work_req->data = context;
-        log_event_dispatched((char*) context->event);
+        log_event_dispatched(event);
 
         pthread_mutex_lock(&event_handler_lock);
 
         while (event_handler_queue_size > EVENT_HANDLER_MAX_QUEUE_SIZE) {
             r = pthread_cond_wait(&event_handler_cond, &event_handler_lock);
-            log_check_uv_r(r, "__coop_dispatch_process:pthread_cond_wait");
+            log_check_uv_r(r, "__coop_dispatch_handle_event:pthread_cond_wait");
         }
 
         ++event_handler_queue_size;
         r = uv_queue_work(loop, work_req, __start_worker, __work_done);
-        log_check_uv_r(r, "__coop_dispatch_process:uv_queue_work");
+        log_check_uv_r(r, "__coop_dispatch_handle_event:uv_queue_work");
 
         pthread_mutex_unlock(&event_handler_lock);
     }
@@ -525,14 +611,12 @@ void __coop_dispatch_process(state_t* state, void* payload)
         log_error("Unknown event handler \"%s\"", config->eventhandler);
         exit(1);
     }
-
-    protocol_free_build(response);
 }
 
 /**
  * This state writes a line to a file io_rounds times.
  */
-void __coop_dispatch_handle_io(state_t* state, void* payload)
+void __coop_dispatch_handle_io(const state_t* state, void* payload)
 {
     log_verbose("__coop_dispatch_handle_io:state=%p, payload=%p", state, payload);
 
@@ -541,90 +625,114 @@ void __coop_dispatch_handle_io(state_t* state, void* payload)
 
     free(fs_context->content);
     unlink(fs_context->path);
-    log_event_done((char*) coop_context->event);
-    state_run_next(state, "done", coop_context);
+    log_event_done(&coop_context->events[coop_context->event_index]);
+    state_run_next(state, STATE_EDGE_DONE, coop_context);
+}
+
+/**
+ * Moves on to the next event of the batch, or back to polling the device when
+ * the batch is done.
+ */
+void __coop_dispatch_event_done(const state_t* state, void* payload)
+{
+    log_verbose("__coop_dispatch_event_done:state=%p, payload=%p", state, payload);
+
+    machine_coop_context_t* context = (machine_coop_context_t*) payload;
+
+    if (++(context->event_index) < context->events_len) {
+        state_run_next(state, STATE_EDGE_NEXT, context);
+    }
+    else {
+        state_run_next(state, STATE_EDGE_DONE, context);
+    }
+}
+
+/**
+ * Handles one reply of a pipelined round, matched to its request by order.
+ * The first reply answers the status request. The other replies tell by
+ * themselves whether there were events, so the status is not needed to decide
+ * anything. On an empty queue next_event answers with an error, which is
+ * skipped here, and next_events answers with [], which goes through process as
+ * a batch of no events.
+ */
+void __coop_dispatch_pipeline_done(const state_t* state, machine_coop_context_t* context)
+{
+    log_verbose("__coop_dispatch_pipeline_done:state=%p, context=%p", state, context);
+
+    net_tcp_context_t* tcp = (net_tcp_context_t*) context;
+    int is_status = context->req_count++ == 0;
+
+    --(context->pipeline_pending);
+
+    if (!is_status && protocol_has_result(tcp->read_payload, &tcp->read_result)) {
+        state_run_next(state, STATE_EDGE_PROCESS, context);
+        return;
+    }
+
+    net_free_read_payload((net_tcp_context_t*) context);
+
+    if (context->pipeline_pending > 0) {
+        state_run_next(state, STATE_EDGE_READ, context);
+    }
+    else {
+        state_run_next(state, STATE_EDGE_STATUS_NOT_OK, context);
+    }
 }
 
 /**
  * Run whenever a tcp response has been received. If context->req_count is 0,
  * this is the status response. If the response is 0, go back to the status
- * state. Otherwise continue.
+ * state. Otherwise continue. The response is parsed into the arena of the
+ * context and stays valid until the next response is read.
  */
-void __coop_dispatch_tcp_done(state_t* state, void* payload)
+void __coop_dispatch_tcp_done(const state_t* state, void* payload)
 {
     log_verbose("__coop_dispatch_tcp_done:state=%p, payload=%p", state, payload);
 
     machine_coop_context_t* context = (machine_coop_context_t*) payload;
 
-    protocol_free_build(((net_tcp_context_t*) context)->write_payload);
+    if (context->pipeline_pending > 0) {
+        __coop_dispatch_pipeline_done(state, context);
+        return;
+    }
 
     if (context->req_count == 0) {
-        int r;
-        protocol_value_t* response = ((net_tcp_context_t*) context)->read_payload;
-        protocol_value_t* result;
-        int status_ok;
+        net_tcp_context_t* tcp = (net_tcp_context_t*) context;
+        int status_ok = protocol_get_result_int(tcp->read_payload, &tcp->read_result);
 
-        r = protocol_get_key(response, &result, "result");
-        log_check_r(r, "__coop_dispatch_tcp_done:protocol_get_key");
-
-        status_ok = protocol_get_int(result);
-        protocol_free_parse(response);
+        net_free_read_payload(tcp);
 
         if (status_ok < 0) {
-            log_check_r(status_ok, "__coop_dispatch_tcp_done:protocol_get_int");
+            log_check_r(status_ok, "__coop_dispatch_tcp_done:protocol_get_result_int");
         }
 
         if (status_ok) {
             (context->req_count)++;
-            state_run_next(state, "status_ok", payload);
+            state_run_next(state, STATE_EDGE_STATUS_OK, payload);
         }
         else {
-            state_run_next(state, "status_not_ok", payload);
+            state_run_next(state, STATE_EDGE_STATUS_NOT_OK, payload);
         }
     }
     else {
         context->req_count = 0;
-        state_run_next(state, "process", payload);
+        state_run_next(state, STATE_EDGE_PROCESS, payload);
     }
 }
 
+MACHINE_COOPERATIVE_DISPATCH(STATE_DECLARE)
+MACHINE_COOPERATIVE_DISPATCH(STATE_DEFINE)
+
 /**
  * The cooperative dispatcher is a state machine that steps through the
  * dispatch asynchronously. If the event handler is serial, the machine will
  * block in that step. If the event handler is cooperative it will step through
- * the handle_io state.
+ * the handle_io state. When pipelining, the replies of a round are read one
+ * by one through the read edges.
  */
-state_t* machine_cooperative_dispatch()
+const state_t* machine_cooperative_dispatch()
 {
     log_verbose("machine_cooperative_dispatch");
 
-    state_t* coop_dispatch;
-    state_lookup_t lookup;
-
-    const state_initializer_t si[] = {
-        { .name = "coop_dispatch_status", .callback = __coop_dispatch_status },
-        { .name = "coop_dispatch_next_event", .callback = __coop_dispatch_next_event },
-        { .name = "coop_dispatch_process", .callback = __coop_dispatch_process },
-        { .name = "coop_dispatch_handle_io", .callback = __coop_dispatch_handle_io }
-    };
-    const edge_initializer_t ei[] = {
-        { .name = "status", .from = "coop_dispatch_status", .to = "tcp_request_connecting" },
-        { .name = "status_ok", .from = "tcp_request_done", .to = "coop_dispatch_next_event" },
-        { .name = "status_not_ok", .from = "tcp_request_done", .to = "coop_dispatch_status" },
-        { .name = "next_event", .from = "coop_dispatch_next_event", .to = "tcp_request_connecting" },
-        { .name = "process", .from = "tcp_request_done", .to = "coop_dispatch_process" },
-        { .name = "handle_io", .from = "coop_dispatch_process", .to = "coop_dispatch_handle_io" },
-        { .name = "handle_io", .from = "coop_dispatch_handle_io", .to = "coop_dispatch_handle_io" },
-        { .name = "done", .from = "coop_dispatch_handle_io", .to = "coop_dispatch_status" },
-        { .name = "done", .from = "coop_dispatch_process", .to = "coop_dispatch_status" }
-    };
-    const int nsi = sizeof(si) / sizeof(si[0]);
-    const int nei = sizeof(ei) / sizeof(ei[0]);
-
-    lookup_init(&lookup);
-    machine_tcp_request(&lookup, __coop_dispatch_tcp_done);
-    coop_dispatch = state_machine_build(si, nsi, ei, nei, &lookup);
-    lookup_clear(&lookup);
-
-    return coop_dispatch;
+    return &coop_dispatch_status;
 }
@@ -32,25 +32,27 @@ struct machine_coop_context_s {
     net_tcp_context_t tcp;
     fs_context_t fs;
     config_data_t* config;
+    net_encoded_t* next_request;
     int req_count;
+    int pipeline_pending;
     long io_count;
     long io_rounds;
-    char event[128];
+    int events_len;
+    int event_index;
+    protocol_event_t events[NET_MAX_EVENTS];
 };
 
-state_t* machine_tcp_request(state_lookup_t* lookup, state_callback done);
-
-state_t* machine_boot_process(
+const state_t* machine_boot_process(
         machine_boot_context_t* context,
         uv_loop_t* loop,
         config_data_t* config,
         net_tcp_context_t* server_context);
 
-state_t* machine_tcp_server(
+const state_t* machine_tcp_server(
         machine_server_context_t* context,
         uv_loop_t* loop,
         request_callback on_request);
 
-state_t* machine_cooperative_dispatch();
+const state_t* machine_cooperative_dispatch();
 
 #endif
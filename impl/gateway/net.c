@@ -1,11 +1,13 @@
 #include <stdlib.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include "net.h"
 #include "log.h"
 #include "err.h"
+#include "pool.h"
 
 /**
  * Initializes the context. Allocates memory for the address struct. Returns an
@@ -35,7 +37,21 @@ int net_tcp_context_init(
 
     context->addr = addr;
     context->loop = loop;
+    context->handle = NULL;
+    context->write_payload = NULL;
+    context->write_encoded = NULL;
+    context->write_queue_len = 0;
     context->buf = malloc(NET_MAX_SIZE);
+    context->buf_size = NET_MAX_SIZE;
+    ring_init(&context->rbuf);
+    context->rbuf_scanned = 0;
+    arena_init(&context->arena);
+    context->use_arena = 0;
+    context->use_scan = 0;
+    context->read_result.type = PROTOCOL_SCALAR_NONE;
+    context->keep_alive = 0;
+    context->is_reading = 0;
+    context->encoding = PROTOCOL_JSON;
 
     return 0;
 }
@@ -63,9 +79,18 @@ int net_tcp_context_sync_init(
     }
 
     context->buf = calloc(1, NET_MAX_SIZE);
+    context->buf_size = NET_MAX_SIZE;
+    context->sock = -1;
     context->addr = addr;
     context->config = config;
+    context->write_encoded = NULL;
+    context->encoding = config->encoding;
+    context->use_scan = 0;
+    context->read_result.type = PROTOCOL_SCALAR_NONE;
+    context->buf_len = 0;
     context->is_processed = 1;
+    context->events_len = 0;
+    context->events_pending = 0;
 
     return pthread_mutex_init(&context->mutex, NULL);
 }
@@ -73,7 +98,7 @@ int net_tcp_context_sync_init(
 /**
  * Casts payload and updates the state field.
  */
-net_tcp_context_t* net_get_context(state_t* state, void* payload)
+net_tcp_context_t* net_get_context(const state_t* state, void* payload)
 {
     net_tcp_context_t* context = (net_tcp_context_t*) payload;
     context->state = state;
@@ -89,19 +114,19 @@ void __net_on_connection(uv_connect_t* req, int status)
     log_check_uv_r(status, "__net_on_connection");
 
     net_tcp_context_t* context = (net_tcp_context_t*) req->data;
-    char* edge_name = context->data;
+    int edge = context->next_edge;
 
     free(req);
-    state_run_next(context->state, edge_name, context);
+    state_run_next(context->state, edge, context);
 }
 
 /**
  * Connects to a tcp host with address found in context->addr. Runs the state
- * associated with edge_name when done.
+ * associated with edge when done.
  */
-int net_connect(net_tcp_context_t* context, char* edge_name)
+int net_connect(net_tcp_context_t* context, int edge)
 {
-    log_verbose("net_connect:context=%p, edge_name=\"%s\"", context, edge_name);
+    log_verbose("net_connect:context=%p, edge=\"%s\"", context, state_edge_name(edge));
 
     int r;
     uv_tcp_t* handle = calloc(1, sizeof(uv_tcp_t));
@@ -117,7 +142,7 @@ int net_connect(net_tcp_context_t* context, char* edge_name)
     context->handle = handle;
     connect_req->data = context;
     handle->data = context;
-    context->data = edge_name;
+    context->next_edge = edge;
 
     return uv_tcp_connect(connect_req, handle, context->addr, __net_on_connection);
 }
@@ -136,11 +161,348 @@ int net_connect_sync(net_tcp_context_sync_t* context)
 
     if (r < 0) {
         log_error("net_connect_sync:could not create socket");
+        return -errno;
+    }
+
+    context->sock = r;
+    r = connect(context->sock, addr, sizeof(struct sockaddr_in));
+
+    if (r < 0) {
+        r = -errno;
+        net_disconnect_sync(context);
         return r;
     }
 
+    return 0;
+}
+
+/**
+ * Closes context->sock if it is open.
+ */
+int net_disconnect_sync(net_tcp_context_sync_t* context)
+{
+    log_verbose("net_disconnect_sync:context=%p", context);
+
+    int r = 0;
+
+    if (context->sock >= 0) {
+        r = close(context->sock);
+        context->sock = -1;
+    }
+
+    return r;
+}
+
+/**
+ * Creates a non-blocking socket for context->sock and starts connecting to
+ * context->addr. The socket turns writable when the connection is done, and
+ * net_connect_error tells how it went.
+ */
+int net_connect_nonblocking(net_tcp_context_sync_t* context)
+{
+    log_verbose("net_connect_nonblocking:context=%p", context);
+
+    int r;
+    struct sockaddr* addr = (struct sockaddr*) context->addr;
+
+    r = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if (r < 0) {
+        log_error("net_connect_nonblocking:could not create socket");
+        return -errno;
+    }
+
     context->sock = r;
-    return connect(context->sock, addr, sizeof(struct sockaddr_in));
+    context->buf_len = 0;
+    r = connect(context->sock, addr, sizeof(struct sockaddr_in));
+
+    if (r < 0 && errno != EINPROGRESS) {
+        r = -errno;
+        net_disconnect_sync(context);
+        return r;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the result of a connection started by net_connect_nonblocking.
+ */
+int net_connect_error(net_tcp_context_sync_t* context)
+{
+    log_verbose("net_connect_error:context=%p", context);
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(context->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        return -errno;
+    }
+
+    return -err;
+}
+
+/**
+ * Sends what is left of the len bytes in buf after offset over the
+ * non-blocking context->sock and moves offset forward. Returns 0 when all of
+ * buf has been sent and -EAGAIN when the rest has to wait for the socket to
+ * turn writable.
+ */
+int net_send_nonblocking(net_tcp_context_sync_t* context, char* buf, size_t len, size_t* offset)
+{
+    log_verbose("net_send_nonblocking:context=%p, buf=%p, len=%zu, offset=%zu", context, buf, len, *offset);
+
+    while (*offset < len) {
+        ssize_t n = send(context->sock, buf + *offset, len - *offset, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            return -errno;
+        }
+
+        *offset += n;
+    }
+
+    return 0;
+}
+
+/**
+ * Frames protocol into buf. Json is followed by a newline, msgpack comes after
+ * a header of NET_FRAME_MARKER and its big endian length. The marker is never
+ * used by msgpack and cannot start json, so the two can be told apart by the
+ * first byte. Returns the length of the frame, or EBNDS if it does not fit in
+ * size bytes.
+ */
+int __net_frame(protocol_value_t* protocol, int encoding, char* buf, size_t size)
+{
+    log_verbose("__net_frame:protocol=%p, encoding=%d, buf=%p, size=%zu", protocol, encoding, buf, size);
+
+    int r;
+
+    if (encoding == PROTOCOL_MSGPACK) {
+        if (size < NET_FRAME_HEADER) {
+            return EBNDS;
+        }
+
+        r = protocol_serialize_msgpack(protocol, buf + NET_FRAME_HEADER, size - NET_FRAME_HEADER);
+
+        if (r < 0) {
+            return r;
+        }
+
+        buf[0] = (char) NET_FRAME_MARKER;
+        buf[1] = (char) (r >> 24);
+        buf[2] = (char) (r >> 16);
+        buf[3] = (char) (r >> 8);
+        buf[4] = (char) r;
+
+        return NET_FRAME_HEADER + r;
+    }
+
+    if (size < 1) {
+        return EBNDS;
+    }
+
+    r = protocol_serialize(protocol, buf, size - 1);
+
+    if (r < 0) {
+        return r;
+    }
+
+    buf[r] = '\n';
+
+    return r + 1;
+}
+
+/**
+ * Frames protocol into *buf, which has room for *size bytes. The buffer is
+ * grown as long as the frame does not fit, up to NET_MAX_MESSAGE_SIZE, so
+ * messages of every size up to that are written in one go. Returns the
+ * length of the frame, or EBNDS if it does not fit.
+ */
+int __net_frame_grow(protocol_value_t* protocol, int encoding, char** buf, size_t* size)
+{
+    log_verbose("__net_frame_grow:protocol=%p, encoding=%d, buf=%p, size=%p", protocol, encoding, buf, size);
+
+    int r;
+
+    while ((r = __net_frame(protocol, encoding, *buf, *size)) == EBNDS && *size < NET_MAX_MESSAGE_SIZE) {
+        char* grown = realloc(*buf, *size * 2);
+
+        if (grown == NULL) {
+            return EBNDS;
+        }
+
+        *buf = grown;
+        *size *= 2;
+    }
+
+    return r;
+}
+
+/**
+ * Returns the length of the message that follows the frame header.
+ */
+size_t __net_frame_length(char* header)
+{
+    unsigned char* h = (unsigned char*) header;
+
+    return ((size_t) h[1] << 24) | ((size_t) h[2] << 16) | ((size_t) h[3] << 8) | h[4];
+}
+
+/**
+ * Looks for a whole frame at the start of the len bytes in buf. Returns the
+ * length of the frame and points message, message_len and encoding at what
+ * it carries, or returns -EAGAIN if the frame is not complete yet. Returns
+ * EMPCK as soon as the header announces a frame larger than max_len, rather
+ * than waiting for a frame that can never fit.
+ */
+long __net_unframe(char* buf, size_t len, size_t max_len, char** message, size_t* message_len, int* encoding)
+{
+    log_verbose("__net_unframe:buf=%p, len=%zu, max_len=%zu", buf, len, max_len);
+
+    char* end;
+
+    if (len > 0 && (unsigned char) buf[0] == NET_FRAME_MARKER) {
+        if (len < NET_FRAME_HEADER) {
+            return -EAGAIN;
+        }
+
+        *message = buf + NET_FRAME_HEADER;
+        *message_len = __net_frame_length(buf);
+        *encoding = PROTOCOL_MSGPACK;
+
+        if (*message_len > max_len - NET_FRAME_HEADER) {
+            return EMPCK;
+        }
+
+        if (len < NET_FRAME_HEADER + *message_len) {
+            return -EAGAIN;
+        }
+
+        return NET_FRAME_HEADER + *message_len;
+    }
+
+    end = memchr(buf, '\n', len);
+
+    if (end == NULL) {
+        return -EAGAIN;
+    }
+
+    *message = buf;
+    *message_len = end - buf;
+    *encoding = PROTOCOL_JSON;
+
+    return *message_len + 1;
+}
+
+/**
+ * Parses the len bytes of message according to encoding into payload, from
+ * arena unless it is NULL. If scalar is not NULL, a json response with an int
+ * or string result is only scanned into it and payload is set to NULL.
+ */
+int __net_decode(
+        char* message,
+        size_t len,
+        int encoding,
+        arena_t* arena,
+        protocol_scalar_t* scalar,
+        protocol_value_t** payload)
+{
+    log_verbose(
+            "__net_decode:message=%p, len=%zu, encoding=%d, arena=%p, scalar=%p",
+            message,
+            len,
+            encoding,
+            arena,
+            scalar);
+
+    if (scalar != NULL) {
+        scalar->type = PROTOCOL_SCALAR_NONE;
+    }
+
+    if (encoding == PROTOCOL_MSGPACK) {
+        return protocol_parse_msgpack(payload, message, len, arena);
+    }
+
+    log_debug("__net_decode:>>>> \"%.*s\" (%zu)", (int) len, message, len);
+
+    if (scalar != NULL && protocol_scan_result(message, len, scalar) == 0) {
+        *payload = NULL;
+        return 0;
+    }
+
+    if (arena != NULL) {
+        return protocol_parse_arena(payload, message, len, arena);
+    }
+
+    return protocol_parse(payload, message, len);
+}
+
+/**
+ * Parses the first message of the context->buf_len bytes in context->buf into
+ * context->read_payload and returns 0, or returns -EAGAIN if there is no
+ * whole message yet. Bytes after the message are kept for the next call.
+ */
+int net_parse_buffered(net_tcp_context_sync_t* context)
+{
+    log_verbose("net_parse_buffered:context=%p", context);
+
+    int r;
+    char* buf = context->buf;
+    char* message;
+    size_t len;
+    int encoding;
+    long frame_len = __net_unframe(buf, context->buf_len, NET_MAX_SIZE, &message, &len, &encoding);
+    protocol_value_t* read_payload;
+
+    if (frame_len == -EAGAIN) {
+        return context->buf_len == NET_MAX_SIZE ? EBNDS : -EAGAIN;
+    }
+
+    if (frame_len < 0) {
+        return frame_len;
+    }
+
+    r = __net_decode(message, len, encoding, NULL, context->use_scan ? &context->read_result : NULL, &read_payload);
+
+    context->buf_len -= frame_len;
+    memmove(buf, buf + frame_len, context->buf_len);
+
+    if (r) {
+        return r;
+    }
+
+    context->read_payload = read_payload;
+
+    return 0;
+}
+
+/**
+ * Reads what is available on the non-blocking context->sock. Parses the
+ * response into context->read_payload and returns 0 once a whole message has
+ * arrived, or returns -EAGAIN if it has not.
+ */
+int net_recv_nonblocking(net_tcp_context_sync_t* context)
+{
+    log_verbose("net_recv_nonblocking:context=%p", context);
+
+    int r;
+
+    while ((r = net_parse_buffered(context)) == -EAGAIN) {
+        ssize_t n = recv(context->sock, context->buf + context->buf_len, NET_MAX_SIZE - context->buf_len, 0);
+
+        if (n == 0) {
+            return ECLSD;
+        }
+
+        if (n < 0) {
+            return -errno;
+        }
+
+        context->buf_len += n;
+    }
+
+    return r;
 }
 
 /**
@@ -151,11 +513,26 @@ void __net_on_close(uv_handle_t* handle)
     log_verbose("__net_on_close:handle=%p", handle);
 
     net_tcp_context_t* context = (net_tcp_context_t*) handle->data;
-    state_t* state = context->state;
-    char* edge_name = context->data;
+    const state_t* state = context->state;
+    int edge = context->next_edge;
+
+    context->handle = NULL;
+    context->is_reading = 0;
+    ring_reset(&context->rbuf);
+    context->rbuf_scanned = 0;
+    free(handle);
+    state_run_next(state, edge, context);
+}
+
+/**
+ * Called when a kept alive connection has been dropped by the peer. The next
+ * request on the context will connect again.
+ */
+void __net_on_drop(uv_handle_t* handle)
+{
+    log_verbose("__net_on_drop:handle=%p", handle);
 
     free(handle);
-    state_run_next(state, edge_name, context);
 }
 
 void __net_on_shutdown(uv_shutdown_t* req, int status)
@@ -172,15 +549,15 @@ void __net_on_shutdown(uv_shutdown_t* req, int status)
 }
 
 /**
- * Disconnects context->handle and runs the state associated to edge_name.
+ * Disconnects context->handle and runs the state associated to edge.
  */
-int net_disconnect(net_tcp_context_t* context, char* edge_name)
+int net_disconnect(net_tcp_context_t* context, int edge)
 {
-    log_verbose("net_disconnect:context=%p, edge_name=\"%s\"", context, edge_name);
+    log_verbose("net_disconnect:context=%p, edge=\"%s\"", context, state_edge_name(edge));
 
     uv_shutdown_t* shutdown_req = calloc(1, sizeof(uv_shutdown_t));
 
-    context->data = edge_name;
+    context->next_edge = edge;
     shutdown_req->data = context;
 
     return uv_shutdown(shutdown_req, (uv_stream_t*) context->handle, __net_on_shutdown);
@@ -195,19 +572,19 @@ void __net_on_incoming_connection(uv_stream_t* handle, int status)
     log_check_uv_r(status, "__net_on_incoming_connection");
 
     net_tcp_context_t* context = (net_tcp_context_t*) handle->data;
-    state_t* state = context->state;
-    char* edge_name = context->data;
+    const state_t* state = context->state;
+    int edge = context->next_edge;
 
-    state_run_next(state, edge_name, context);
+    state_run_next(state, edge, context);
 }
 
 /**
- * Starts listening to tcp connections on context->addr. Goes to edge_name on
+ * Starts listening to tcp connections on context->addr. Goes to edge on
  * connection. Returns an uv error code if something goes wrong.
  */
-int net_listen(net_tcp_context_t* context, char* edge_name)
+int net_listen(net_tcp_context_t* context, int edge)
 {
-    log_verbose("net_listen:context=%p, edge_name=\"%s\"", context, edge_name);
+    log_verbose("net_listen:context=%p, edge=\"%s\"", context, state_edge_name(edge));
 
     int r;
     uv_tcp_t* handle = calloc(1, sizeof(uv_tcp_t));
@@ -225,7 +602,7 @@ int net_listen(net_tcp_context_t* context, char* edge_name)
         return r;
     }
 
-    context->data = edge_name;
+    context->next_edge = edge;
     context->handle = handle;
     handle->data = context;
     r = uv_listen((uv_stream_t*) handle, 1, __net_on_incoming_connection);
@@ -235,14 +612,21 @@ int net_listen(net_tcp_context_t* context, char* edge_name)
 
 /**
  * Allocate memory with the suggested size to retrieve incoming data from the
- * tcp client.
+ * tcp client. The buffer comes from the pool of the loop and is not zeroed.
  */
 void __net_on_alloc(uv_handle_t* handle, size_t size, uv_buf_t* buf)
 {
     log_verbose("__net_on_alloc:handle=%p, size=%d, buf=%p", handle, size, buf);
 
-    buf->base = calloc(1, NET_MAX_SIZE);
-    buf->len = NET_MAX_SIZE;
+    pool_t* pool = pool_get(handle->loop);
+    size_t len;
+
+    if (size > NET_MAX_SIZE) {
+        size = NET_MAX_SIZE;
+    }
+
+    buf->base = pool_alloc(pool, size, &len);
+    buf->len = len;
 
     if (buf->base == NULL) {
         log_error("reading buffer was not allocated properly");
@@ -250,89 +634,238 @@ void __net_on_alloc(uv_handle_t* handle, size_t size, uv_buf_t* buf)
 }
 
 /**
- * Called when a chunk of data has been read. The chunk buffer is pointed to by
- * context->data.
+ * Stops reading a connection that sent something that cannot be a message.
+ * The owner of the context closes it through the eof edge if it has one, like
+ * on eof. Otherwise the connection is closed here, and a kept alive context
+ * connects again on its next request.
+ */
+void __net_drop(net_tcp_context_t* context)
+{
+    log_verbose("__net_drop:context=%p", context);
+
+    uv_stream_t* handle = (uv_stream_t*) context->handle;
+    int read_eof_edge = context->read_eof_edge;
+
+    uv_read_stop(handle);
+    context->is_reading = 0;
+    context->read_chunk_edge = STATE_EDGE_NONE;
+    ring_reset(&context->rbuf);
+    context->rbuf_scanned = 0;
+
+    if (read_eof_edge != STATE_EDGE_NONE) {
+        state_run_next(context->state, read_eof_edge, context);
+    }
+    else {
+        context->handle = NULL;
+        uv_close((uv_handle_t*) handle, __net_on_drop);
+    }
+}
+
+/**
+ * Parses the first message in context->rbuf into context->read_payload and
+ * runs the chunk edge, if a message is complete and the context is waiting
+ * for one. The edge is consumed so that every message has to be asked for
+ * with net_read. Bytes already searched for the newline are not searched
+ * again when more data arrives. Messages are written back in the encoding of
+ * the last one read, so a server answers in the encoding it was asked in.
+ */
+void __net_dispatch(net_tcp_context_t* context)
+{
+    log_verbose("__net_dispatch:context=%p", context);
+
+    int r;
+    int edge = context->read_chunk_edge;
+    ring_t* rbuf = &context->rbuf;
+    char* message;
+    long len;
+    size_t frame_len;
+    int encoding = PROTOCOL_JSON;
+    protocol_value_t* read_payload;
+
+    if (edge == STATE_EDGE_NONE || rbuf->len == 0) {
+        return;
+    }
+
+    if ((unsigned char) rbuf->buf[rbuf->head] == NET_FRAME_MARKER) {
+        char header[NET_FRAME_HEADER];
+
+        if (rbuf->len < NET_FRAME_HEADER) {
+            return;
+        }
+
+        // the header may wrap, copy it out rather than moving the data
+        for (int i = 0; i < NET_FRAME_HEADER; ++i) {
+            header[i] = rbuf->buf[(rbuf->head + i) & (rbuf->size - 1)];
+        }
+
+        len = __net_frame_length(header);
+        frame_len = NET_FRAME_HEADER + len;
+
+        if (frame_len > NET_MAX_MESSAGE_SIZE) {
+            log_error("__net_dispatch:frame of %zu bytes is too large (%d)", frame_len, EMPCK);
+            __net_drop(context);
+            return;
+        }
+
+        if (rbuf->len < frame_len) {
+            return;
+        }
+
+        message = ring_linear(rbuf, frame_len);
+        encoding = PROTOCOL_MSGPACK;
+    }
+    else {
+        len = ring_find(rbuf, '\n', context->rbuf_scanned);
+
+        if (len < 0) {
+            context->rbuf_scanned = rbuf->len;
+            return;
+        }
+
+        frame_len = len + 1;
+        message = ring_linear(rbuf, len);
+    }
+
+    if (message == NULL) {
+        log_error("__net_dispatch:could not allocate read buffer");
+        exit(1);
+    }
+
+    if (encoding == PROTOCOL_MSGPACK) {
+        message += NET_FRAME_HEADER;
+    }
+
+    // the message before has been handled by the time the next one is read
+    if (context->use_arena) {
+        arena_reset(&context->arena);
+    }
+
+    r = __net_decode(
+            message,
+            len,
+            encoding,
+            context->use_arena ? &context->arena : NULL,
+            context->use_scan ? &context->read_result : NULL,
+            &read_payload);
+
+    if (r) {
+        log_error("could not parse read data (%d)", r);
+        context->read_payload = NULL;
+    }
+    else {
+        context->read_payload = read_payload;
+    }
+
+    // keep what is left, it belongs to the next message
+    ring_consume(rbuf, frame_len);
+    context->rbuf_scanned = 0;
+    context->read_chunk_edge = STATE_EDGE_NONE;
+    context->encoding = encoding;
+
+    state_run_next(context->state, edge, context);
+}
+
+/**
+ * Called when a chunk of data has been read. The chunk is appended to
+ * context->rbuf and dispatched once a whole message has arrived. A chunk may
+ * hold a part of a message or several messages.
  */
 void __net_on_read(uv_stream_t* handle, ssize_t nread, const uv_buf_t* buf)
 {
     log_verbose("__net_on_read:handle=%p, nread=%d, buf=%p", handle, nread, buf);
 
-    int r;
     net_tcp_context_t* context = (net_tcp_context_t*) handle->data;
-    state_t* state = context->state;
-    char* read_chunk_edge = context->read_chunk_edge;
-    char* read_eof_edge = context->read_eof_edge;
+    const state_t* state = context->state;
+    int read_eof_edge = context->read_eof_edge;
+    pool_t* pool = pool_get(handle->loop);
 
     if (nread < 0) {
         if (nread != UV_EOF) {
             log_check_uv_r(nread, "tcp_on_reading");
         }
 
-        if (read_eof_edge != NULL) {
+        context->is_reading = 0;
+
+        if (read_eof_edge != STATE_EDGE_NONE) {
             state_run_next(state, read_eof_edge, context);
-            free(read_eof_edge);
+        }
+        else if (context->keep_alive) {
+            log_debug("__net_on_read:connection dropped by peer");
+            context->handle = NULL;
+            ring_reset(&context->rbuf);
+            context->rbuf_scanned = 0;
+            uv_close((uv_handle_t*) handle, __net_on_drop);
         }
     }
     else if (nread > 0) {
-        log_debug("__net_on_read:>>>> \"%s\" (%d)", buf->base, nread);
-
-        protocol_value_t* read_payload;
-
-        r = protocol_parse(&read_payload, buf->base, nread);
+        int r = ring_write(&context->rbuf, buf->base, nread);
 
+        // a message that does not end within RING_MAX_SIZE never will
         if (r) {
-            log_error("could not parse read data (%d)", r);
-            context->read_payload = NULL;
+            log_error("__net_on_read:message larger than %d bytes, dropping connection", RING_MAX_SIZE);
+            __net_drop(context);
         }
         else {
-            context->read_payload = read_payload;
+            __net_dispatch(context);
         }
-
-        state_run_next(state, read_chunk_edge, context);
-        free(read_chunk_edge);
-    }
-    else if (nread == 0) {
-        return;
     }
 
-    free(buf->base);
+    pool_free(pool, buf->base, buf->len);
 }
 
 /*
- * Start read from context->handle. Goes to state associated with chunk_edge on
- * each chunk. Goes to state associated with eof_edge when eof has been read.
+ * Waits for the next message on context->handle. Goes to state associated
+ * with chunk_edge when it has been read, right away if it is already buffered.
+ * Goes to state associated with eof_edge when eof has been read. A handle that
+ * is already reading (a kept alive connection) keeps reading.
  */
-int net_read(net_tcp_context_t* context, char* chunk_edge, char* eof_edge)
+int net_read(net_tcp_context_t* context, int chunk_edge, int eof_edge)
 {
-    log_verbose("net_read: context=%p, chunk_edge=\"%s\", eof_edge=\"%s\"", context, chunk_edge, eof_edge);
+    log_verbose(
+            "net_read: context=%p, chunk_edge=\"%s\", eof_edge=\"%s\"",
+            context,
+            state_edge_name(chunk_edge),
+            state_edge_name(eof_edge));
 
-    char* read_chunk_edge = malloc(strlen(chunk_edge) + 1);
-    char* read_eof_edge;
+    int r;
 
-    if (eof_edge == NULL) {
-        read_eof_edge = NULL;
-    }
-    else {
-        read_eof_edge = malloc(strlen(read_eof_edge) + 1);
-    }
+    context->read_chunk_edge = chunk_edge;
+    context->read_eof_edge = eof_edge;
+
+    if (!context->is_reading) {
+        r = uv_read_start((uv_stream_t*) context->handle, __net_on_alloc, __net_on_read);
 
-    strcpy(read_chunk_edge, chunk_edge);
-    strcat(read_chunk_edge, "\0");
+        if (r) {
+            return r;
+        }
 
-    if (eof_edge != NULL) {
-        strcpy(read_eof_edge, eof_edge);
-        strcat(read_eof_edge, "\0");
+        context->is_reading = 1;
     }
 
-    context->read_chunk_edge = read_chunk_edge;
-    context->read_eof_edge = read_eof_edge;
+    __net_dispatch(context);
 
-    return uv_read_start((uv_stream_t*) context->handle, __net_on_alloc, __net_on_read);
+    return 0;
 }
 
 /**
- * Reads context->sock until no more data is available. The result is parsed
- * and set in context->read_payload.
+ * Frees context->read_payload unless it was parsed into context->arena, in
+ * which case it goes away when the next message is read.
+ */
+void net_free_read_payload(net_tcp_context_t* context)
+{
+    log_verbose("net_free_read_payload:context=%p", context);
+
+    if (context->read_payload != NULL && !context->use_arena) {
+        protocol_free_parse(context->read_payload);
+    }
+
+    context->read_payload = NULL;
+}
+
+/**
+ * Reads one message from context->sock. The result is parsed and set in
+ * context->read_payload. Returns ECLSD if the peer closed the connection
+ * before the message was complete.
  */
 int net_read_sync(net_tcp_context_sync_t* context)
 {
@@ -340,30 +873,42 @@ int net_read_sync(net_tcp_context_sync_t* context)
 
     int sock = context->sock;
     char* buf = context->buf;
-    int nread = 0;
+    char* message;
+    size_t len;
+    int encoding;
+    size_t nread = 0;
+    long frame_len;
     int r;
     protocol_value_t* read_payload;
 
-    memset(buf, 0, NET_MAX_SIZE);
+    context->read_len = 0;
 
-    while (nread < NET_MAX_SIZE) {
+    while ((frame_len = __net_unframe(buf, nread, NET_MAX_SIZE, &message, &len, &encoding)) < 0) {
         int n;
 
+        if (frame_len != -EAGAIN) {
+            return frame_len;
+        }
+
+        if (nread == NET_MAX_SIZE) {
+            return EBNDS;
+        }
+
         n = read(sock, buf + nread, NET_MAX_SIZE - nread);
 
         if (n == 0) {
-            break;
+            return ECLSD;
         }
 
-        if (n < 1) {
-            return n;
+        if (n < 0) {
+            return -errno;
         }
 
         nread += n;
+        context->read_len = nread;
     }
 
-    log_debug("net_read_sync:>>>> \"%s\" (%d)", buf, nread);
-    r = protocol_parse(&read_payload, buf, nread);
+    r = __net_decode(message, len, encoding, NULL, context->use_scan ? &context->read_result : NULL, &read_payload);
 
     if (r) {
         return r;
@@ -381,51 +926,84 @@ void __net_on_write(uv_write_t* req, int status)
 
     net_tcp_context_t* context = (net_tcp_context_t*) req->data;
     log_debug("__net_on_write:context=%p", context);
-    char* edge_name = context->data;
+    int edge = context->next_edge;
 
     free(req);
-    state_run_next(context->state, edge_name, context);
+    state_run_next(context->state, edge, context);
 }
 
 /**
- * Writes context->write_payload to context->handle. Proceeds to the state associated
- * with edge_name when writing is finished.
+ * Frames context->write_payload into context->buf in the encoding of the
+ * context and points context->write_encoded at it. Releases
+ * context->write_payload. Does nothing if context->write_encoded is already
+ * set. Returns EBNDS if the message is larger than NET_MAX_MESSAGE_SIZE.
  */
-int net_write(net_tcp_context_t* context, char* edge_name)
+int net_serialize(net_tcp_context_t* context)
 {
-    log_verbose("net_write:context=%p, edge_name=\"%s\"", context, edge_name);
+    log_verbose("net_serialize:context=%p", context);
 
-    protocol_value_t* write_payload = context->write_payload;
-    char* buf = context->buf;
+    int r;
 
-    uv_write_t* write_req = malloc(sizeof(uv_write_t));
+    if (context->write_encoded != NULL) {
+        return 0;
+    }
 
-    if (protocol_size(write_payload) > NET_MAX_SIZE) {
-        log_error("net_write:protocol is too large!");
-        exit(1);
+    r = __net_frame_grow(context->write_payload, context->encoding, &context->buf, &context->buf_size);
+
+    protocol_free_build(context->write_payload);
+    context->write_payload = NULL;
+
+    if (r < 0) {
+        return r;
     }
 
-    memset(buf, 0, NET_MAX_SIZE);
-    protocol_to_json(write_payload, buf);
-    strcat(buf, "\n\0");
+    context->write_framed.buf = context->buf;
+    context->write_framed.len = r;
+    context->write_encoded = &context->write_framed;
 
-    uv_buf_t bufs[] = {
-        { .base = buf, .len = strlen(buf) }
-    };
+    log_debug("net_serialize:<<<< \"%.*s\"", r, context->buf);
 
-    protocol_free_build(write_payload);
-    context->write_payload = NULL;
-    context->data = edge_name;
-    write_req->data = context;
+    return 0;
+}
 
-    log_debug("net_write:<<<< \"%s\"", buf);
+/**
+ * Writes context->write_encoded to context->handle, followed by any requests
+ * in context->write_queue. A context->write_payload has to be framed with
+ * net_serialize first. Proceeds to the state associated with edge when
+ * writing is finished. Returns a uv error code.
+ */
+int net_write(net_tcp_context_t* context, int edge)
+{
+    log_verbose("net_write:context=%p, edge=\"%s\"", context, state_edge_name(edge));
+
+    int nbufs = 1;
+    uv_buf_t bufs[NET_MAX_PIPELINE + 1];
+    uv_write_t* write_req;
+
+    if (context->write_encoded == NULL) {
+        return UV_EINVAL;
+    }
+
+    bufs[0] = uv_buf_init(context->write_encoded->buf, context->write_encoded->len);
+    write_req = malloc(sizeof(uv_write_t));
+
+    for (int i = 0; i < context->write_queue_len; ++i) {
+        net_encoded_t* encoded = context->write_queue[i];
+        bufs[nbufs++] = uv_buf_init(encoded->buf, encoded->len);
+    }
+
+    context->write_encoded = NULL;
+    context->write_queue_len = 0;
+    context->next_edge = edge;
+    write_req->data = context;
 
-    return uv_write(write_req, (uv_stream_t*) context->handle, bufs, 1, __net_on_write);
+    return uv_write(write_req, (uv_stream_t*) context->handle, bufs, nbufs, __net_on_write);
 }
 
 /**
- * Serializes context->write_payload and writes the buffer over tcp. Assumes
- * context->sock is defined.
+ * Frames context->write_payload in the encoding of the context and writes it
+ * over tcp in one call. If context->write_encoded is set, it is written
+ * instead without serializing anything. Assumes context->sock is defined.
  */
 int net_write_sync(net_tcp_context_sync_t* context)
 {
@@ -433,64 +1011,224 @@ int net_write_sync(net_tcp_context_sync_t* context)
 
     int r;
     int sock = context->sock;
-    protocol_value_t* write_payload = context->write_payload;
-    char* buf = context->buf;
-    int buf_len;
+    char* buf;
+    size_t len;
 
-    if (protocol_size(write_payload) > NET_MAX_SIZE) {
-        log_error("net_write_sync:protocol is too large!");
-        exit(1);
+    if (context->write_encoded != NULL) {
+        buf = context->write_encoded->buf;
+        len = context->write_encoded->len;
     }
+    else {
+        r = __net_frame_grow(context->write_payload, context->encoding, &context->buf, &context->buf_size);
 
-    memset(buf, 0, NET_MAX_SIZE);
-    protocol_to_json(write_payload, buf);
-    strcat(buf, "\n\0");
-    buf_len = strlen(buf);
+        if (r < 0) {
+            return r;
+        }
+
+        buf = context->buf;
+        len = r;
 
-    log_debug("net_write_sync:<<<< \"%s\"", buf);
+        log_debug("net_write_sync:<<<< \"%.*s\"", (int) len, buf);
+    }
 
-    r = send(sock, buf, buf_len, 0);
+    // a peer that closed a kept alive socket should give EPIPE, not SIGPIPE
+    r = send(sock, buf, len, MSG_NOSIGNAL);
 
     if (r < 0) {
-        return r;
+        return -errno;
     }
 
-    if (r != buf_len) {
+    if ((size_t) r != len) {
         return EBNDS;
     }
 
     return 0;
 }
 
+/**
+ * Frames protocol for encoding into a buffer of its own in encoded. protocol
+ * is left as it is.
+ */
+int net_encode(protocol_value_t* protocol, int encoding, net_encoded_t* encoded)
+{
+    log_verbose("net_encode:protocol=%p, encoding=%d, encoded=%p", protocol, encoding, encoded);
+
+    size_t size = NET_MAX_SIZE;
+    char* buf = malloc(size);
+    int r = __net_frame_grow(protocol, encoding, &buf, &size);
+
+    if (r < 0) {
+        free(buf);
+        return r;
+    }
+
+    encoded->buf = realloc(buf, r);
+    encoded->len = r;
+
+    return 0;
+}
+
+/**
+ * Requests without arguments that have been encoded so far. Entries are only
+ * ever added, under the lock, and the length is published after the entry is
+ * complete, so lookups do not have to take the lock.
+ */
+typedef struct {
+    char method[NET_CACHE_METHOD_LEN];
+    int encoding;
+    net_encoded_t encoded;
+} __net_cache_entry_t;
+
+static __net_cache_entry_t __net_cache[NET_CACHE_SIZE];
+static int __net_cache_len = 0;
+static pthread_mutex_t __net_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Points encoded at the request for method without arguments, framed for
+ * encoding. The request is encoded on the first call and shared by every
+ * caller after that, so it must not be changed or freed. Returns EBNDS if the
+ * cache is full.
+ */
+int net_get_cached_request(char* method, int encoding, net_encoded_t** encoded)
+{
+    log_verbose("net_get_cached_request:method=\"%s\", encoding=%d, encoded=%p", method, encoding, encoded);
+
+    int r = 0;
+    int len = __atomic_load_n(&__net_cache_len, __ATOMIC_ACQUIRE);
+    protocol_value_t* request;
+
+    for (int i = 0; i < len; ++i) {
+        if (__net_cache[i].encoding == encoding && strcmp(__net_cache[i].method, method) == 0) {
+            *encoded = &__net_cache[i].encoded;
+            return 0;
+        }
+    }
+
+    pthread_mutex_lock(&__net_cache_lock);
+
+    // another thread may have added it in the meantime
+    for (int i = len; i < __net_cache_len; ++i) {
+        if (__net_cache[i].encoding == encoding && strcmp(__net_cache[i].method, method) == 0) {
+            *encoded = &__net_cache[i].encoded;
+            pthread_mutex_unlock(&__net_cache_lock);
+            return 0;
+        }
+    }
+
+    len = __net_cache_len;
+
+    if (len == NET_CACHE_SIZE || strlen(method) >= NET_CACHE_METHOD_LEN) {
+        pthread_mutex_unlock(&__net_cache_lock);
+        return EBNDS;
+    }
+
+    r = protocol_build_request(&request, method, 0);
+
+    if (r == 0) {
+        r = net_encode(request, encoding, &__net_cache[len].encoded);
+        protocol_free_build(request);
+    }
+
+    if (r == 0) {
+        strcpy(__net_cache[len].method, method);
+        __net_cache[len].encoding = encoding;
+        *encoded = &__net_cache[len].encoded;
+        __atomic_store_n(&__net_cache_len, len + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&__net_cache_lock);
+
+    return r;
+}
+
+/**
+ * Writes context->write_payload and reads the response into
+ * context->read_payload over the already connected context->sock.
+ */
+int __net_exchange_sync(net_tcp_context_sync_t* context)
+{
+    log_verbose("__net_exchange_sync:context=%p", context);
+
+    int r;
+
+    r = net_write_sync(context);
+
+    if (r) {
+        return r;
+    }
+
+    return net_read_sync(context);
+}
+
+/**
+ * Returns 1 if the exchange that gave r failed because the peer closed a kept
+ * alive socket since the last call, that is if the request could not be sent
+ * or the connection was closed or reset before any byte of the reply was read.
+ * Other errors would only fail again on a new connection.
+ */
+int __net_is_stale_sync(net_tcp_context_sync_t* context, int r, int is_sent)
+{
+    log_verbose("__net_is_stale_sync:context=%p, r=%d, is_sent=%d", context, r, is_sent);
+
+    if (!is_sent) {
+        return 1;
+    }
+
+    return context->read_len == 0 && (r == ECLSD || r == -ECONNRESET);
+}
+
 /**
  * Connects to context->addr, writes context->write_payload and loads the
- * result in context->read_payload.
+ * result in context->read_payload. If the config keeps connections alive the
+ * socket is left open for the next call, and a socket that went stale since
+ * the last call is reconnected once before giving up.
  */
 int net_call_sync(net_tcp_context_sync_t* context)
 {
     log_verbose("net_call_sync:context=%p", context);
 
     int r;
+    int keep_alive = context->config->keep_alive;
+    int is_reused = context->sock >= 0;
+    int is_sent;
 
-    r = net_connect_sync(context);
+    if (!is_reused) {
+        r = net_connect_sync(context);
 
-    if (r) {
-        return r;
+        if (r) {
+            return r;
+        }
     }
 
     r = net_write_sync(context);
+    is_sent = r == 0;
 
-    if (r) {
-        return r;
+    if (is_sent) {
+        r = net_read_sync(context);
     }
 
-    r = net_read_sync(context);
+    if (r && is_reused && __net_is_stale_sync(context, r, is_sent)) {
+        log_debug("net_call_sync:reconnecting (%d)", r);
+        net_disconnect_sync(context);
+        r = net_connect_sync(context);
+
+        if (r) {
+            return r;
+        }
+
+        r = __net_exchange_sync(context);
+    }
 
     if (r) {
+        net_disconnect_sync(context);
         return r;
     }
 
-    return close(context->sock);
+    if (!keep_alive) {
+        return net_disconnect_sync(context);
+    }
+
+    return 0;
 }
 
 /**
@@ -8,28 +8,60 @@
 #include "state.h"
 #include "protocol.h"
 #include "conf.h"
+#include "ring.h"
+#include "arena.h"
 
 #define MAX_REQUEST_ARGS 8
 #define SERVER_PORT 5010
 #define NET_MAX_SIZE 65536
+#define NET_MAX_MESSAGE_SIZE RING_MAX_SIZE
+#define NET_MAX_PIPELINE 16
+#define NET_MAX_EVENTS 32
+#define NET_CACHE_SIZE 8
+#define NET_CACHE_METHOD_LEN 32
+#define NET_FRAME_MARKER 0xc1
+#define NET_FRAME_HEADER 5
 //#define LOCAL_ETH_ADDR "192.168.28.47"
 #define LOCAL_ETH_ADDR "0.0.0.0"
 
+typedef struct net_encoded_s net_encoded_t;
 typedef struct net_tcp_context_s net_tcp_context_t;
 typedef struct net_tcp_context_sync_s net_tcp_context_sync_t;
 
+/**
+ * A message that is serialized and framed once, and then written as it is any
+ * number of times.
+ */
+struct net_encoded_s {
+    char* buf;
+    size_t len;
+};
+
 struct net_tcp_context_s {
-    state_t* state;
+    const state_t* state;
     uv_loop_t* loop;
     uv_tcp_t* handle;
     struct sockaddr* addr;
     protocol_value_t* read_payload;
+    protocol_scalar_t read_result;
     protocol_value_t* write_payload;
-    void* data;
+    net_encoded_t* write_encoded;
+    net_encoded_t write_framed;
+    net_encoded_t* write_queue[NET_MAX_PIPELINE];
+    int write_queue_len;
+    int next_edge;
     char* buf;
-    size_t buf_len;
-    char* read_chunk_edge;
-    char* read_eof_edge;
+    size_t buf_size;
+    ring_t rbuf;
+    size_t rbuf_scanned;
+    arena_t arena;
+    int use_arena;
+    int use_scan;
+    int read_chunk_edge;
+    int read_eof_edge;
+    int keep_alive;
+    int is_reading;
+    int encoding;
     char did[128];
 };
 
@@ -38,11 +70,19 @@ struct net_tcp_context_sync_s {
     struct sockaddr_storage* addr;
     config_data_t* config;
     protocol_value_t* read_payload;
+    protocol_scalar_t read_result;
     protocol_value_t* write_payload;
+    net_encoded_t* write_encoded;
+    int encoding;
+    int use_scan;
     char* buf;
+    size_t buf_size;
     size_t buf_len;
+    size_t read_len;
     int is_processed;
-    char event[128];
+    int events_len;
+    int events_pending;
+    protocol_event_t events[NET_MAX_EVENTS];
     pthread_mutex_t mutex;
     char did[128];
 };
@@ -59,24 +99,44 @@ int net_tcp_context_sync_init(
         int port,
         config_data_t* config);
 
-net_tcp_context_t* net_get_context(state_t* state, void* payload);
+net_tcp_context_t* net_get_context(const state_t* state, void* payload);
 
-int net_connect(net_tcp_context_t* context, char* edge_name);
+int net_connect(net_tcp_context_t* context, int edge);
 
 int net_connect_sync(net_tcp_context_sync_t* context);
 
-int net_disconnect(net_tcp_context_t* context, char* edge_name);
+int net_disconnect_sync(net_tcp_context_sync_t* context);
+
+int net_connect_nonblocking(net_tcp_context_sync_t* context);
+
+int net_connect_error(net_tcp_context_sync_t* context);
+
+int net_send_nonblocking(net_tcp_context_sync_t* context, char* buf, size_t len, size_t* offset);
 
-int net_listen(net_tcp_context_t* context, char* edge_name);
+int net_parse_buffered(net_tcp_context_sync_t* context);
 
-int net_read(net_tcp_context_t* context, char* chunk_edge, char* eof_edge);
+int net_recv_nonblocking(net_tcp_context_sync_t* context);
+
+int net_disconnect(net_tcp_context_t* context, int edge);
+
+int net_listen(net_tcp_context_t* context, int edge);
+
+int net_read(net_tcp_context_t* context, int chunk_edge, int eof_edge);
 
 int net_read_sync(net_tcp_context_sync_t* context);
 
-int net_write(net_tcp_context_t* context, char* edge_name);
+void net_free_read_payload(net_tcp_context_t* context);
+
+int net_serialize(net_tcp_context_t* context);
+
+int net_write(net_tcp_context_t* context, int edge);
 
 int net_write_sync(net_tcp_context_sync_t* context);
 
+int net_encode(protocol_value_t* protocol, int encoding, net_encoded_t* encoded);
+
+int net_get_cached_request(char* method, int encoding, net_encoded_t** encoded);
+
 int net_call_sync(net_tcp_context_sync_t* context);
 
 int net_hostname(net_tcp_context_t* context, char* addr, int* port);
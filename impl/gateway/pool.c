@@ -0,0 +1,158 @@
+#include "pool.h"
+#include "log.h"
+
+/**
+ * Returns the size class index of size, or -1 if it is larger than the
+ * largest class.
+ */
+int __pool_class(size_t size)
+{
+    int index = 0;
+    size_t class_size = 1 << POOL_MIN_SHIFT;
+
+    while (class_size < size) {
+        class_size <<= 1;
+        ++index;
+    }
+
+    return index < POOL_CLASSES ? index : -1;
+}
+
+void pool_init(pool_t* pool)
+{
+    log_verbose("pool_init:pool=%p", pool);
+
+    for (int i = 0; i < POOL_CLASSES; ++i) {
+        pool->free_list[i] = NULL;
+        pool->free_len[i] = 0;
+    }
+
+    pool->hits = 0;
+    pool->misses = 0;
+}
+
+/**
+ * Returns the pool of loop, which is kept in loop->data. It is created the
+ * first time it is asked for.
+ */
+pool_t* pool_get(uv_loop_t* loop)
+{
+    if (loop->data == NULL) {
+        pool_t* pool = malloc(sizeof(pool_t));
+
+        if (pool == NULL) {
+            log_error("pool_get:pool was not allocated properly");
+            exit(1);
+        }
+
+        pool_init(pool);
+        loop->data = pool;
+    }
+
+    return (pool_t*) loop->data;
+}
+
+/**
+ * Returns the size of the buffers that pool_alloc hands out for size.
+ */
+size_t pool_class_size(size_t size)
+{
+    int index = __pool_class(size);
+
+    if (index < 0) {
+        return size;
+    }
+
+    return (size_t) 1 << (POOL_MIN_SHIFT + index);
+}
+
+/**
+ * Returns a buffer of at least size bytes and sets len to its actual size.
+ * Sizes larger than the largest class are allocated and freed directly.
+ */
+void* pool_alloc(pool_t* pool, size_t size, size_t* len)
+{
+    log_verbose("pool_alloc:pool=%p, size=%lu", pool, size);
+
+    int index = __pool_class(size);
+    pool_block_t* block;
+
+    *len = pool_class_size(size);
+
+    if (index >= 0 && pool->free_list[index] != NULL) {
+        block = pool->free_list[index];
+        pool->free_list[index] = block->next;
+        --(pool->free_len[index]);
+        ++(pool->hits);
+
+        return block;
+    }
+
+    ++(pool->misses);
+    log_debug("pool_alloc:miss, hits=%lu, misses=%lu", pool->hits, pool->misses);
+
+    return malloc(*len);
+}
+
+/**
+ * Gives a buffer from pool_alloc back to the pool. len is the size that
+ * pool_alloc set. Full size classes free the buffer instead.
+ */
+void pool_free(pool_t* pool, void* base, size_t len)
+{
+    log_verbose("pool_free:pool=%p, base=%p, len=%lu", pool, base, len);
+
+    int index = __pool_class(len);
+    pool_block_t* block = (pool_block_t*) base;
+
+    if (base == NULL) {
+        return;
+    }
+
+    if (index < 0 || pool->free_len[index] >= POOL_MAX_FREE) {
+        free(base);
+        return;
+    }
+
+    block->next = pool->free_list[index];
+    pool->free_list[index] = block;
+    ++(pool->free_len[index]);
+}
+
+/**
+ * Frees every buffer held by the pool.
+ */
+void pool_clear(pool_t* pool)
+{
+    log_verbose("pool_clear:pool=%p", pool);
+
+    for (int i = 0; i < POOL_CLASSES; ++i) {
+        while (pool->free_list[i] != NULL) {
+            pool_block_t* block = pool->free_list[i];
+
+            pool->free_list[i] = block->next;
+            free(block);
+        }
+
+        pool->free_len[i] = 0;
+    }
+}
+
+/**
+ * Frees the pool of loop and its buffers, if it has one. Called once the loop
+ * has stopped running.
+ */
+void pool_delete(uv_loop_t* loop)
+{
+    log_verbose("pool_delete:loop=%p", loop);
+
+    pool_t* pool = (pool_t*) loop->data;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    pool_clear(pool);
+    free(pool);
+    loop->data = NULL;
+}
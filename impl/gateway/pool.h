@@ -0,0 +1,48 @@
+#ifndef __POOL_h__
+#define __POOL_h__
+
+#include <stdlib.h>
+#include "uv.h"
+
+#define POOL_MIN_SHIFT 10
+#define POOL_CLASSES 7
+#define POOL_MAX_FREE 64
+
+typedef struct pool_block_s pool_block_t;
+typedef struct pool_s pool_t;
+
+/**
+ * A free buffer is linked into the free list of its size class through its
+ * own first bytes.
+ */
+struct pool_block_s {
+    pool_block_t* next;
+};
+
+/**
+ * Buffer pool with power of two size classes from 1 << POOL_MIN_SHIFT bytes
+ * up. Buffers are recycled as they are, without being zeroed. A pool is not
+ * thread safe and is meant to be used by one loop only.
+ */
+struct pool_s {
+    pool_block_t* free_list[POOL_CLASSES];
+    int free_len[POOL_CLASSES];
+    unsigned long hits;
+    unsigned long misses;
+};
+
+void pool_init(pool_t* pool);
+
+pool_t* pool_get(uv_loop_t* loop);
+
+size_t pool_class_size(size_t size);
+
+void* pool_alloc(pool_t* pool, size_t size, size_t* len);
+
+void pool_free(pool_t* pool, void* base, size_t len);
+
+void pool_clear(pool_t* pool);
+
+void pool_delete(uv_loop_t* loop);
+
+#endif
@@ -1,20 +1,83 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "log.h"
 #include "err.h"
 #include "protocol.h"
 #include "machine.h"
 
+const protocol_key_t protocol_key_method = PROTOCOL_KEY("method");
+const protocol_key_t protocol_key_args = PROTOCOL_KEY("args");
+const protocol_key_t protocol_key_result = PROTOCOL_KEY("result");
+const protocol_key_t protocol_key_error = PROTOCOL_KEY("error");
+const protocol_key_t protocol_key_name = PROTOCOL_KEY("name");
+
+int __protocol_parse_indexed(protocol_value_t** protocol, char* buf, int len, arena_t* arena);
+
 /**
  * Parses the json string in buf and builds up a json structure in protocol.
+ * Messages of PROTOCOL_INDEX_MIN_LEN bytes or more are parsed from an index
+ * of their structural characters instead of by the json parser.
  */
 int protocol_parse(protocol_value_t** protocol, char* buf, int len)
 {
     log_verbose("protocol_parse:protocol=%p, buf=\"%s\", len=%d", protocol, buf, len);
 
+    if (len >= PROTOCOL_INDEX_MIN_LEN) {
+        return __protocol_parse_indexed(protocol, buf, len, NULL);
+    }
+
+    json_settings settings = {};
+    char strerr[1024] = { 0 };
+
+    settings.value_extra = json_builder_extra;
+    *protocol = json_parse_ex(&settings, buf, len, (char*) &strerr);
+
+    if (*protocol == NULL) {
+        log_error("json error:%s", &strerr);
+        return EJSON;
+    }
+
+    return 0;
+}
+
+void* __protocol_arena_alloc(size_t size, int zero, void* user_data)
+{
+    return arena_alloc((arena_t*) user_data, size, zero);
+}
+
+void __protocol_arena_free(void* ptr, void* user_data)
+{
+    // released all at once by arena_reset
+    log_verbose("__protocol_arena_free:ptr=%p, user_data=%p", ptr, user_data);
+}
+
+/**
+ * Same as protocol_parse, but the json structure is allocated from arena. It
+ * must not be passed to protocol_free_parse, it is gone with the next
+ * arena_reset instead.
+ */
+int protocol_parse_arena(protocol_value_t** protocol, char* buf, int len, arena_t* arena)
+{
+    log_verbose("protocol_parse_arena:protocol=%p, buf=\"%s\", len=%d, arena=%p", protocol, buf, len, arena);
+
+    if (len >= PROTOCOL_INDEX_MIN_LEN) {
+        return __protocol_parse_indexed(protocol, buf, len, arena);
+    }
+
     json_settings settings = {};
     char strerr[1024] = { 0 };
 
     settings.value_extra = json_builder_extra;
+    settings.mem_alloc = __protocol_arena_alloc;
+    settings.mem_free = __protocol_arena_free;
+    settings.user_data = arena;
     *protocol = json_parse_ex(&settings, buf, len, (char*) &strerr);
 
     if (*protocol == NULL) {
@@ -61,24 +124,35 @@ int protocol_is_int(protocol_value_t* protocol)
 }
 
 /**
- * Returns 1 if protocol is an object and has a key named key. Returns 0
- * otherwise.
+ * Returns the value of the entry named by the len bytes of name in protocol,
+ * or NULL if there is none or protocol is not an object.
  */
-int protocol_has_key(protocol_value_t* protocol, char* key)
+protocol_value_t* __protocol_find_entry(protocol_value_t* protocol, const char* name, unsigned int len)
 {
-    log_verbose("protocol_has_key:protocol=%p, key=\"%s\"", protocol, key);
+    if (protocol == NULL || !protocol_is_object(protocol)) {
+        return NULL;
+    }
 
-    if (protocol_is_object(protocol)) {
-        for (unsigned int i = 0; i < protocol->u.object.length; ++i) {
-            json_object_entry current_key = protocol->u.object.values[i];
+    for (unsigned int i = 0; i < protocol->u.object.length; ++i) {
+        json_object_entry* entry = &protocol->u.object.values[i];
 
-            if (strcmp(current_key.name, key) == 0) {
-                return 1;
-            }
+        if (entry->name_length == len && memcmp(entry->name, name, len) == 0) {
+            return entry->value;
         }
     }
 
-    return 0;
+    return NULL;
+}
+
+/**
+ * Returns 1 if protocol is an object and has a key named key. Returns 0
+ * otherwise.
+ */
+int protocol_has_key(protocol_value_t* protocol, char* key)
+{
+    log_verbose("protocol_has_key:protocol=%p, key=\"%s\"", protocol, key);
+
+    return __protocol_find_entry(protocol, key, strlen(key)) != NULL;
 }
 
 /**
@@ -89,18 +163,27 @@ int protocol_get_key(protocol_value_t* protocol, protocol_value_t** dest, char*
 {
     log_verbose("protocol_get_key:protocol=%p, dest=%p, key=\"%s\"", protocol, dest, key);
 
-    if (protocol_is_object(protocol)) {
-        for (unsigned int i = 0; i < protocol->u.object.length; ++i) {
-            json_object_entry current_key = protocol->u.object.values[i];
+    protocol_value_t* value = __protocol_find_entry(protocol, key, strlen(key));
 
-            if (strcmp(current_key.name, key) == 0) {
-                *dest = current_key.value;
-                return 0;
-            }
-        }
+    if (value == NULL) {
+        return ENFND;
     }
 
-    return ENFND;
+    *dest = value;
+
+    return 0;
+}
+
+/**
+ * Returns the value associated with key in protocol, or NULL if there is
+ * none. Tells whether the key is there and gets its value with one scan,
+ * where protocol_has_key and protocol_get_key take one each.
+ */
+protocol_value_t* protocol_find_key(protocol_value_t* protocol, const protocol_key_t* key)
+{
+    log_verbose("protocol_find_key:protocol=%p, key=\"%s\"", protocol, key->name);
+
+    return __protocol_find_entry(protocol, key->name, key->len);
 }
 
 /**
@@ -147,6 +230,10 @@ int protocol_get_at(protocol_value_t* protocol, protocol_value_t** dest, int ind
     return EPTCL;
 }
 
+/**
+ * Copies the string value of protocol into buf, which must have room for all
+ * of it. protocol_copy_string is the bounded version.
+ */
 int protocol_get_string(protocol_value_t* protocol, char* buf)
 {
     log_verbose("protocol_get_string:protocol=%p, buf=%s", protocol, buf);
@@ -159,6 +246,55 @@ int protocol_get_string(protocol_value_t* protocol, char* buf)
     return EPTCL;
 }
 
+/**
+ * Points view at the string value of protocol without copying it.
+ */
+int protocol_get_string_view(protocol_value_t* protocol, protocol_string_t* view)
+{
+    log_verbose("protocol_get_string_view:protocol=%p, view=%p", protocol, view);
+
+    if (protocol_is_string(protocol)) {
+        view->ptr = protocol->u.string.ptr;
+        view->len = protocol->u.string.length;
+        return 0;
+    }
+
+    return EPTCL;
+}
+
+/**
+ * Copies the string value of protocol into buf, which has room for size
+ * bytes. A string that does not fit is cut off and EBNDS is returned, buf is
+ * NUL terminated either way.
+ */
+int protocol_copy_string(protocol_value_t* protocol, char* buf, size_t size)
+{
+    log_verbose("protocol_copy_string:protocol=%p, buf=%p, size=%zu", protocol, buf, size);
+
+    int r;
+    protocol_string_t view;
+    size_t len;
+
+    r = protocol_get_string_view(protocol, &view);
+
+    if (r) {
+        return r;
+    }
+
+    len = view.len < size ? view.len : size - 1;
+    memcpy(buf, view.ptr, len);
+    buf[len] = '\0';
+
+    return len == view.len ? 0 : EBNDS;
+}
+
+int protocol_string_equals(protocol_string_t* view, char* str)
+{
+    log_verbose("protocol_string_equals:view=%p, str=\"%s\"", view, str);
+
+    return strlen(str) == view->len && memcmp(view->ptr, str, view->len) == 0;
+}
+
 int protocol_get_bool(protocol_value_t* protocol)
 {
     log_verbose("protocol_get_bool:protocol=%p", protocol);
@@ -267,7 +403,8 @@ int protocol_build_response_error(protocol_value_t** protocol, char* name, char*
 /**
  * Retrieves the error name and the error message found in the errorenous
  * protocol. If protocol does not follow the error standard, return an error
- * code. Returns 0 otherwise.
+ * code. Returns 0 otherwise. error_name and error_message must have room for
+ * PROTOCOL_ERROR_NAME_LEN and PROTOCOL_ERROR_MESSAGE_LEN bytes.
  */
 int protocol_get_response_error(protocol_value_t* protocol, char* error_name, char* error_message)
 {
@@ -283,28 +420,15 @@ int protocol_get_response_error(protocol_value_t* protocol, char* error_name, ch
         return 0;
     }
 
-    if (protocol_has_key(protocol, "error")) {
-        int r;
-        protocol_value_t* error;
-        protocol_value_t* name_str;
-        protocol_value_t* args_arr;
-
-        r = protocol_get_key(protocol, &error, "error");
-
-        if (r) {
-            return r;
-        }
-
-        r = protocol_get_key(error, &name_str, "name");
-
-        if (r) {
-            return r;
-        }
+    protocol_value_t* error = protocol_find_key(protocol, &protocol_key_error);
 
-        r = protocol_get_key(error, &args_arr, "args");
+    if (error != NULL) {
+        int r;
+        protocol_value_t* name_str = protocol_find_key(error, &protocol_key_name);
+        protocol_value_t* args_arr = protocol_find_key(error, &protocol_key_args);
 
-        if (r) {
-            return r;
+        if (name_str == NULL || args_arr == NULL) {
+            return ENFND;
         }
 
         if (protocol_get_length(args_arr) > 0) {
@@ -316,16 +440,17 @@ int protocol_get_response_error(protocol_value_t* protocol, char* error_name, ch
                 return r;
             }
 
-            r = protocol_get_string(msg_str, error_message);
+            // a message that is cut off still tells what went wrong
+            r = protocol_copy_string(msg_str, error_message, PROTOCOL_ERROR_MESSAGE_LEN);
 
-            if (r) {
+            if (r && r != EBNDS) {
                 return r;
             }
         }
 
-        r = protocol_get_string(name_str, error_name);
+        r = protocol_copy_string(name_str, error_name, PROTOCOL_ERROR_NAME_LEN);
 
-        if (r) {
+        if (r && r != EBNDS) {
             return r;
         }
 
@@ -344,8 +469,8 @@ void protocol_check_response_error(protocol_value_t* protocol)
     log_verbose("protocol_check_response_error:protocol=%p", protocol);
 
     int r;
-    char err_name[48];
-    char err_msg[1024];
+    char err_name[PROTOCOL_ERROR_NAME_LEN];
+    char err_msg[PROTOCOL_ERROR_MESSAGE_LEN];
 
     r = protocol_get_response_error(protocol, (char*) &err_name, (char*) &err_msg);
 
@@ -357,7 +482,8 @@ void protocol_check_response_error(protocol_value_t* protocol)
 
 /**
  * Assuming devices is a list of <addr, port> tuples; retrieves the device at
- * index and fills addr and port with its value.
+ * index and fills addr and port with its value. addr must have room for
+ * PROTOCOL_ADDR_LEN bytes.
  */
 int protocol_get_device(protocol_value_t* devices, unsigned int index, char* addr, int* port)
 {
@@ -400,7 +526,7 @@ int protocol_get_device(protocol_value_t* devices, unsigned int index, char* add
         return r;
     }
 
-    r = protocol_get_string(addr_val, addr);
+    r = protocol_copy_string(addr_val, addr, PROTOCOL_ADDR_LEN);
 
     if (r) {
         return r;
@@ -438,7 +564,7 @@ int protocol_get_devices(protocol_value_t* devices, struct sockaddr_storage** de
     }
 
     for (int i = 0; i < len; ++i) {
-        char addrstr[128];
+        char addrstr[PROTOCOL_ADDR_LEN];
         int portint;
         struct sockaddr_storage* saddr;
 
@@ -463,21 +589,1680 @@ int protocol_get_devices(protocol_value_t* devices, struct sockaddr_storage** de
     return 0;
 }
 
-size_t protocol_size(protocol_value_t* protocol)
+int __protocol_hex_value(char c)
 {
-    log_verbose("protocol_size:protocol=%p", protocol);
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
 
-    return json_measure(protocol);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
 }
 
-int protocol_to_json(protocol_value_t* protocol, char* buf)
+/**
+ * Whether a uuid has a dash before the byte at index.
+ */
+int __protocol_event_dash(int index)
 {
-    log_verbose("protocol_to_json:protocol=%p, buf=%p", protocol, buf);
+    return index == 4 || index == 6 || index == 8 || index == 10;
+}
 
-    json_serialize_opts opts = {};
+/**
+ * Reads the uuid in the len bytes of str, in its usual 8-4-4-4-12 form, into
+ * event. Returns EPTCL if str is not such a uuid.
+ */
+int protocol_parse_event(const char* str, size_t len, protocol_event_t* event)
+{
+    log_verbose("protocol_parse_event:str=%p, len=%zu, event=%p", str, len, event);
+
+    if (len != PROTOCOL_EVENT_STR_LEN - 1) {
+        return EPTCL;
+    }
+
+    for (int i = 0; i < PROTOCOL_EVENT_ID_LEN; ++i) {
+        int high;
+        int low;
+
+        if (__protocol_event_dash(i) && *str++ != '-') {
+            return EPTCL;
+        }
+
+        high = __protocol_hex_value(*str++);
+        low = __protocol_hex_value(*str++);
+
+        if (high < 0 || low < 0) {
+            return EPTCL;
+        }
+
+        event->bytes[i] = (unsigned char) (high << 4 | low);
+    }
+
+    return 0;
+}
+
+/**
+ * Writes event as a lower case uuid to buf, which has room for
+ * PROTOCOL_EVENT_STR_LEN bytes.
+ */
+void protocol_format_event(const protocol_event_t* event, char* buf)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    for (int i = 0; i < PROTOCOL_EVENT_ID_LEN; ++i) {
+        if (__protocol_event_dash(i)) {
+            *buf++ = '-';
+        }
+
+        *buf++ = hex[event->bytes[i] >> 4];
+        *buf++ = hex[event->bytes[i] & 0x0f];
+    }
+
+    *buf = '\0';
+}
+
+int __protocol_get_event(protocol_value_t* protocol, protocol_event_t* event)
+{
+    int r;
+    protocol_string_t view;
+
+    r = protocol_get_string_view(protocol, &view);
+
+    if (r) {
+        return r;
+    }
+
+    return protocol_parse_event(view.ptr, view.len, event);
+}
+
+/**
+ * Reads the event ids in result into events, where result is either one event
+ * id (a next_event reply) or an array of them (a next_events reply). Returns
+ * the number of events read or an error code.
+ */
+int protocol_get_events(protocol_value_t* result, protocol_event_t* events, int max)
+{
+    log_verbose("protocol_get_events:result=%p, events=%p, max=%d", result, events, max);
+
+    int r;
+    int len;
+
+    if (protocol_is_string(result)) {
+        r = __protocol_get_event(result, &events[0]);
+
+        if (r) {
+            return r;
+        }
+
+        return 1;
+    }
+
+    len = protocol_get_length(result);
+
+    if (len < 0) {
+        return len;
+    }
+
+    if (len > max) {
+        return EBNDS;
+    }
+
+    for (int i = 0; i < len; ++i) {
+        protocol_value_t* event;
+
+        r = protocol_get_at(result, &event, i);
+
+        if (r) {
+            return r;
+        }
+
+        r = __protocol_get_event(event, &events[i]);
+
+        if (r) {
+            return r;
+        }
+    }
+
+    return len;
+}
+
+char* __protocol_skip_space(char* p, char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        ++p;
+    }
+
+    return p;
+}
+
+/**
+ * Returns the first quote, backslash or control character at or after p, or
+ * end if there is none. Those are the bytes that end a run of plain string
+ * characters. With SSE2 sixteen bytes are checked at a time.
+ */
+char* __protocol_find_string_end(char* p, char* end)
+{
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        __m128i hits = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash)),
+                // unsigned block <= 0x1f
+                _mm_cmpeq_epi8(_mm_min_epu8(block, control), block));
+        int mask = _mm_movemask_epi8(hits);
+
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+#endif
+
+    while (p < end && *p != '"' && *p != '\\' && (unsigned char) *p >= 0x20) {
+        ++p;
+    }
+
+    return p;
+}
+
+/**
+ * Copies the json string at p into dest, which has room for size bytes.
+ * Strings with escapes are not read. Returns the position after the closing
+ * quote, or NULL.
+ */
+char* __protocol_scan_string(char* p, char* end, char* dest, size_t size)
+{
+    char* start;
+
+    if (p == end || *p != '"') {
+        return NULL;
+    }
+
+    start = ++p;
+    p = __protocol_find_string_end(p, end);
+
+    if (p == end || *p != '"' || (size_t) (p - start) >= size) {
+        return NULL;
+    }
+
+    memcpy(dest, start, p - start);
+    dest[p - start] = '\0';
+
+    return p + 1;
+}
+
+/**
+ * Reads the int or string at p into scalar. Returns the position after the
+ * value, or NULL if it is anything else.
+ */
+char* __protocol_scan_scalar(char* p, char* end, protocol_scalar_t* scalar)
+{
+    long long value = 0;
+    int sign = 1;
+    char* digits;
+
+    if (p < end && *p == '"') {
+        scalar->type = PROTOCOL_SCALAR_STRING;
+        return __protocol_scan_string(p, end, scalar->string, PROTOCOL_EVENT_LEN);
+    }
+
+    if (p < end && *p == '-') {
+        sign = -1;
+        ++p;
+    }
+
+    digits = p;
+
+    while (p < end && *p >= '0' && *p <= '9' && p - digits < 10) {
+        value = value * 10 + (*p - '0');
+        ++p;
+    }
+
+    if (p == digits || value > 0x7fffffff) {
+        return NULL;
+    }
+
+    // fractions and exponents, or more digits than an int has
+    if (p < end && ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E')) {
+        return NULL;
+    }
+
+    scalar->type = PROTOCOL_SCALAR_INT;
+    scalar->value = sign * value;
+
+    return p;
+}
+
+int __protocol_scan_object(char* p, char* end, protocol_scalar_t* scalar)
+{
+    char key[PROTOCOL_EVENT_LEN];
+    protocol_scalar_t other;
+    int found = 0;
+
+    p = __protocol_skip_space(p, end);
+
+    if (p == end || *p != '{') {
+        return ENSCL;
+    }
+
+    p = __protocol_skip_space(p + 1, end);
+
+    while (1) {
+        int is_result;
+
+        p = __protocol_scan_string(p, end, key, sizeof(key));
+
+        if (p == NULL) {
+            return ENSCL;
+        }
+
+        p = __protocol_skip_space(p, end);
+
+        if (p == end || *p != ':') {
+            return ENSCL;
+        }
+
+        is_result = strcmp(key, "result") == 0;
+        p = __protocol_scan_scalar(__protocol_skip_space(p + 1, end), end, is_result ? scalar : &other);
+
+        if (p == NULL) {
+            return ENSCL;
+        }
+
+        found |= is_result;
+        p = __protocol_skip_space(p, end);
+
+        if (p < end && *p == '}') {
+            break;
+        }
+
+        if (p == end || *p != ',') {
+            return ENSCL;
+        }
+
+        p = __protocol_skip_space(p + 1, end);
+    }
+
+    if (!found || __protocol_skip_space(p + 1, end) != end) {
+        return ENSCL;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the result of the json response in the len bytes of buf into scalar
+ * when it is an int or a string, which is all the status and next_event
+ * replies carry, without building the response. Every other member must be
+ * an int or a string too. Returns ENSCL if the response has to be parsed
+ * instead, e.g. because it is an error or a batch of events; scalar->type is
+ * then PROTOCOL_SCALAR_NONE.
+ */
+int protocol_scan_result(char* buf, int len, protocol_scalar_t* scalar)
+{
+    log_verbose("protocol_scan_result:buf=%p, len=%d, scalar=%p", buf, len, scalar);
+
+    int r = __protocol_scan_object(buf, buf + len, scalar);
+
+    if (r) {
+        scalar->type = PROTOCOL_SCALAR_NONE;
+    }
+
+    return r;
+}
+
+/**
+ * Whether the response has a result, be it scanned into scalar or parsed
+ * into response.
+ */
+int protocol_has_result(protocol_value_t* response, protocol_scalar_t* scalar)
+{
+    log_verbose("protocol_has_result:response=%p, scalar=%p", response, scalar);
+
+    if (scalar != NULL && scalar->type != PROTOCOL_SCALAR_NONE) {
+        return 1;
+    }
+
+    return protocol_find_key(response, &protocol_key_result) != NULL;
+}
+
+/**
+ * Returns the int result of the response, taken from scalar if it was
+ * scanned and from response otherwise. Exits if the response is an error.
+ */
+int protocol_get_result_int(protocol_value_t* response, protocol_scalar_t* scalar)
+{
+    log_verbose("protocol_get_result_int:response=%p, scalar=%p", response, scalar);
+
+    protocol_value_t* result;
+
+    if (scalar != NULL && scalar->type != PROTOCOL_SCALAR_NONE) {
+        return scalar->type == PROTOCOL_SCALAR_INT ? scalar->value : EPTCL;
+    }
+
+    protocol_check_response_error(response);
+    result = protocol_find_key(response, &protocol_key_result);
+
+    if (result == NULL) {
+        return ENFND;
+    }
+
+    return protocol_get_int(result);
+}
+
+/**
+ * Like protocol_get_events on the result of the response, taken from scalar
+ * if it was scanned and from response otherwise. Exits if the response is an
+ * error.
+ */
+int protocol_get_result_events(
+        protocol_value_t* response,
+        protocol_scalar_t* scalar,
+        protocol_event_t* events,
+        int max)
+{
+    log_verbose(
+            "protocol_get_result_events:response=%p, scalar=%p, events=%p, max=%d",
+            response,
+            scalar,
+            events,
+            max);
+
+    int r;
+    protocol_value_t* result;
+
+    if (scalar != NULL && scalar->type != PROTOCOL_SCALAR_NONE) {
+        if (scalar->type != PROTOCOL_SCALAR_STRING) {
+            return EPTCL;
+        }
+
+        r = protocol_parse_event(scalar->string, strlen(scalar->string), &events[0]);
+
+        if (r) {
+            return r;
+        }
+
+        return 1;
+    }
+
+    protocol_check_response_error(response);
+    result = protocol_find_key(response, &protocol_key_result);
+
+    if (result == NULL) {
+        return ENFND;
+    }
+
+    return protocol_get_events(result, events, max);
+}
+
+size_t protocol_size(protocol_value_t* protocol)
+{
+    log_verbose("protocol_size:protocol=%p", protocol);
+
+    return json_measure(protocol);
+}
+
+int protocol_to_json(protocol_value_t* protocol, char* buf)
+{
+    log_verbose("protocol_to_json:protocol=%p, buf=%p", protocol, buf);
+
+    json_serialize_opts opts = {};
+
+    opts.mode = json_serialize_mode_packed;
+    json_serialize_ex(buf, protocol, opts);
+    return 0;
+}
+
+/**
+ * Output cursor of protocol_serialize. Writes past size are counted in len but
+ * not stored, so an overflow is only checked once at the end.
+ */
+typedef struct {
+    char* buf;
+    size_t size;
+    size_t len;
+} __protocol_out_t;
+
+void __protocol_put(__protocol_out_t* out, const char* data, size_t len)
+{
+    if (out->len + len <= out->size) {
+        memcpy(out->buf + out->len, data, len);
+    }
+
+    out->len += len;
+}
+
+void __protocol_put_string(__protocol_out_t* out, const char* str, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0;
+
+    __protocol_put(out, "\"", 1);
+
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = str[i];
+        char escape[6] = { '\\', 0, '0', '0', 0, 0 };
+        size_t escape_len = 2;
+
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        switch (c) {
+            case '"': escape[1] = '"'; break;
+            case '\\': escape[1] = '\\'; break;
+            case '\b': escape[1] = 'b'; break;
+            case '\f': escape[1] = 'f'; break;
+            case '\n': escape[1] = 'n'; break;
+            case '\r': escape[1] = 'r'; break;
+            case '\t': escape[1] = 't'; break;
+            default:
+                escape[1] = 'u';
+                escape[4] = hex[c >> 4];
+                escape[5] = hex[c & 0xf];
+                escape_len = 6;
+        }
+
+        __protocol_put(out, str + start, i - start);
+        __protocol_put(out, escape, escape_len);
+        start = i + 1;
+    }
+
+    __protocol_put(out, str + start, len - start);
+    __protocol_put(out, "\"", 1);
+}
+
+void __protocol_put_value(__protocol_out_t* out, protocol_value_t* value)
+{
+    char num[32];
+    int num_len;
+
+    switch (value->type) {
+        case json_object:
+            __protocol_put(out, "{", 1);
+
+            for (unsigned int i = 0; i < value->u.object.length; ++i) {
+                if (i > 0) {
+                    __protocol_put(out, ",", 1);
+                }
+
+                __protocol_put_string(out, value->u.object.values[i].name, value->u.object.values[i].name_length);
+                __protocol_put(out, ":", 1);
+                __protocol_put_value(out, value->u.object.values[i].value);
+            }
+
+            __protocol_put(out, "}", 1);
+            break;
+        case json_array:
+            __protocol_put(out, "[", 1);
+
+            for (unsigned int i = 0; i < value->u.array.length; ++i) {
+                if (i > 0) {
+                    __protocol_put(out, ",", 1);
+                }
+
+                __protocol_put_value(out, value->u.array.values[i]);
+            }
+
+            __protocol_put(out, "]", 1);
+            break;
+        case json_string:
+            __protocol_put_string(out, value->u.string.ptr, value->u.string.length);
+            break;
+        case json_integer:
+            num_len = snprintf(num, sizeof(num), "%lld", (long long) value->u.integer);
+            __protocol_put(out, num, num_len);
+            break;
+        case json_double:
+            num_len = snprintf(num, sizeof(num), "%g", value->u.dbl);
+            __protocol_put(out, num, num_len);
+
+            // keep it a double on the other side
+            if (strpbrk(num, ".eEn") == NULL) {
+                __protocol_put(out, ".0", 2);
+            }
+            break;
+        case json_boolean:
+            if (value->u.boolean) {
+                __protocol_put(out, "true", 4);
+            }
+            else {
+                __protocol_put(out, "false", 5);
+            }
+            break;
+        default:
+            __protocol_put(out, "null", 4);
+    }
+}
+
+/**
+ * Serializes protocol as packed json into buf in a single pass. The output is
+ * not null terminated. Returns the length of the output, or EBNDS if it does
+ * not fit in size bytes.
+ */
+int protocol_serialize(protocol_value_t* protocol, char* buf, size_t size)
+{
+    log_verbose("protocol_serialize:protocol=%p, buf=%p, size=%zu", protocol, buf, size);
+
+    __protocol_out_t out = { .buf = buf, .size = size, .len = 0 };
+
+    __protocol_put_value(&out, protocol);
+
+    if (out.len > size) {
+        return EBNDS;
+    }
+
+    return out.len;
+}
+
+/**
+ * Puts tag followed by the lowest bytes bytes of value, big endian as msgpack
+ * wants it.
+ */
+void __protocol_put_tag(__protocol_out_t* out, unsigned char tag, uint64_t value, int bytes)
+{
+    unsigned char data[9];
+
+    data[0] = tag;
+
+    for (int i = 0; i < bytes; ++i) {
+        data[bytes - i] = (unsigned char) (value >> (8 * i));
+    }
+
+    __protocol_put(out, (char*) data, bytes + 1);
+}
+
+/**
+ * Puts the header of a msgpack str, array or map with len elements in its
+ * smallest form. fix is the tag of the form that holds up to fix_max elements
+ * in the tag itself, tag is the tag of the 16 bit form, followed by the tag of
+ * the 32 bit form.
+ */
+void __protocol_put_length(__protocol_out_t* out, unsigned char fix, size_t fix_max, unsigned char tag, size_t len)
+{
+    if (len <= fix_max) {
+        __protocol_put_tag(out, fix | len, 0, 0);
+    }
+    else if (len <= 0xffff) {
+        __protocol_put_tag(out, tag, len, 2);
+    }
+    else {
+        __protocol_put_tag(out, tag + 1, len, 4);
+    }
+}
+
+void __protocol_put_msgpack_string(__protocol_out_t* out, const char* str, size_t len)
+{
+    if (len > 31 && len <= 0xff) {
+        __protocol_put_tag(out, 0xd9, len, 1);
+    }
+    else {
+        __protocol_put_length(out, 0xa0, 31, 0xda, len);
+    }
+
+    __protocol_put(out, str, len);
+}
+
+void __protocol_put_msgpack_int(__protocol_out_t* out, json_int_t value)
+{
+    if (value >= 0) {
+        if (value <= 0x7f) {
+            __protocol_put_tag(out, value, 0, 0);
+        }
+        else if (value <= 0xff) {
+            __protocol_put_tag(out, 0xcc, value, 1);
+        }
+        else if (value <= 0xffff) {
+            __protocol_put_tag(out, 0xcd, value, 2);
+        }
+        else if (value <= 0xffffffffLL) {
+            __protocol_put_tag(out, 0xce, value, 4);
+        }
+        else {
+            __protocol_put_tag(out, 0xcf, value, 8);
+        }
+    }
+    else if (value >= -32) {
+        __protocol_put_tag(out, (unsigned char) value, 0, 0);
+    }
+    else if (value >= INT8_MIN) {
+        __protocol_put_tag(out, 0xd0, value, 1);
+    }
+    else if (value >= INT16_MIN) {
+        __protocol_put_tag(out, 0xd1, value, 2);
+    }
+    else if (value >= INT32_MIN) {
+        __protocol_put_tag(out, 0xd2, value, 4);
+    }
+    else {
+        __protocol_put_tag(out, 0xd3, value, 8);
+    }
+}
+
+void __protocol_put_msgpack_value(__protocol_out_t* out, protocol_value_t* value)
+{
+    uint64_t bits;
+
+    switch (value->type) {
+        case json_object:
+            __protocol_put_length(out, 0x80, 15, 0xde, value->u.object.length);
+
+            for (unsigned int i = 0; i < value->u.object.length; ++i) {
+                __protocol_put_msgpack_string(out, value->u.object.values[i].name, value->u.object.values[i].name_length);
+                __protocol_put_msgpack_value(out, value->u.object.values[i].value);
+            }
+            break;
+        case json_array:
+            __protocol_put_length(out, 0x90, 15, 0xdc, value->u.array.length);
+
+            for (unsigned int i = 0; i < value->u.array.length; ++i) {
+                __protocol_put_msgpack_value(out, value->u.array.values[i]);
+            }
+            break;
+        case json_string:
+            __protocol_put_msgpack_string(out, value->u.string.ptr, value->u.string.length);
+            break;
+        case json_integer:
+            __protocol_put_msgpack_int(out, value->u.integer);
+            break;
+        case json_double:
+            memcpy(&bits, &value->u.dbl, sizeof(bits));
+            __protocol_put_tag(out, 0xcb, bits, 8);
+            break;
+        case json_boolean:
+            __protocol_put_tag(out, value->u.boolean ? 0xc3 : 0xc2, 0, 0);
+            break;
+        default:
+            __protocol_put_tag(out, 0xc0, 0, 0);
+    }
+}
+
+/**
+ * Serializes protocol as msgpack into buf in a single pass. Returns the length
+ * of the output, or EBNDS if it does not fit in size bytes.
+ */
+int protocol_serialize_msgpack(protocol_value_t* protocol, char* buf, size_t size)
+{
+    log_verbose("protocol_serialize_msgpack:protocol=%p, buf=%p, size=%zu", protocol, buf, size);
+
+    __protocol_out_t out = { .buf = buf, .size = size, .len = 0 };
+
+    __protocol_put_msgpack_value(&out, protocol);
+
+    if (out.len > size) {
+        return EBNDS;
+    }
+
+    return out.len;
+}
+
+typedef struct {
+    const unsigned char* p;
+    const unsigned char* end;
+    arena_t* arena;
+} __protocol_in_t;
+
+/**
+ * Allocates from in->arena if there is one. Otherwise the parts are allocated
+ * one by one like the json parser does, so that protocol_free_parse works on
+ * the result.
+ */
+void* __protocol_in_alloc(__protocol_in_t* in, size_t size, int zero)
+{
+    if (in->arena != NULL) {
+        return arena_alloc(in->arena, size, zero);
+    }
+
+    return zero ? calloc(1, size) : malloc(size);
+}
+
+/**
+ * Reads a big endian unsigned integer of bytes bytes. Returns 0, or EMPCK if
+ * the input ends before it.
+ */
+int __protocol_get_uint(__protocol_in_t* in, int bytes, uint64_t* value)
+{
+    if (in->end - in->p < bytes) {
+        return EMPCK;
+    }
+
+    *value = 0;
+
+    for (int i = 0; i < bytes; ++i) {
+        *value = (*value << 8) | *(in->p)++;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies a string of len bytes into a new null terminated buffer.
+ */
+char* __protocol_get_bytes(__protocol_in_t* in, size_t len)
+{
+    char* str;
+
+    if ((size_t) (in->end - in->p) < len) {
+        return NULL;
+    }
+
+    str = __protocol_in_alloc(in, len + 1, 0);
+
+    if (str != NULL) {
+        memcpy(str, in->p, len);
+        str[len] = 0;
+        in->p += len;
+    }
+
+    return str;
+}
+
+/**
+ * Reads the bytes bytes long length of a str, array or map. Returns 0, or
+ * EMPCK if there are not that many bytes left.
+ */
+int __protocol_get_length(__protocol_in_t* in, int bytes, size_t* len)
+{
+    uint64_t value;
+    int r = __protocol_get_uint(in, bytes, &value);
+
+    if (r) {
+        return r;
+    }
+
+    // every element takes at least a byte, so a longer length is broken
+    if (value > (uint64_t) (in->end - in->p)) {
+        return EMPCK;
+    }
+
+    *len = value;
+
+    return 0;
+}
+
+protocol_value_t* __protocol_get_msgpack_value(__protocol_in_t* in, int depth);
+
+void __protocol_in_free(__protocol_in_t* in, protocol_value_t* value)
+{
+    if (in->arena == NULL) {
+        json_value_free(value);
+    }
+}
+
+protocol_value_t* __protocol_get_msgpack_object(__protocol_in_t* in, protocol_value_t* value, size_t len, int depth)
+{
+    value->type = json_object;
+    value->u.object.values = __protocol_in_alloc(in, (len > 0 ? len : 1) * sizeof(json_object_entry), 0);
+
+    for (size_t i = 0; i < len && value->u.object.values != NULL; ++i) {
+        json_object_entry* entry = &value->u.object.values[i];
+        unsigned char tag;
+        size_t name_len;
+        int r = EMPCK;
+
+        if (in->p < in->end) {
+            tag = *(in->p)++;
+
+            if ((tag & 0xe0) == 0xa0) {
+                name_len = tag & 0x1f;
+                r = 0;
+            }
+            else if (tag >= 0xd9 && tag <= 0xdb) {
+                r = __protocol_get_length(in, 1 << (tag - 0xd9), &name_len);
+            }
+        }
+
+        if (r) {
+            break;
+        }
+
+        entry->name = __protocol_get_bytes(in, name_len);
+
+        if (entry->name == NULL) {
+            break;
+        }
+
+        entry->name_length = name_len;
+        entry->value = __protocol_get_msgpack_value(in, depth + 1);
+
+        if (entry->value == NULL) {
+            if (in->arena == NULL) {
+                free(entry->name);
+            }
+            break;
+        }
+
+        entry->value->parent = value;
+        value->u.object.length = i + 1;
+    }
+
+    if (value->u.object.values == NULL || value->u.object.length != len) {
+        __protocol_in_free(in, value);
+        return NULL;
+    }
+
+    return value;
+}
+
+protocol_value_t* __protocol_get_msgpack_array(__protocol_in_t* in, protocol_value_t* value, size_t len, int depth)
+{
+    value->type = json_array;
+    value->u.array.values = __protocol_in_alloc(in, (len > 0 ? len : 1) * sizeof(protocol_value_t*), 0);
+
+    for (size_t i = 0; i < len && value->u.array.values != NULL; ++i) {
+        protocol_value_t* element = __protocol_get_msgpack_value(in, depth + 1);
+
+        if (element == NULL) {
+            break;
+        }
+
+        element->parent = value;
+        value->u.array.values[i] = element;
+        value->u.array.length = i + 1;
+    }
+
+    if (value->u.array.values == NULL || value->u.array.length != len) {
+        __protocol_in_free(in, value);
+        return NULL;
+    }
+
+    return value;
+}
+
+/**
+ * Reads one msgpack value, and everything in it, into a value laid out like
+ * the ones of the json parser. Returns NULL if the input is broken, nested
+ * deeper than PROTOCOL_MAX_DEPTH or uses a type json does not have.
+ */
+protocol_value_t* __protocol_get_msgpack_value(__protocol_in_t* in, int depth)
+{
+    protocol_value_t* value;
+    unsigned char tag;
+    uint64_t bits = 0;
+    uint32_t bits32;
+    float f;
+    size_t len;
+    int r = 0;
+
+    if (in->p >= in->end || depth > PROTOCOL_MAX_DEPTH) {
+        return NULL;
+    }
+
+    value = __protocol_in_alloc(in, sizeof(protocol_value_t) + json_builder_extra, 1);
+
+    if (value == NULL) {
+        return NULL;
+    }
+
+    tag = *(in->p)++;
+
+    if (tag <= 0x7f || tag >= 0xe0) {
+        // positive and negative fixint
+        value->type = json_integer;
+        value->u.integer = (int8_t) tag;
+    }
+    else if ((tag & 0xf0) == 0x80) {
+        return __protocol_get_msgpack_object(in, value, tag & 0x0f, depth);
+    }
+    else if ((tag & 0xf0) == 0x90) {
+        return __protocol_get_msgpack_array(in, value, tag & 0x0f, depth);
+    }
+    else if ((tag & 0xe0) == 0xa0 || (tag >= 0xd9 && tag <= 0xdb)) {
+        len = tag & 0x1f;
+
+        if (tag >= 0xd9) {
+            r = __protocol_get_length(in, 1 << (tag - 0xd9), &len);
+        }
+
+        value->type = json_string;
+        value->u.string.ptr = r ? NULL : __protocol_get_bytes(in, len);
+        value->u.string.length = len;
+        r = value->u.string.ptr == NULL ? EMPCK : 0;
+    }
+    else {
+        switch (tag) {
+            case 0xc0:
+                value->type = json_null;
+                break;
+            case 0xc2:
+            case 0xc3:
+                value->type = json_boolean;
+                value->u.boolean = tag == 0xc3;
+                break;
+            case 0xca:
+                r = __protocol_get_uint(in, 4, &bits);
+                bits32 = (uint32_t) bits;
+                memcpy(&f, &bits32, sizeof(f));
+                value->type = json_double;
+                value->u.dbl = f;
+                break;
+            case 0xcb:
+                r = __protocol_get_uint(in, 8, &bits);
+                value->type = json_double;
+                memcpy(&value->u.dbl, &bits, sizeof(bits));
+                break;
+            case 0xcc:
+            case 0xcd:
+            case 0xce:
+            case 0xcf:
+                r = __protocol_get_uint(in, 1 << (tag - 0xcc), &bits);
+                value->type = json_integer;
+                value->u.integer = (json_int_t) bits;
+                break;
+            case 0xd0:
+                r = __protocol_get_uint(in, 1, &bits);
+                value->type = json_integer;
+                value->u.integer = (int8_t) bits;
+                break;
+            case 0xd1:
+                r = __protocol_get_uint(in, 2, &bits);
+                value->type = json_integer;
+                value->u.integer = (int16_t) bits;
+                break;
+            case 0xd2:
+                r = __protocol_get_uint(in, 4, &bits);
+                value->type = json_integer;
+                value->u.integer = (int32_t) bits;
+                break;
+            case 0xd3:
+                r = __protocol_get_uint(in, 8, &bits);
+                value->type = json_integer;
+                value->u.integer = (int64_t) bits;
+                break;
+            case 0xdc:
+            case 0xdd:
+                r = __protocol_get_length(in, tag == 0xdc ? 2 : 4, &len);
+
+                if (r == 0) {
+                    return __protocol_get_msgpack_array(in, value, len, depth);
+                }
+                break;
+            case 0xde:
+            case 0xdf:
+                r = __protocol_get_length(in, tag == 0xde ? 2 : 4, &len);
+
+                if (r == 0) {
+                    return __protocol_get_msgpack_object(in, value, len, depth);
+                }
+                break;
+            default:
+                r = EMPCK;
+        }
+    }
+
+    if (r) {
+        __protocol_in_free(in, value);
+        return NULL;
+    }
+
+    return value;
+}
+
+/**
+ * Parses the msgpack in buf into the same structure as protocol_parse does.
+ * With an arena the structure is allocated from it, like protocol_parse_arena,
+ * otherwise it is freed with protocol_free_parse.
+ */
+int protocol_parse_msgpack(protocol_value_t** protocol, char* buf, int len, arena_t* arena)
+{
+    log_verbose("protocol_parse_msgpack:protocol=%p, buf=%p, len=%d, arena=%p", protocol, buf, len, arena);
+
+    __protocol_in_t in = {
+        .p = (unsigned char*) buf,
+        .end = (unsigned char*) buf + len,
+        .arena = arena
+    };
+
+    *protocol = __protocol_get_msgpack_value(&in, 0);
+
+    if (*protocol != NULL && in.p != in.end) {
+        __protocol_in_free(&in, *protocol);
+        *protocol = NULL;
+    }
+
+    if (*protocol == NULL) {
+        log_error("msgpack error:broken message of %d bytes", len);
+        return EMPCK;
+    }
+
+    return 0;
+}
+
+/**
+ * Positions of the structural characters of a json message, that is of every
+ * quote and of every {}[]:, outside of strings. count is set at the position
+ * of every [ and { to the number of elements of that array or object.
+ */
+typedef struct {
+    uint32_t* positions;
+    uint32_t* counts;
+    size_t len;
+    size_t size;
+} __protocol_index_t;
+
+static __thread __protocol_index_t __protocol_index;
+
+/**
+ * Sets a bit for every quote, backslash and {}[]:, among the 64 bytes at p.
+ * With AVX2 the bytes are compared 32 at a time and with SSE2 16 at a time.
+ * The brackets and braces are found with a single compare each by setting
+ * the bit that tells [ from { and ] from }.
+ */
+void __protocol_index_block(const unsigned char* p, uint64_t* quotes, uint64_t* backslashes, uint64_t* ops)
+{
+    *quotes = 0;
+    *backslashes = 0;
+    *ops = 0;
+
+#if defined(__AVX2__)
+    for (int i = 0; i < 64; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) (p + i));
+        __m256i folded = _mm256_or_si256(block, _mm256_set1_epi8(0x20));
+        __m256i op = _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')),
+                    _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}'))),
+                _mm256_or_si256(
+                    _mm256_cmpeq_epi8(block, _mm256_set1_epi8(':')),
+                    _mm256_cmpeq_epi8(block, _mm256_set1_epi8(','))));
+
+        *quotes |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('"'))) << i;
+        *backslashes |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\\'))) << i;
+        *ops |= (uint64_t) (uint32_t) _mm256_movemask_epi8(op) << i;
+    }
+#elif defined(__SSE2__)
+    for (int i = 0; i < 64; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (p + i));
+        __m128i folded = _mm_or_si128(block, _mm_set1_epi8(0x20));
+        __m128i op = _mm_or_si128(
+                _mm_or_si128(
+                    _mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+                    _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+                _mm_or_si128(
+                    _mm_cmpeq_epi8(block, _mm_set1_epi8(':')),
+                    _mm_cmpeq_epi8(block, _mm_set1_epi8(','))));
+
+        *quotes |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('"'))) << i;
+        *backslashes |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\\'))) << i;
+        *ops |= (uint64_t) _mm_movemask_epi8(op) << i;
+    }
+#else
+    for (int i = 0; i < 64; ++i) {
+        unsigned char c = p[i] | 0x20;
+
+        *quotes |= (uint64_t) (p[i] == '"') << i;
+        *backslashes |= (uint64_t) (p[i] == '\\') << i;
+        *ops |= (uint64_t) (c == '{' || c == '}' || p[i] == ':' || p[i] == ',') << i;
+    }
+#endif
+}
+
+/**
+ * Returns the bits of the bytes that are escaped by a backslash, given the
+ * backslashes of a block. Only a backslash that ends an odd run escapes the
+ * byte after it. escaped carries a backslash at the end of the block over
+ * to the next one.
+ */
+uint64_t __protocol_index_escaped(uint64_t backslashes, uint64_t* escaped)
+{
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    uint64_t follows_escape;
+    uint64_t odd_starts;
+    uint64_t even_runs;
+
+    // an escaped backslash does not start a run
+    backslashes &= ~*escaped;
+    follows_escape = backslashes << 1 | *escaped;
+
+    // adding the starts of the runs on odd bits to the runs carries through
+    // them, and leaves the bit after each run set where the run length flips
+    // the parity
+    odd_starts = backslashes & ~even_bits & ~follows_escape;
+    even_runs = odd_starts + backslashes;
+    *escaped = even_runs < backslashes;
+
+    return (even_bits ^ (even_runs << 1)) & follows_escape;
+}
+
+/**
+ * Finds the structural characters of the len bytes in buf, 64 bytes at a
+ * time, and puts their positions in index. A quote that is not escaped opens
+ * or closes a string, so the bits inside of strings are the running xor of
+ * the quotes, which the shifts below work out for the whole block at once.
+ */
+int __protocol_index_json(const char* buf, size_t len, __protocol_index_t* index)
+{
+    uint64_t escaped = 0;
+    uint64_t in_string = 0;
+    unsigned char tail[64];
+
+    if (index->size < len + 1) {
+        index->size = len + 1;
+        index->positions = realloc(index->positions, index->size * sizeof(uint32_t));
+        index->counts = realloc(index->counts, index->size * sizeof(uint32_t));
+
+        if (index->positions == NULL || index->counts == NULL) {
+            log_error("__protocol_index_json:index was not allocated properly");
+            exit(1);
+        }
+    }
+
+    index->len = 0;
+
+    for (size_t base = 0; base < len; base += 64) {
+        const unsigned char* p = (const unsigned char*) buf + base;
+        uint64_t quotes;
+        uint64_t backslashes;
+        uint64_t ops;
+        uint64_t strings;
+        uint64_t structurals;
+
+        if (len - base < 64) {
+            // spaces are never structural
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, p, len - base);
+            p = tail;
+        }
+
+        __protocol_index_block(p, &quotes, &backslashes, &ops);
+        quotes &= ~__protocol_index_escaped(backslashes, &escaped);
+
+        strings = quotes;
+        strings ^= strings << 1;
+        strings ^= strings << 2;
+        strings ^= strings << 4;
+        strings ^= strings << 8;
+        strings ^= strings << 16;
+        strings ^= strings << 32;
+        strings ^= in_string;
+        in_string = (uint64_t) ((int64_t) strings >> 63);
+
+        structurals = (ops & ~strings) | quotes;
+
+        while (structurals != 0) {
+            index->positions[index->len++] = base + __builtin_ctzll(structurals);
+            structurals &= structurals - 1;
+        }
+    }
+
+    return in_string ? EJSON : 0;
+}
+
+/**
+ * Counts the elements of every array and object in index, and checks that
+ * the brackets and braces match and are nested no deeper than
+ * PROTOCOL_MAX_DEPTH.
+ */
+int __protocol_index_count(const char* buf, __protocol_index_t* index)
+{
+    size_t open[PROTOCOL_MAX_DEPTH + 1];
+    int depth = 0;
+    int in_string = 0;
+
+    for (size_t i = 0; i < index->len; ++i) {
+        uint32_t pos = index->positions[i];
+        char c = buf[pos];
+
+        if (c == '"') {
+            in_string = !in_string;
+        }
+        else if (c == '[' || c == '{') {
+            if (depth > PROTOCOL_MAX_DEPTH) {
+                return EJSON;
+            }
+
+            index->counts[i] = 0;
+            open[depth++] = i;
+        }
+        else if (c == ',') {
+            if (depth == 0) {
+                return EJSON;
+            }
+
+            ++(index->counts[open[depth - 1]]);
+        }
+        else if (c == ']' || c == '}') {
+            size_t first;
+            char* p;
+
+            if (depth == 0 || buf[index->positions[open[depth - 1]]] != (c == ']' ? '[' : '{')) {
+                return EJSON;
+            }
+
+            first = open[--depth];
+            p = __protocol_skip_space((char*) buf + index->positions[first] + 1, (char*) buf + pos);
+
+            // n commas separate n + 1 elements, unless there are none
+            if (index->counts[first] > 0 || p < buf + pos) {
+                ++(index->counts[first]);
+            }
+        }
+    }
+
+    return depth == 0 && !in_string ? 0 : EJSON;
+}
+
+typedef struct {
+    __protocol_in_t in;
+    const char* p;
+    const char* buf;
+    const char* end;
+    const __protocol_index_t* index;
+    size_t i;
+} __protocol_json_in_t;
+
+/**
+ * Returns 1 and moves past the structural character c if it is the next
+ * non-space character of the input. Returns 0 otherwise.
+ */
+int __protocol_json_expect(__protocol_json_in_t* in, char c)
+{
+    const char* p = __protocol_skip_space((char*) in->p, (char*) in->end);
+
+    if (in->i >= in->index->len || in->buf + in->index->positions[in->i] != p || *p != c) {
+        return 0;
+    }
+
+    ++(in->i);
+    in->p = p + 1;
+
+    return 1;
+}
+
+/**
+ * Reads the 4 hex digits at p. Returns -1 if they are not hex digits.
+ */
+long __protocol_json_hex(const char* p)
+{
+    long value = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        char c = p[i];
+
+        value <<= 4;
+
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        }
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            value |= (c | 0x20) - 'a' + 10;
+        }
+        else {
+            return -1;
+        }
+    }
+
+    return value;
+}
+
+/**
+ * Copies the json string between the quotes at start and end into a new null
+ * terminated buffer with the escapes decoded. Returns NULL on a bad escape.
+ */
+char* __protocol_json_string(__protocol_json_in_t* in, const char* start, const char* end, unsigned int* len)
+{
+    // a decoded escape is never longer than the escape
+    char* str = __protocol_in_alloc(&in->in, end - start + 1, 0);
+    char* out = str;
+    const char* p = start;
+
+    if (str == NULL) {
+        return NULL;
+    }
+
+    while (p < end) {
+        const char* escape = memchr(p, '\\', end - p);
+        long code;
+
+        if (escape == NULL) {
+            escape = end;
+        }
+
+        memcpy(out, p, escape - p);
+        out += escape - p;
+        p = escape;
+
+        if (p == end) {
+            break;
+        }
+
+        if (end - p < 2) {
+            goto bad_escape;
+        }
+
+        switch (p[1]) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u':
+                if (end - p < 6 || (code = __protocol_json_hex(p + 2)) < 0) {
+                    goto bad_escape;
+                }
+
+                if (code >= 0xd800 && code <= 0xdbff) {
+                    long low;
+
+                    // the other half of a surrogate pair follows right away
+                    if (end - p < 12 || p[6] != '\\' || p[7] != 'u'
+                            || (low = __protocol_json_hex(p + 8)) < 0xdc00 || low > 0xdfff) {
+                        goto bad_escape;
+                    }
+
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    p += 6;
+                }
+
+                if (code < 0x80) {
+                    *out++ = code;
+                }
+                else if (code < 0x800) {
+                    *out++ = 0xc0 | (code >> 6);
+                    *out++ = 0x80 | (code & 0x3f);
+                }
+                else if (code < 0x10000) {
+                    *out++ = 0xe0 | (code >> 12);
+                    *out++ = 0x80 | ((code >> 6) & 0x3f);
+                    *out++ = 0x80 | (code & 0x3f);
+                }
+                else {
+                    *out++ = 0xf0 | (code >> 18);
+                    *out++ = 0x80 | ((code >> 12) & 0x3f);
+                    *out++ = 0x80 | ((code >> 6) & 0x3f);
+                    *out++ = 0x80 | (code & 0x3f);
+                }
+
+                p += 4;
+                break;
+            default:
+                goto bad_escape;
+        }
+
+        p += 2;
+    }
+
+    *out = '\0';
+    *len = out - str;
+
+    return str;
+
+bad_escape:
+    if (in->in.arena == NULL) {
+        free(str);
+    }
+
+    return NULL;
+}
+
+/**
+ * Reads the string whose opening quote is the next structural character.
+ */
+char* __protocol_json_next_string(__protocol_json_in_t* in, unsigned int* len)
+{
+    const char* start;
+    const char* end;
+
+    if (!__protocol_json_expect(in, '"')) {
+        return NULL;
+    }
+
+    // the closing quote is the next structural character
+    start = in->p;
+    end = in->buf + in->index->positions[in->i++];
+    in->p = end + 1;
+
+    return __protocol_json_string(in, start, end, len);
+}
+
+/**
+ * Reads the number, true, false or null at in->p into value. It ends at the
+ * first space or structural character.
+ */
+int __protocol_json_scalar(__protocol_json_in_t* in, protocol_value_t* value)
+{
+    const char* next = in->i < in->index->len ? in->buf + in->index->positions[in->i] : in->end;
+    const char* p = in->p;
+    char number[64];
+    char* parsed;
+    size_t len;
+    int is_double = 0;
+
+    while (p < next && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '\0') {
+        is_double |= *p == '.' || *p == 'e' || *p == 'E';
+        ++p;
+    }
+
+    len = p - in->p;
+
+    if (len == 4 && memcmp(in->p, "true", 4) == 0) {
+        value->type = json_boolean;
+        value->u.boolean = 1;
+    }
+    else if (len == 5 && memcmp(in->p, "false", 5) == 0) {
+        value->type = json_boolean;
+        value->u.boolean = 0;
+    }
+    else if (len == 4 && memcmp(in->p, "null", 4) == 0) {
+        value->type = json_null;
+    }
+    else if (len > 0 && len < sizeof(number) && (*in->p == '-' || (*in->p >= '0' && *in->p <= '9'))) {
+        memcpy(number, in->p, len);
+        number[len] = '\0';
+
+        if (is_double) {
+            value->type = json_double;
+            value->u.dbl = strtod(number, &parsed);
+        }
+        else {
+            value->type = json_integer;
+            value->u.integer = strtoll(number, &parsed, 10);
+        }
+
+        if (parsed != number + len) {
+            return EJSON;
+        }
+    }
+    else {
+        return EJSON;
+    }
+
+    in->p = p;
+
+    return 0;
+}
+
+protocol_value_t* __protocol_get_json_value(__protocol_json_in_t* in, int depth);
+
+protocol_value_t* __protocol_get_json_object(__protocol_json_in_t* in, protocol_value_t* value, int depth)
+{
+    size_t len = in->index->counts[in->i - 1];
+
+    value->type = json_object;
+    value->u.object.values = __protocol_in_alloc(&in->in, (len > 0 ? len : 1) * sizeof(json_object_entry), 0);
+
+    for (size_t i = 0; i < len && value->u.object.values != NULL; ++i) {
+        json_object_entry* entry = &value->u.object.values[i];
+
+        if (i > 0 && !__protocol_json_expect(in, ',')) {
+            break;
+        }
+
+        entry->name = __protocol_json_next_string(in, &entry->name_length);
+
+        if (entry->name == NULL) {
+            break;
+        }
+
+        entry->value = __protocol_json_expect(in, ':') ? __protocol_get_json_value(in, depth + 1) : NULL;
+
+        if (entry->value == NULL) {
+            if (in->in.arena == NULL) {
+                free(entry->name);
+            }
+            break;
+        }
+
+        entry->value->parent = value;
+        value->u.object.length = i + 1;
+    }
+
+    if (value->u.object.values == NULL || value->u.object.length != len || !__protocol_json_expect(in, '}')) {
+        __protocol_in_free(&in->in, value);
+        return NULL;
+    }
+
+    return value;
+}
+
+protocol_value_t* __protocol_get_json_array(__protocol_json_in_t* in, protocol_value_t* value, int depth)
+{
+    size_t len = in->index->counts[in->i - 1];
+
+    value->type = json_array;
+    value->u.array.values = __protocol_in_alloc(&in->in, (len > 0 ? len : 1) * sizeof(protocol_value_t*), 0);
+
+    for (size_t i = 0; i < len && value->u.array.values != NULL; ++i) {
+        protocol_value_t* element;
+
+        if (i > 0 && !__protocol_json_expect(in, ',')) {
+            break;
+        }
+
+        element = __protocol_get_json_value(in, depth + 1);
+
+        if (element == NULL) {
+            break;
+        }
+
+        element->parent = value;
+        value->u.array.values[i] = element;
+        value->u.array.length = i + 1;
+    }
+
+    if (value->u.array.values == NULL || value->u.array.length != len || !__protocol_json_expect(in, ']')) {
+        __protocol_in_free(&in->in, value);
+        return NULL;
+    }
+
+    return value;
+}
+
+/**
+ * Reads the json value at in->p, and everything in it, into a value laid out
+ * like the ones of the json parser. Arrays and objects are allocated with
+ * the number of elements counted in the index. Returns NULL if the input is
+ * broken.
+ */
+protocol_value_t* __protocol_get_json_value(__protocol_json_in_t* in, int depth)
+{
+    protocol_value_t* value;
+    const char* p = __protocol_skip_space((char*) in->p, (char*) in->end);
+    int is_structural = in->i < in->index->len && in->buf + in->index->positions[in->i] == p;
+
+    if (p >= in->end || depth > PROTOCOL_MAX_DEPTH) {
+        return NULL;
+    }
+
+    value = __protocol_in_alloc(&in->in, sizeof(protocol_value_t) + json_builder_extra, 1);
+
+    if (value == NULL) {
+        return NULL;
+    }
+
+    in->p = p;
+
+    if (is_structural && *p == '{') {
+        ++(in->i);
+        in->p = p + 1;
+        return __protocol_get_json_object(in, value, depth);
+    }
+
+    if (is_structural && *p == '[') {
+        ++(in->i);
+        in->p = p + 1;
+        return __protocol_get_json_array(in, value, depth);
+    }
+
+    if (is_structural && *p == '"') {
+        value->type = json_string;
+        value->u.string.ptr = __protocol_json_next_string(in, &value->u.string.length);
+
+        if (value->u.string.ptr == NULL) {
+            __protocol_in_free(&in->in, value);
+            return NULL;
+        }
+
+        return value;
+    }
+
+    if (is_structural || __protocol_json_scalar(in, value)) {
+        __protocol_in_free(&in->in, value);
+        return NULL;
+    }
+
+    return value;
+}
+
+/**
+ * Parses the json in buf into the same structure as the json parser does, in
+ * two passes. The first finds the structural characters of the whole message
+ * with SIMD compares and bit operations rather than a byte at a time. The
+ * second builds the values straight from their positions, so that strings
+ * are copied without being scanned again and arrays and objects are
+ * allocated once with the size they end up with.
+ */
+int __protocol_parse_indexed(protocol_value_t** protocol, char* buf, int len, arena_t* arena)
+{
+    log_verbose("__protocol_parse_indexed:protocol=%p, buf=%p, len=%d, arena=%p", protocol, buf, len, arena);
+
+    __protocol_index_t* index = &__protocol_index;
+    __protocol_json_in_t in = {
+        .in = { .arena = arena },
+        .p = buf,
+        .buf = buf,
+        .end = buf + len,
+        .index = index,
+        .i = 0
+    };
+
+    *protocol = NULL;
+
+    if (__protocol_index_json(buf, len, index) == 0 && __protocol_index_count(buf, index) == 0) {
+        *protocol = __protocol_get_json_value(&in, 0);
+    }
+
+    if (*protocol != NULL) {
+        // like the json parser, a message may be followed by null bytes
+        while (in.p < in.end && (*in.p == '\0' || *in.p == ' ' || *in.p == '\t' || *in.p == '\r' || *in.p == '\n')) {
+            ++(in.p);
+        }
+
+        if (in.p != in.end || in.i != index->len) {
+            __protocol_in_free(&in.in, *protocol);
+            *protocol = NULL;
+        }
+    }
+
+    if (*protocol == NULL) {
+        log_error("json error:broken message of %d bytes", len);
+        return EJSON;
+    }
 
-    opts.mode = json_serialize_mode_packed;
-    json_serialize_ex(buf, protocol, opts);
     return 0;
 }
 
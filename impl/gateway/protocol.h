@@ -3,12 +3,81 @@
 
 #include "uv.h"
 #include "json.h"
+#include "arena.h"
 #include "json-builder.h"
 
+#define PROTOCOL_EVENT_LEN 128
+#define PROTOCOL_EVENT_ID_LEN 16
+#define PROTOCOL_EVENT_STR_LEN 37
+#define PROTOCOL_ADDR_LEN 128
+#define PROTOCOL_ERROR_NAME_LEN 48
+#define PROTOCOL_ERROR_MESSAGE_LEN 1024
+#define PROTOCOL_MAX_DEPTH 32
+#define PROTOCOL_INDEX_MIN_LEN 1024
+
+#define PROTOCOL_JSON 0
+#define PROTOCOL_MSGPACK 1
+
+#define PROTOCOL_SCALAR_NONE 0
+#define PROTOCOL_SCALAR_INT 1
+#define PROTOCOL_SCALAR_STRING 2
+
 typedef json_value protocol_value_t;
+typedef struct protocol_key_s protocol_key_t;
+typedef struct protocol_string_s protocol_string_t;
+typedef struct protocol_scalar_s protocol_scalar_t;
+typedef struct protocol_event_s protocol_event_t;
+
+/**
+ * An event id, which is a uuid on the wire, kept as its 16 bytes. It is only
+ * turned back into text with protocol_format_event when it is logged.
+ */
+struct protocol_event_s {
+    unsigned char bytes[PROTOCOL_EVENT_ID_LEN];
+};
+
+/**
+ * A key of the protocol with its length worked out up front, so that a
+ * lookup only compares the names of entries that have the same length.
+ */
+struct protocol_key_s {
+    char* name;
+    unsigned int len;
+};
+
+/**
+ * The characters of a string value, not copied. ptr is NUL terminated and
+ * is valid for as long as the value it was taken from.
+ */
+struct protocol_string_s {
+    char* ptr;
+    size_t len;
+};
+
+#define PROTOCOL_KEY(name) { name, sizeof(name) - 1 }
+
+extern const protocol_key_t protocol_key_method;
+extern const protocol_key_t protocol_key_args;
+extern const protocol_key_t protocol_key_result;
+extern const protocol_key_t protocol_key_error;
+extern const protocol_key_t protocol_key_name;
+
+/**
+ * The result of a response when it is an int or a string, read straight out
+ * of the message by protocol_scan_result without building the response.
+ */
+struct protocol_scalar_s {
+    int type;
+    int value;
+    char string[PROTOCOL_EVENT_LEN];
+};
 
 int protocol_parse(protocol_value_t** protocol, char* buf, int len);
 
+int protocol_parse_arena(protocol_value_t** protocol, char* buf, int len, arena_t* arena);
+
+int protocol_parse_msgpack(protocol_value_t** protocol, char* buf, int len, arena_t* arena);
+
 int protocol_is_object(protocol_value_t* protocol);
 
 int protocol_is_array(protocol_value_t* protocol);
@@ -23,12 +92,20 @@ int protocol_has_key(protocol_value_t* protocol, char* key);
 
 int protocol_get_key(protocol_value_t* protocol, protocol_value_t** dest, char* key);
 
+protocol_value_t* protocol_find_key(protocol_value_t* protocol, const protocol_key_t* key);
+
 int protocol_get_length(protocol_value_t* protocol);
 
 int protocol_get_at(protocol_value_t* protocol, protocol_value_t** dest, int index);
 
 int protocol_get_string(protocol_value_t* protocol, char* buf);
 
+int protocol_get_string_view(protocol_value_t* protocol, protocol_string_t* view);
+
+int protocol_copy_string(protocol_value_t* protocol, char* buf, size_t size);
+
+int protocol_string_equals(protocol_string_t* view, char* str);
+
 int protocol_get_bool(protocol_value_t* protocol);
 
 int protocol_get_int(protocol_value_t* protocol);
@@ -53,10 +130,32 @@ int protocol_get_device(protocol_value_t* devices, unsigned int index, char* add
 
 int protocol_get_devices(protocol_value_t* protocol, struct sockaddr_storage** devices_list, size_t* devices_len);
 
+int protocol_parse_event(const char* str, size_t len, protocol_event_t* event);
+
+void protocol_format_event(const protocol_event_t* event, char* buf);
+
+int protocol_get_events(protocol_value_t* result, protocol_event_t* events, int max);
+
+int protocol_scan_result(char* buf, int len, protocol_scalar_t* scalar);
+
+int protocol_has_result(protocol_value_t* response, protocol_scalar_t* scalar);
+
+int protocol_get_result_int(protocol_value_t* response, protocol_scalar_t* scalar);
+
+int protocol_get_result_events(
+        protocol_value_t* response,
+        protocol_scalar_t* scalar,
+        protocol_event_t* events,
+        int max);
+
 size_t protocol_size(protocol_value_t* protocol);
 
 int protocol_to_json(protocol_value_t* protocol, char* buf);
 
+int protocol_serialize(protocol_value_t* protocol, char* buf, size_t size);
+
+int protocol_serialize_msgpack(protocol_value_t* protocol, char* buf, size_t size);
+
 void protocol_free_parse(protocol_value_t* protocol);
 
 void protocol_free_build(protocol_value_t* protocol);
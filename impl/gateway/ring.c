@@ -0,0 +1,153 @@
+#include <string.h>
+#include "ring.h"
+#include "log.h"
+#include "err.h"
+
+/**
+ * Moves the data of ring to the start of a buffer of size bytes.
+ */
+int __ring_realloc(ring_t* ring, size_t size)
+{
+    char* buf = malloc(size);
+    size_t first;
+
+    if (buf == NULL) {
+        return ENULL;
+    }
+
+    if (ring->len > 0) {
+        first = ring->size - ring->head;
+        first = first < ring->len ? first : ring->len;
+
+        memcpy(buf, ring->buf + ring->head, first);
+        memcpy(buf + first, ring->buf, ring->len - first);
+    }
+
+    free(ring->buf);
+    ring->buf = buf;
+    ring->size = size;
+    ring->head = 0;
+
+    return 0;
+}
+
+void ring_init(ring_t* ring)
+{
+    log_verbose("ring_init:ring=%p", ring);
+
+    ring->buf = NULL;
+    ring->size = 0;
+    ring->head = 0;
+    ring->len = 0;
+}
+
+/**
+ * Appends len bytes of data to ring. The ring doubles in size until the data
+ * fits, up to RING_MAX_SIZE.
+ */
+int ring_write(ring_t* ring, const char* data, size_t len)
+{
+    log_verbose("ring_write:ring=%p, data=%p, len=%lu", ring, data, len);
+
+    int r;
+    size_t size = ring->size > 0 ? ring->size : RING_MIN_SIZE;
+    size_t tail;
+    size_t first;
+
+    while (size < ring->len + len) {
+        size <<= 1;
+    }
+
+    if (size > RING_MAX_SIZE) {
+        return EBNDS;
+    }
+
+    if (size != ring->size) {
+        r = __ring_realloc(ring, size);
+
+        if (r) {
+            return r;
+        }
+    }
+
+    tail = (ring->head + ring->len) & (ring->size - 1);
+    first = ring->size - tail;
+    first = first < len ? first : len;
+
+    memcpy(ring->buf + tail, data, first);
+    memcpy(ring->buf, data + first, len - first);
+    ring->len += len;
+
+    return 0;
+}
+
+/**
+ * Returns the offset from the start of the data of the first c at or after
+ * from, or -1 if there is none.
+ */
+long ring_find(ring_t* ring, char c, size_t from)
+{
+    log_verbose("ring_find:ring=%p, c=%d, from=%lu", ring, c, from);
+
+    while (from < ring->len) {
+        size_t start = (ring->head + from) & (ring->size - 1);
+        size_t span = ring->size - start;
+        char* found;
+
+        span = span < ring->len - from ? span : ring->len - from;
+        found = memchr(ring->buf + start, c, span);
+
+        if (found != NULL) {
+            return from + (found - (ring->buf + start));
+        }
+
+        from += span;
+    }
+
+    return -1;
+}
+
+/**
+ * Returns a pointer to the first len bytes of the data as one contiguous
+ * block. The data is only moved if those bytes wrap around the end.
+ */
+char* ring_linear(ring_t* ring, size_t len)
+{
+    log_verbose("ring_linear:ring=%p, len=%lu", ring, len);
+
+    if (ring->head + len > ring->size && __ring_realloc(ring, ring->size)) {
+        return NULL;
+    }
+
+    return ring->buf + ring->head;
+}
+
+/**
+ * Drops the first len bytes of the data.
+ */
+void ring_consume(ring_t* ring, size_t len)
+{
+    log_verbose("ring_consume:ring=%p, len=%lu", ring, len);
+
+    ring->len -= len;
+    ring->head = ring->len > 0 ? (ring->head + len) & (ring->size - 1) : 0;
+}
+
+/**
+ * Drops all data but keeps the buffer.
+ */
+void ring_reset(ring_t* ring)
+{
+    log_verbose("ring_reset:ring=%p", ring);
+
+    ring->head = 0;
+    ring->len = 0;
+}
+
+void ring_free(ring_t* ring)
+{
+    log_verbose("ring_free:ring=%p", ring);
+
+    free(ring->buf);
+    ring_init(ring);
+}
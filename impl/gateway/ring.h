@@ -0,0 +1,36 @@
+#ifndef __RING_h__
+#define __RING_h__
+
+#include <stdlib.h>
+
+#define RING_MIN_SIZE 4096
+#define RING_MAX_SIZE (16 * 1024 * 1024)
+
+typedef struct ring_s ring_t;
+
+/**
+ * Growable ring buffer of bytes. The data starts at head and wraps around
+ * the end of buf. The size is always a power of two.
+ */
+struct ring_s {
+    char* buf;
+    size_t size;
+    size_t head;
+    size_t len;
+};
+
+void ring_init(ring_t* ring);
+
+int ring_write(ring_t* ring, const char* data, size_t len);
+
+long ring_find(ring_t* ring, char c, size_t from);
+
+char* ring_linear(ring_t* ring, size_t len);
+
+void ring_consume(ring_t* ring, size_t len);
+
+void ring_reset(ring_t* ring);
+
+void ring_free(ring_t* ring);
+
+#endif
@@ -4,19 +4,31 @@
 
 #include "stddef.h"
 #include "stdlib.h"
+#include "string.h"
 #include "assert.h"
+#include "time.h"
+#include "pthread.h"
 #include "log.h"
 #include "state.h"
 #include "err.h"
 
+__thread state_run_queue_t state_run_queue = { NULL, 0, 0, 0, 0 };
+
+static const state_t* __state_registry[STATE_MAX_STATES];
+static int __state_created = 0;
+static int __state_stats_enabled = 0;
+static state_stats_t* __state_stats_list = NULL;
+static pthread_mutex_t __state_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread state_stats_t* __state_stats_thread = NULL;
+
 /**
- * Initializes the lookup table with NULL pointers.
+ * Initializes an empty lookup. The table is allocated on the first insert.
  */
 void lookup_init(state_lookup_t* lookup)
 {
-    for (int i = 0; i < LOOKUP_SIZE; ++i) {
-        lookup->table[i] = NULL;
-    }
+    lookup->table = NULL;
+    lookup->size = 0;
+    lookup->len = 0;
 }
 
 /**
@@ -35,24 +47,78 @@ unsigned long __hash(const char* str)
 }
 
 /**
- * Returns the state corresponding to state_name in lookup.
+ * Returns the slot of the state named state_name with hash, or the empty slot
+ * where it would go. The table must have at least one empty slot.
  */
-state_t* lookup_search(state_lookup_t* lookup, const char* state_name)
+state_lookup_slot_t* __lookup_probe(
+        state_lookup_slot_t* table,
+        size_t size,
+        unsigned long hash,
+        const char* state_name)
 {
-    log_verbose("lookup_search::lookup=%p, state_name=\"%s\"", lookup, state_name);
+    size_t i = hash & (size - 1);
+
+    while (table[i].state != NULL
+            && (table[i].hash != hash || strcmp(table[i].state->name, state_name) != 0)) {
+        i = (i + 1) & (size - 1);
+    }
+
+    return &table[i];
+}
+
+/**
+ * Makes room in lookup for n states more without growing, by moving the
+ * states over to a larger table if needed. Building a machine reserves room
+ * for all of its states at once.
+ */
+void lookup_reserve(state_lookup_t* lookup, size_t n)
+{
+    log_verbose("lookup_reserve::lookup=%p, n=%zu", lookup, n);
+
+    size_t size = lookup->size > 0 ? lookup->size : LOOKUP_SIZE;
+    state_lookup_slot_t* table;
+
+    // keep the table at most half full, so that probe chains stay short
+    while (2 * (lookup->len + n) > size) {
+        size *= 2;
+    }
+
+    if (size == lookup->size) {
+        return;
+    }
+
+    table = calloc(size, sizeof(state_lookup_slot_t));
+
+    if (table == NULL) {
+        log_error("lookup_reserve:could not allocate lookup table");
+        exit(1);
+    }
 
-    const unsigned long key = __hash(state_name) % LOOKUP_SIZE;
-    state_lookup_slot_t* slot = lookup->table[key];
+    for (size_t i = 0; i < lookup->size; ++i) {
+        state_lookup_slot_t* slot = &lookup->table[i];
 
-    while (slot != NULL && slot->state->name != state_name) {
-        slot = slot->next;
+        if (slot->state != NULL) {
+            *__lookup_probe(table, size, slot->hash, slot->state->name) = *slot;
+        }
     }
 
-    if (slot == NULL) {
+    free(lookup->table);
+    lookup->table = table;
+    lookup->size = size;
+}
+
+/**
+ * Returns the state corresponding to state_name in lookup.
+ */
+const state_t* lookup_search(state_lookup_t* lookup, const char* state_name)
+{
+    log_verbose("lookup_search::lookup=%p, state_name=\"%s\"", lookup, state_name);
+
+    if (lookup->len == 0) {
         return NULL;
     }
 
-    return slot->state;
+    return __lookup_probe(lookup->table, lookup->size, __hash(state_name), state_name)->state;
 }
 
 /**
@@ -68,42 +134,31 @@ int lookup_has(state_lookup_t* lookup, const char* state_name)
 /**
  * Inserts state into lookup if it isn't already inserted.
  */
-void lookup_insert(state_lookup_t* lookup, state_t* state)
+void lookup_insert(state_lookup_t* lookup, const state_t* state)
 {
     log_verbose("lookup_insert::lookup=%p, state=%p", lookup, state);
 
+    unsigned long hash;
+    state_lookup_slot_t* slot;
+
     if (state == NULL) {
         log_error("cannot insert state: state is NULL");
         return;
     }
 
-    if (lookup_has(lookup, state->name)) {
-        log_error("cannot insert state \"%s\": already inserted", state->name);
-        return;
-    }
-
-    const unsigned long key = __hash(state->name) % LOOKUP_SIZE;
-    state_lookup_slot_t* new_slot = calloc(1, sizeof(state_lookup_slot_t));
-    state_lookup_slot_t* next_slot = lookup->table[key];
+    lookup_reserve(lookup, 1);
 
-    new_slot->state = state;
-    new_slot->next = next_slot;
-    lookup->table[key] = new_slot;
-}
-
-/**
- * Releases memory allocated by slot. If there is a chain of slots, recursively
- * releases the tail first.
- */
-void lookup_clear_slot(state_lookup_slot_t* slot)
-{
-    log_verbose("lookup_clear_slot::slot=%p", slot);
+    hash = __hash(state->name);
+    slot = __lookup_probe(lookup->table, lookup->size, hash, state->name);
 
-    if (slot->next != NULL) {
-        lookup_clear_slot(slot->next);
+    if (slot->state != NULL) {
+        log_error("cannot insert state \"%s\": already inserted", state->name);
+        return;
     }
 
-    free(slot);
+    slot->hash = hash;
+    slot->state = state;
+    ++(lookup->len);
 }
 
 /**
@@ -113,50 +168,42 @@ void lookup_clear(state_lookup_t* lookup)
 {
     log_verbose("lookup_clear::lookup=%p", lookup);
 
-    for (int i = 0; i < LOOKUP_SIZE; ++i) {
-        state_lookup_slot_t* slot = lookup->table[i];
-
-        if (slot != NULL) {
-            lookup_clear_slot(slot);
-        }
-    }
+    free(lookup->table);
+    lookup_init(lookup);
 }
 
-void lookup_print_slot(state_lookup_slot_t* slot)
+void lookup_print(state_lookup_t* lookup)
 {
-    printf("%s", slot->state->name);
+    for (size_t i = 0; i < lookup->size; ++i) {
+        state_lookup_slot_t* slot = &lookup->table[i];
 
-    if (slot->next != NULL) {
-        printf(", ");
-        lookup_print_slot(slot->next);
+        if (slot->state != NULL) {
+            printf("[%zu]\t%s\n", i, slot->state->name);
+        }
     }
 }
 
-void lookup_print(state_lookup_t* lookup)
+#define STATE_EDGE_NAME_GEN(name, str) case STATE_EDGE_##name: return str;
+/**
+ * Returns the name of edge, for printing and logging.
+ */
+const char* state_edge_name(int edge)
 {
-    for (int i = 0; i < LOOKUP_SIZE; ++i) {
-        state_lookup_slot_t* slot = lookup->table[i];
-
-        if (slot != NULL) {
-            printf("[%d]\t", i);
-            lookup_print_slot(slot);
-            printf("\n");
-        }
+    switch (edge) {
+        STATE_EDGE_MAP(STATE_EDGE_NAME_GEN)
     }
+
+    return "none";
 }
+#undef STATE_EDGE_NAME_GEN
 
 /**
- * Allocates and adds a new edge between from_state and to_state.
+ * Adds an edge between from_state and to_state.
  */
-void state_add_edge(const char* name, state_t* from_state, state_t* to_state) {
-    log_verbose("state_add_edge::name=\"%s\", from_state=%p, to_state=%p", name, from_state, to_state);
+void state_add_edge(int edge, state_t* from_state, const state_t* to_state) {
+    log_verbose("state_add_edge::edge=\"%s\", from_state=%p, to_state=%p", state_edge_name(edge), from_state, to_state);
 
-    edge_t* new_edge = calloc(1, sizeof(edge_t));
-
-    new_edge->name = name;
-    new_edge->next_state = to_state;
-    new_edge->next_edge = from_state->edges;
-    from_state->edges = new_edge;
+    from_state->next[edge] = to_state;
 }
 
 /**
@@ -169,15 +216,25 @@ state_t* state_create(const char* name, state_callback callback)
     state_t* new_state = calloc(1, sizeof(state_t));
 
     new_state->name = name;
-    new_state->edges = NULL;
     new_state->callback = callback;
+    new_state->id = STATE_STATIC_STATES + __atomic_fetch_add(&__state_created, 1, __ATOMIC_RELAXED);
+
+    // states past the registry still run, they are just not counted
+    if (new_state->id < STATE_MAX_STATES) {
+        __state_registry[new_state->id] = new_state;
+    }
+    else {
+        new_state->id = -1;
+    }
 
     return new_state;
 }
 
 /**
- * Builds an entire state machine as described by si and ei. Any states inside
- * lookup can be added as well.
+ * Builds an entire state machine as described by si and ei at runtime. Any
+ * states inside lookup can be added as well, as long as they were built by
+ * state_machine_build too. Machines known at compile time are better defined
+ * with STATE_DEFINE.
  */
 state_t* state_machine_build(
         const state_initializer_t* si,
@@ -189,6 +246,8 @@ state_t* state_machine_build(
     log_verbose("state_machine_build::si=%p, nsi=%zu, ei=%p, nei=%zu, lookup=%p", si, nsi, ei, nei, lookup);
 
     if (nsi > 0) {
+        lookup_reserve(lookup, nsi);
+
         for (size_t i = 0; i < nsi; ++i) {
             const char* name = si[i].name;
             state_callback callback = si[i].callback;
@@ -198,16 +257,17 @@ state_t* state_machine_build(
         }
 
         for (size_t i = 0; i < nei; ++i) {
-            const char* name = ei[i].name;
+            int edge = ei[i].edge;
             const char* from = ei[i].from;
             const char* to = ei[i].to;
-            state_t* from_state = lookup_search(lookup, from);
-            state_t* to_state = lookup_search(lookup, to);
+            // the states of the lookup are built here, so they are not const
+            state_t* from_state = (state_t*) lookup_search(lookup, from);
+            const state_t* to_state = lookup_search(lookup, to);
 
-            state_add_edge(name, from_state, to_state);
+            state_add_edge(edge, from_state, to_state);
         }
 
-        state_t* first_state = lookup_search(lookup, si[0].name);
+        state_t* first_state = (state_t*) lookup_search(lookup, si[0].name);
 
         return first_state;
     }
@@ -216,70 +276,353 @@ state_t* state_machine_build(
 }
 
 /**
- * Runs the callback associated with start_state with the given payload.
+ * Returns the state with id, or NULL if there is none. States defined with
+ * STATE_DEFINE are only known once they have been run with the counters on.
  */
-void state_machine_run(state_t* start_state, void* payload) {
-    log_verbose("state_machine_run::start_state=%p, payload=%p", start_state, payload);
+const state_t* state_get_by_id(int id)
+{
+    if (id < 0 || id >= STATE_MAX_STATES) {
+        return NULL;
+    }
+
+    return __atomic_load_n(&__state_registry[id], __ATOMIC_RELAXED);
+}
 
-    (*start_state->callback)(start_state, payload);
+/**
+ * Turns on the state counters. They are off by default, as timing every
+ * callback costs two clock reads.
+ */
+void state_stats_enable()
+{
+    log_verbose("state_stats_enable");
+
+    __atomic_store_n(&__state_stats_enabled, 1, __ATOMIC_RELAXED);
 }
 
 /**
- * Set next to be the state pointed to by edge_name from origin. Returns an
- * error code if the edge was not found.
+ * Returns the counters of this thread, which are allocated and listed the
+ * first time. Only the listing takes a lock, counting does not. Returns NULL
+ * if the counters could not be allocated.
  */
-int state_next(state_t* origin, state_t** next, const char* edge_name)
+state_stats_t* __state_stats_get()
 {
-    log_verbose("state_next::origin=%p, next=%p, edge_name=\"%s\"", origin, *next, edge_name);
+    state_stats_t* stats = __state_stats_thread;
+
+    if (stats != NULL) {
+        return stats;
+    }
 
-    edge_t* current_edge = origin->edges;
+    stats = calloc(1, sizeof(state_stats_t));
 
-    while (current_edge != NULL && strcmp(current_edge->name, edge_name) != 0) {
-        current_edge = current_edge->next_edge;
+    if (stats == NULL) {
+        return NULL;
     }
 
-    if (current_edge != NULL && strcmp(current_edge->name, edge_name) == 0) {
-        *next = current_edge->next_state;
-        return 0;
+    pthread_mutex_lock(&__state_stats_lock);
+    stats->next = __state_stats_list;
+    __state_stats_list = stats;
+    pthread_mutex_unlock(&__state_stats_lock);
+
+    __state_stats_thread = stats;
+
+    return stats;
+}
+
+/**
+ * Adds n to a counter of this thread. Only this thread writes the counter, so
+ * no locked instruction is needed, but state_stats_collect may read it from
+ * another thread.
+ */
+void __state_stats_add(unsigned long long* counter, unsigned long long n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+unsigned long long __state_stats_now()
+{
+    struct timespec spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+
+    return (unsigned long long) spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+}
+
+/**
+ * Registers state under its id, given registered, the state found there so
+ * far. Exits if another state already has the id, as the two would share
+ * their counters.
+ */
+void __state_register(const state_t* state, const state_t* registered)
+{
+    log_verbose("__state_register:state=%p, registered=%p", state, registered);
+
+    if (registered == NULL && __atomic_compare_exchange_n(&__state_registry[state->id],
+                &registered, state, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
     }
 
-    return ENFND;
+    if (registered != state) {
+        log_error("state \"%s\" has the id %d of state \"%s\"", state->name, state->id, registered->name);
+        exit(1);
+    }
 }
 
 /**
- * Runs the callback associated with the next state of the given state, determined by edge_name.
+ * Runs the callback of state, and counts and times it if the counters are on.
  */
-void state_run_next(state_t* state, const char* edge_name, void* payload) {
-    log_verbose("state_run_next::state=%p, edge_name=\"%s\", payload=%p", state, edge_name, payload);
+void __state_call(const state_t* state, void* payload)
+{
+    const state_t* registered;
+    state_stats_t* stats;
+    unsigned long long start;
+    unsigned long long ns;
+    int bucket;
+
+    if (!__atomic_load_n(&__state_stats_enabled, __ATOMIC_RELAXED) || state->id < 0
+            || (stats = __state_stats_get()) == NULL) {
+        (*state->callback)(state, payload);
+        return;
+    }
+
+    // states defined with STATE_DEFINE are registered when first counted
+    registered = __atomic_load_n(&__state_registry[state->id], __ATOMIC_RELAXED);
+
+    if (registered != state) {
+        __state_register(state, registered);
+    }
+
+    start = __state_stats_now();
+    (*state->callback)(state, payload);
+    ns = __state_stats_now() - start;
+
+    bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+    bucket = bucket < STATE_STATS_BUCKETS ? bucket : STATE_STATS_BUCKETS - 1;
+
+    __state_stats_add(&stats->entries[state->id], 1);
+    __state_stats_add(&stats->ns[state->id], ns);
+    __state_stats_add(&stats->histogram[state->id][bucket], 1);
+}
+
+/**
+ * Counts a transition out of state through edge, if the counters are on.
+ */
+void __state_stats_transition(const state_t* state, int edge)
+{
+    state_stats_t* stats;
+
+    if (!__atomic_load_n(&__state_stats_enabled, __ATOMIC_RELAXED) || state->id < 0
+            || (stats = __state_stats_get()) == NULL) {
+        return;
+    }
+
+    __state_stats_add(&stats->transitions[state->id][edge], 1);
+}
+
+/**
+ * Sums the counters of every thread into stats.
+ */
+void state_stats_collect(state_stats_t* stats)
+{
+    log_verbose("state_stats_collect:stats=%p", stats);
+
+    memset(stats, 0, sizeof(state_stats_t));
+    pthread_mutex_lock(&__state_stats_lock);
+
+    for (state_stats_t* t = __state_stats_list; t != NULL; t = t->next) {
+        for (int i = 0; i < STATE_MAX_STATES; ++i) {
+            stats->entries[i] += __atomic_load_n(&t->entries[i], __ATOMIC_RELAXED);
+            stats->ns[i] += __atomic_load_n(&t->ns[i], __ATOMIC_RELAXED);
+
+            for (int j = 0; j < STATE_STATS_BUCKETS; ++j) {
+                stats->histogram[i][j] += __atomic_load_n(&t->histogram[i][j], __ATOMIC_RELAXED);
+            }
+
+            for (int j = 0; j < STATE_EDGE_MAX; ++j) {
+                stats->transitions[i][j] += __atomic_load_n(&t->transitions[i][j], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&__state_stats_lock);
+}
+
+/**
+ * Prints the summed counters of every state that has been run, with its
+ * histogram and the edges it has been left through.
+ */
+void state_stats_print()
+{
+    state_stats_t* stats = malloc(sizeof(state_stats_t));
+
+    if (stats == NULL) {
+        return;
+    }
+
+    state_stats_collect(stats);
+    printf("%-36s %12s %14s %12s\n", "state", "entries", "time (ms)", "mean (ns)");
+
+    for (int i = 0; i < STATE_MAX_STATES; ++i) {
+        const state_t* state = state_get_by_id(i);
+
+        if (state == NULL || stats->entries[i] == 0) {
+            continue;
+        }
+
+        printf("%-36s %12llu %14.3f %12llu\n",
+                state->name,
+                stats->entries[i],
+                stats->ns[i] / 1.0e6,
+                stats->ns[i] / stats->entries[i]);
+
+        for (int j = 0; j < STATE_STATS_BUCKETS; ++j) {
+            if (stats->histogram[i][j] > 0) {
+                printf("    >= %llu ns: %llu\n", 1ULL << j, stats->histogram[i][j]);
+            }
+        }
+
+        for (int j = 0; j < STATE_EDGE_MAX; ++j) {
+            if (stats->transitions[i][j] > 0) {
+                printf("    %s -> %s: %llu\n", state_edge_name(j), state->next[j]->name, stats->transitions[i][j]);
+            }
+        }
+    }
+
+    fflush(stdout);
+    free(stats);
+}
+
+/**
+ * Appends a run of state to queue. Returns ENULL if the queue is full and
+ * could not grow.
+ */
+int __state_run_queue_push(state_run_queue_t* queue, const state_t* state, void* payload)
+{
+    log_verbose("__state_run_queue_push:queue=%p, state=%p, payload=%p", queue, state, payload);
+
+    if (queue->tail == queue->size) {
+        if (queue->head > 0) {
+            // the runs before head are done, make room by moving the rest down
+            memmove(queue->runs, queue->runs + queue->head, (queue->tail - queue->head) * sizeof(state_run_t));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        }
+        else {
+            size_t size = queue->size > 0 ? 2 * queue->size : STATE_RUN_QUEUE_SIZE;
+            state_run_t* runs = realloc(queue->runs, size * sizeof(state_run_t));
+
+            if (runs == NULL) {
+                return ENULL;
+            }
+
+            queue->runs = runs;
+            queue->size = size;
+        }
+    }
+
+    queue->runs[queue->tail].state = state;
+    queue->runs[queue->tail].payload = payload;
+    ++(queue->tail);
+
+    return 0;
+}
+
+/**
+ * Runs the callback of state. If a callback is already running on this thread
+ * the state is queued instead, and run once that callback has returned, so
+ * the stack stays as deep as a single callback however long the chain of
+ * states is.
+ */
+void __state_run(const state_t* state, void* payload)
+{
+    log_verbose("__state_run:state=%p, payload=%p", state, payload);
 
     int r;
-    state_t* next_state;
+    state_run_queue_t* queue = &state_run_queue;
+
+    if (queue->is_running) {
+        r = __state_run_queue_push(queue, state, payload);
+        log_check_r(r, "__state_run_queue_push");
+        return;
+    }
 
-    r = state_next(state, &next_state, edge_name);
-    log_check_r(r, "state_next");
+    queue->is_running = 1;
+    __state_call(state, payload);
 
-    (*next_state->callback)(next_state, payload);
+    while (queue->head < queue->tail) {
+        state_run_t run = queue->runs[queue->head++];
+
+        __state_call(run.state, run.payload);
+    }
+
+    queue->head = 0;
+    queue->tail = 0;
+    queue->is_running = 0;
 }
 
-void state_print_tree(state_lookup_t* lookup, state_t* parent, int indent)
+/**
+ * Runs the callback associated with start_state with the given payload.
+ */
+void state_machine_run(const state_t* start_state, void* payload) {
+    log_verbose("state_machine_run::start_state=%p, payload=%p", start_state, payload);
+
+    __state_run(start_state, payload);
+}
+
+/**
+ * Set next to be the state pointed to by edge from origin. Returns an error
+ * code if the edge was not found.
+ */
+int state_next(const state_t* origin, const state_t** next, int edge)
 {
-    edge_t* edge = parent->edges;
+    log_verbose("state_next::origin=%p, next=%p, edge=\"%s\"", origin, *next, state_edge_name(edge));
 
-    while (edge != NULL) {
-        state_t* next_state = edge->next_state;
+    if (edge <= STATE_EDGE_NONE || edge >= STATE_EDGE_MAX || origin->next[edge] == NULL) {
+        return ENFND;
+    }
+
+    *next = origin->next[edge];
+
+    return 0;
+}
 
-        printf("  %*s%s -> %s\n", indent, "", edge->name, next_state->name);
+/**
+ * Runs the callback associated with the next state of the given state,
+ * determined by edge. When called from a state callback, the next state runs
+ * after that callback has returned.
+ */
+void state_run_next(const state_t* state, int edge, void* payload) {
+    log_verbose("state_run_next::state=%p, edge=\"%s\", payload=%p", state, state_edge_name(edge), payload);
+
+    const state_t* next_state = state->next[edge];
+
+    if (next_state == NULL) {
+        log_error("state \"%s\" has no edge \"%s\"", state->name, state_edge_name(edge));
+        log_check_r(ENFND, "state_run_next");
+    }
+
+    __state_stats_transition(state, edge);
+    __state_run(next_state, payload);
+}
+
+void state_print_tree(state_lookup_t* lookup, const state_t* parent, int indent)
+{
+    for (int edge = STATE_EDGE_NONE + 1; edge < STATE_EDGE_MAX; ++edge) {
+        const state_t* next_state = parent->next[edge];
+
+        if (next_state == NULL) {
+            continue;
+        }
+
+        printf("  %*s%s -> %s\n", indent, "", state_edge_name(edge), next_state->name);
 
         if (!lookup_has(lookup, next_state->name)) {
             lookup_insert(lookup, next_state);
             state_print_tree(lookup, next_state, indent + 2);
         }
-
-        edge = edge->next_edge;
     }
 }
 
-void state_print(state_t* state)
+void state_print(const state_t* state)
 {
     state_lookup_t lookup;
     lookup_init(&lookup);
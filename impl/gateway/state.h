@@ -3,35 +3,103 @@
 
 #include <stdlib.h>
 
-#define LOOKUP_SIZE 20
+#define LOOKUP_SIZE 32
+#define STATE_RUN_QUEUE_SIZE 16
+#define STATE_MAX_STATES 128
+#define STATE_STATIC_STATES 64
+#define STATE_STATS_BUCKETS 32
+
+/**
+ * Every edge name used by the state machines. Edges are interned to small
+ * integers, STATE_EDGE_<NAME>, which index the transitions of a state. The
+ * id 0 is STATE_EDGE_NONE, so a zeroed context is not waiting on any edge.
+ */
+#define STATE_EDGE_MAP(XX) \
+    XX(START, "start") \
+    XX(CONNECT, "connect") \
+    XX(DONE, "done") \
+    XX(READ, "read") \
+    XX(PROCESS, "process") \
+    XX(DISCONNECT, "disconnect") \
+    XX(CLEAN, "clean") \
+    XX(VERIFICATION_RESPONSE, "verification_response") \
+    XX(DEVICES_RESPONSE, "devices_response") \
+    XX(STATUS, "status") \
+    XX(STATUS_OK, "status_ok") \
+    XX(STATUS_NOT_OK, "status_not_ok") \
+    XX(NEXT_EVENT, "next_event") \
+    XX(HANDLE, "handle") \
+    XX(HANDLE_IO, "handle_io") \
+    XX(NEXT, "next") \
+
+#define STATE_EDGE_GEN(name, str) STATE_EDGE_##name,
+enum {
+    STATE_EDGE_NONE,
+    STATE_EDGE_MAP(STATE_EDGE_GEN)
+    STATE_EDGE_MAX
+};
+#undef STATE_EDGE_GEN
 
 typedef struct state_s state_t;
-typedef struct edge_s edge_t;
 typedef struct state_initializer_s state_initializer_t;
 typedef struct edge_initializer_s edge_initializer_t;
 typedef struct state_lookup_slot_s state_lookup_slot_t;
 typedef struct state_lookup_s state_lookup_t;
+typedef struct state_run_s state_run_t;
+typedef struct state_run_queue_s state_run_queue_t;
+typedef struct state_stats_s state_stats_t;
 
 /**
  * The state callback is run when the state is entered.
  */
-typedef void (*state_callback)(state_t* state, void* payload);
+typedef void (*state_callback)(const state_t* state, void* payload);
 
+/**
+ * A state holds its row of the transition table, the state that each edge id
+ * leads to or NULL if the state has no such edge. The id indexes the state
+ * counters. Ids below STATE_STATIC_STATES belong to states defined with
+ * STATE_DEFINE, the rest are handed out by state_machine_build.
+ */
 struct state_s {
     const char* name;
-    edge_t* edges;
+    int id;
     state_callback callback;
+    const state_t* next[STATE_EDGE_MAX];
 };
 
 /**
- * The edge object represents an edge between two states. As a state can
- * consist of multiple edges, an edge has a link to the next edge in the chain.
+ * The first static state id of each table. The ids of a table run up to the
+ * base of the next one, so that the counters of two tables never alias.
  */
-struct edge_s {
-    const char* name;
-    state_t* next_state;
-    edge_t* next_edge;
-};
+#define STATE_BASE_MACHINE 0
+#define STATE_BASE_TEST 56
+
+/**
+ * Machines known at compile time are written as a table, a macro that takes
+ * a macro XX and calls it once per state with the name of the state, its
+ * callback and its edges:
+ *
+ *     #define MACHINE_EXAMPLE(XX) \
+ *         XX(example_start, __example_start, STATE_TO(DONE, example_end)) \
+ *         XX(example_end, __example_end, )
+ *
+ * The table is given STATE_ID to generate an enum of the ids,
+ * STATE_ID_<name>, that starts at the STATE_BASE_ of the table, then
+ * STATE_DECLARE and STATE_DEFINE to define every state as a static const
+ * state_t named as the state. The states and their transitions are built by
+ * the compiler, and an edge to a state that is not in the table fails the
+ * build.
+ */
+#define STATE_TO(edge, to) [STATE_EDGE_##edge] = &to,
+#define STATE_ID(state_name, state_callback, ...) STATE_ID_##state_name,
+#define STATE_DECLARE(state_name, state_callback, ...) static const state_t state_name;
+#define STATE_DEFINE(state_name, state_callback, ...) \
+    static const state_t state_name = { \
+        .name = #state_name, \
+        .id = STATE_ID_##state_name, \
+        .callback = state_callback, \
+        .next = { [STATE_EDGE_NONE] = NULL, __VA_ARGS__ } \
+    };
 
 struct state_initializer_s {
     const char* name;
@@ -39,30 +107,84 @@ struct state_initializer_s {
 };
 
 struct edge_initializer_s {
-    const char* name;
+    int edge;
     const char* from;
     const char* to;
 };
 
+/**
+ * A slot of the lookup table, with the hash of the state name so that probing
+ * only compares names on a matching hash. An empty slot has no state.
+ */
 struct state_lookup_slot_s {
-    state_t* state;
-    state_lookup_slot_t* next;
+    unsigned long hash;
+    const state_t* state;
 };
 
 /**
- * The lookup object implements a hash table to store a set of states.
+ * The lookup object implements a hash table to store a set of states by name.
+ * It is open addressed with linear probing, all slots in one array of a power
+ * of two size that doubles when it gets half full.
  */
 struct state_lookup_s {
-    state_lookup_slot_t* table[LOOKUP_SIZE];
+    state_lookup_slot_t* table;
+    size_t size;
+    size_t len;
+};
+
+/**
+ * A state waiting to be run with its payload.
+ */
+struct state_run_s {
+    const state_t* state;
+    void* payload;
+};
+
+/**
+ * The states waiting to be run on a thread, in order. The queue is drained by
+ * the outermost state_run_next, so a chain of states runs one after the other
+ * instead of nested on the stack. The queue grows if a state runs more
+ * transitions than there is room for.
+ */
+struct state_run_queue_s {
+    state_run_t* runs;
+    size_t size;
+    size_t head;
+    size_t tail;
+    int is_running;
+};
+
+/**
+ * Counters of the states run on one thread, indexed by state id. Time is the
+ * time spent in the callback of a state, in ns. Bucket i of the histogram
+ * counts the callbacks that took from 2^i up to 2^(i+1) ns, the last bucket
+ * counts anything longer. Transitions are counted per state and edge.
+ */
+struct state_stats_s {
+    unsigned long long entries[STATE_MAX_STATES];
+    unsigned long long ns[STATE_MAX_STATES];
+    unsigned long long histogram[STATE_MAX_STATES][STATE_STATS_BUCKETS];
+    unsigned long long transitions[STATE_MAX_STATES][STATE_EDGE_MAX];
+    state_stats_t* next;
 };
 
 void lookup_init(state_lookup_t* lookup);
 
+void lookup_reserve(state_lookup_t* lookup, size_t n);
+
+const state_t* lookup_search(state_lookup_t* lookup, const char* state_name);
+
+int lookup_has(state_lookup_t* lookup, const char* state_name);
+
+void lookup_insert(state_lookup_t* lookup, const state_t* state);
+
 void lookup_clear(state_lookup_t* lookup);
 
 void lookup_print(state_lookup_t* lookup);
 
-void state_add_edge(const char* name, state_t* from_state, state_t* to_state);
+const char* state_edge_name(int edge);
+
+void state_add_edge(int edge, state_t* from_state, const state_t* to_state);
 
 state_t* state_machine_build(
         const state_initializer_t* si,
@@ -71,12 +193,20 @@ state_t* state_machine_build(
         const size_t nei,
         state_lookup_t* lookup);
 
-void state_machine_run(state_t* start_state, void* payload);
+void state_machine_run(const state_t* start_state, void* payload);
+
+int state_next(const state_t* origin, const state_t** next, int edge);
+
+void state_run_next(const state_t* state, int edge, void* payload);
+
+void state_print(const state_t* state);
+
+const state_t* state_get_by_id(int id);
 
-int state_next(state_t* origin, state_t** next, const char* edge_name);
+void state_stats_enable();
 
-void state_run_next(state_t* state, const char* edge_name, void* payload);
+void state_stats_collect(state_stats_t* stats);
 
-void state_print(state_t* state);
+void state_stats_print();
 
 #endif
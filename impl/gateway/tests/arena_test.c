@@ -0,0 +1,80 @@
+#include "test.h"
+#include "log.h"
+#include "err.h"
+#include "arena.h"
+#include "protocol.h"
+
+START_TEST(arena_alloc_test)
+{
+    arena_t arena;
+    char* a;
+    char* b;
+
+    arena_init(&arena);
+
+    a = arena_alloc(&arena, 3, 1);
+    b = arena_alloc(&arena, 5, 0);
+
+    ck_assert_ptr_ne(a, NULL);
+    ck_assert_int_eq(a[0], 0);
+    ck_assert_int_eq((size_t) a % ARENA_ALIGN, 0);
+    ck_assert_int_eq((size_t) b % ARENA_ALIGN, 0);
+    ck_assert_int_eq(b - a, ARENA_ALIGN);
+
+    arena_free(&arena);
+}
+END_TEST
+
+START_TEST(arena_reset_test)
+{
+    arena_t arena;
+    char* a;
+    char* big;
+
+    arena_init(&arena);
+
+    a = arena_alloc(&arena, 16, 0);
+    big = arena_alloc(&arena, 4 * ARENA_BLOCK_SIZE, 0);
+    ck_assert_ptr_ne(big, NULL);
+
+    // both blocks are kept, and handed out again without new allocations
+    arena_reset(&arena);
+    ck_assert_ptr_eq(arena_alloc(&arena, 4 * ARENA_BLOCK_SIZE, 0), big);
+    ck_assert_ptr_eq(arena_alloc(&arena, 16, 0), a);
+
+    arena_free(&arena);
+    ck_assert_ptr_eq(arena.head, NULL);
+}
+END_TEST
+
+START_TEST(arena_parse_test)
+{
+    arena_t arena;
+    protocol_value_t* response;
+    protocol_value_t* result;
+    char buf[] = "{\"result\": [\"a\", \"b\"], \"id\": 1}";
+
+    arena_init(&arena);
+
+    ck_assert_int_eq(protocol_parse_arena(&response, buf, strlen(buf), &arena), 0);
+    ck_assert_int_eq(protocol_get_key(response, &result, "result"), 0);
+    ck_assert_int_eq(protocol_get_length(result), 2);
+    ck_assert_int_eq(protocol_parse_arena(&response, "{", 1, &arena), EJSON);
+
+    arena_free(&arena);
+}
+END_TEST
+
+Suite* arena_suite()
+{
+    Suite* s = suite_create("arena");
+    TCase* tc = tcase_create("alloc");
+
+    tcase_add_test(tc, arena_alloc_test);
+    tcase_add_test(tc, arena_reset_test);
+    tcase_add_test(tc, arena_parse_test);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -0,0 +1,232 @@
+#include <sys/socket.h>
+#include <unistd.h>
+#include "test.h"
+#include "log.h"
+#include "err.h"
+#include "net.h"
+#include "pool.h"
+
+START_TEST(net_encode_test)
+{
+    net_encoded_t encoded;
+    protocol_value_t* request;
+    char* expected = "{\"method\":\"hostnames\",\"args\":[]}\n";
+
+    protocol_build_request(&request, "hostnames", 0);
+
+    ck_assert_int_eq(net_encode(request, PROTOCOL_JSON, &encoded), 0);
+    ck_assert_int_eq(encoded.len, strlen(expected));
+    ck_assert_int_eq(strncmp(encoded.buf, expected, encoded.len), 0);
+
+    protocol_free_build(request);
+    free(encoded.buf);
+}
+END_TEST
+
+START_TEST(net_encode_msgpack_test)
+{
+    net_encoded_t encoded;
+    protocol_value_t* request;
+    char expected[] = "\xc1\x00\x00\x00\x15"
+        "\x82\xa6method\xa6status\xa4" "args\x90";
+
+    protocol_build_request(&request, "status", 0);
+
+    ck_assert_int_eq(net_encode(request, PROTOCOL_MSGPACK, &encoded), 0);
+    ck_assert_int_eq(encoded.len, sizeof(expected) - 1);
+    ck_assert_int_eq(memcmp(encoded.buf, expected, encoded.len), 0);
+
+    protocol_free_build(request);
+    free(encoded.buf);
+}
+END_TEST
+
+START_TEST(net_encode_large_test)
+{
+    net_encoded_t encoded;
+    protocol_value_t* request;
+    protocol_value_t* arg;
+    size_t len = 3 * NET_MAX_SIZE;
+    char* value = malloc(len + 1);
+
+    memset(value, 'a', len);
+    value[len] = '\0';
+    protocol_build_string(&arg, value);
+    protocol_build_request(&request, "put", 1, arg);
+
+    // larger than the buffer it starts out with
+    ck_assert_int_eq(net_encode(request, PROTOCOL_JSON, &encoded), 0);
+    ck_assert_int_gt(encoded.len, len);
+    ck_assert_int_eq(encoded.buf[encoded.len - 1], '\n');
+    free(encoded.buf);
+
+    ck_assert_int_eq(net_encode(request, PROTOCOL_MSGPACK, &encoded), 0);
+    ck_assert_int_gt(encoded.len, len);
+    free(encoded.buf);
+
+    protocol_free_build(request);
+    free(value);
+}
+END_TEST
+
+START_TEST(net_serialize_test)
+{
+    net_tcp_context_t context = {};
+    protocol_value_t* arg;
+    size_t len = NET_MAX_MESSAGE_SIZE;
+    char* value = malloc(len + 1);
+    char* expected = "{\"method\":\"status\",\"args\":[]}\n";
+
+    context.buf_size = NET_MAX_SIZE;
+    context.buf = malloc(context.buf_size);
+
+    protocol_build_request(&context.write_payload, "status", 0);
+    ck_assert_int_eq(net_serialize(&context), 0);
+    ck_assert_ptr_eq(context.write_payload, NULL);
+    ck_assert_ptr_eq(context.write_encoded, &context.write_framed);
+    ck_assert_int_eq(context.write_encoded->len, strlen(expected));
+    ck_assert_int_eq(strncmp(context.write_encoded->buf, expected, context.write_encoded->len), 0);
+
+    // a message that can never be read back is not framed
+    memset(value, 'a', len);
+    value[len] = '\0';
+    protocol_build_string(&arg, value);
+    protocol_build_request(&context.write_payload, "put", 1, arg);
+    context.write_encoded = NULL;
+
+    ck_assert_int_eq(net_serialize(&context), EBNDS);
+    ck_assert_ptr_eq(context.write_payload, NULL);
+    ck_assert_ptr_eq(context.write_encoded, NULL);
+
+    free(context.buf);
+    free(value);
+}
+END_TEST
+
+START_TEST(net_get_cached_request_test)
+{
+    net_encoded_t* status;
+    net_encoded_t* next_event;
+    net_encoded_t* again;
+    char* expected = "{\"method\":\"status\",\"args\":[]}\n";
+
+    ck_assert_int_eq(net_get_cached_request("status", PROTOCOL_JSON, &status), 0);
+    ck_assert_int_eq(net_get_cached_request("next_event", PROTOCOL_JSON, &next_event), 0);
+    ck_assert_int_eq(net_get_cached_request("status", PROTOCOL_JSON, &again), 0);
+
+    ck_assert_ptr_eq(status, again);
+    ck_assert_ptr_ne(status, next_event);
+    ck_assert_int_eq(status->len, strlen(expected));
+    ck_assert_int_eq(strncmp(status->buf, expected, status->len), 0);
+
+    ck_assert_int_eq(net_get_cached_request("status", PROTOCOL_MSGPACK, &again), 0);
+    ck_assert_ptr_ne(status, again);
+    ck_assert_int_eq((unsigned char) again->buf[0], NET_FRAME_MARKER);
+}
+END_TEST
+
+START_TEST(net_parse_buffered_test)
+{
+    net_tcp_context_sync_t context;
+    char reply[] = "{\"result\":1}\n{\"res";
+    char frame[] = "\xc1\x01\x00\x00\x00";
+
+    context.buf = malloc(NET_MAX_SIZE);
+    context.use_scan = 0;
+
+    memcpy(context.buf, reply, sizeof(reply) - 1);
+    context.buf_len = sizeof(reply) - 1;
+
+    // the part of the next reply is kept
+    ck_assert_int_eq(net_parse_buffered(&context), 0);
+    ck_assert_int_eq(protocol_get_result_int(context.read_payload, NULL), 1);
+    ck_assert_int_eq(context.buf_len, 5);
+    ck_assert_int_eq(net_parse_buffered(&context), -EAGAIN);
+    protocol_free_parse(context.read_payload);
+
+    // a frame that can never fit the buffer fails before it is read
+    memcpy(context.buf, frame, sizeof(frame) - 1);
+    context.buf_len = sizeof(frame) - 1;
+    ck_assert_int_eq(net_parse_buffered(&context), EMPCK);
+
+    free(context.buf);
+}
+END_TEST
+
+/**
+ * Writes more than RING_MAX_SIZE bytes without a newline to the socket in
+ * arg, until it is done or the other end has been closed.
+ */
+void __net_test_flood(void* arg)
+{
+    int sock = *(int*) arg;
+    char chunk[65536];
+    size_t sent = 0;
+
+    memset(chunk, 'a', sizeof(chunk));
+
+    while (sent <= RING_MAX_SIZE) {
+        ssize_t r = send(sock, chunk, sizeof(chunk), MSG_NOSIGNAL);
+
+        if (r < 0) {
+            break;
+        }
+
+        sent += r;
+    }
+}
+
+START_TEST(net_read_too_large_test)
+{
+    uv_loop_t loop;
+    uv_thread_t writer;
+    uv_tcp_t* handle = malloc(sizeof(uv_tcp_t));
+    net_tcp_context_t context = {};
+    int fds[2];
+
+    loop.data = NULL;
+    uv_loop_init(&loop);
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    uv_tcp_init(&loop, handle);
+    uv_tcp_open(handle, fds[0]);
+
+    context.loop = &loop;
+    context.handle = handle;
+    handle->data = &context;
+    ring_init(&context.rbuf);
+
+    ck_assert_int_eq(net_read(&context, STATE_EDGE_DONE, STATE_EDGE_NONE), 0);
+    uv_thread_create(&writer, __net_test_flood, &fds[1]);
+
+    // the connection is dropped instead of the process exiting
+    uv_run(&loop, UV_RUN_DEFAULT);
+    uv_thread_join(&writer);
+
+    ck_assert_ptr_eq(context.handle, NULL);
+    ck_assert_int_eq(context.is_reading, 0);
+    ck_assert_int_eq(context.rbuf.len, 0);
+
+    close(fds[1]);
+    ring_free(&context.rbuf);
+    pool_delete(&loop);
+    uv_loop_close(&loop);
+}
+END_TEST
+
+Suite* net_suite()
+{
+    Suite* s = suite_create("net");
+    TCase* tc = tcase_create("encode");
+
+    tcase_add_test(tc, net_encode_test);
+    tcase_add_test(tc, net_encode_msgpack_test);
+    tcase_add_test(tc, net_encode_large_test);
+    tcase_add_test(tc, net_serialize_test);
+    tcase_add_test(tc, net_get_cached_request_test);
+    tcase_add_test(tc, net_parse_buffered_test);
+    tcase_add_test(tc, net_read_too_large_test);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -0,0 +1,78 @@
+#include "test.h"
+#include "log.h"
+#include "pool.h"
+
+START_TEST(pool_class_size_test)
+{
+    ck_assert_int_eq(pool_class_size(1), 1024);
+    ck_assert_int_eq(pool_class_size(1024), 1024);
+    ck_assert_int_eq(pool_class_size(1025), 2048);
+    ck_assert_int_eq(pool_class_size(65536), 65536);
+    ck_assert_int_eq(pool_class_size(65537), 65537);
+}
+END_TEST
+
+START_TEST(pool_alloc_test)
+{
+    pool_t pool;
+    size_t len;
+    void* first;
+    void* second;
+
+    pool_init(&pool);
+
+    first = pool_alloc(&pool, 65536, &len);
+    ck_assert_int_eq(len, 65536);
+    ck_assert_int_eq(pool.misses, 1);
+    pool_free(&pool, first, len);
+
+    second = pool_alloc(&pool, 65536, &len);
+    ck_assert_ptr_eq(first, second);
+    ck_assert_int_eq(pool.hits, 1);
+
+    first = pool_alloc(&pool, 2000, &len);
+    ck_assert_int_eq(len, 2048);
+    ck_assert_int_eq(pool.misses, 2);
+
+    pool_free(&pool, first, len);
+    pool_free(&pool, second, 65536);
+    pool_clear(&pool);
+}
+END_TEST
+
+START_TEST(pool_delete_test)
+{
+    uv_loop_t loop;
+    pool_t* pool;
+    size_t len;
+
+    // uv_loop_init keeps what loop.data held
+    loop.data = NULL;
+    uv_loop_init(&loop);
+
+    pool = pool_get(&loop);
+    ck_assert_ptr_eq(pool, pool_get(&loop));
+    pool_free(pool, pool_alloc(pool, 2000, &len), len);
+
+    pool_delete(&loop);
+    ck_assert_ptr_eq(loop.data, NULL);
+
+    // a loop without a pool is left as it is
+    pool_delete(&loop);
+    uv_loop_close(&loop);
+}
+END_TEST
+
+Suite* pool_suite()
+{
+    Suite* s = suite_create("pool");
+    TCase* tc = tcase_create("alloc");
+
+    tcase_add_test(tc, pool_class_size_test);
+    tcase_add_test(tc, pool_alloc_test);
+    tcase_add_test(tc, pool_delete_test);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
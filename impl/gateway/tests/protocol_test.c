@@ -44,6 +44,27 @@ START_TEST(protocol_has_key_test)
 }
 END_TEST
 
+START_TEST(protocol_find_key_test)
+{
+    int r;
+    protocol_value_t* value;
+    protocol_value_t* result;
+    char* buf = "{\"res\":1, \"results\":2, \"result\":3}";
+
+    r = protocol_parse(&value, buf, strlen(buf));
+    ck_assert_int_eq(r, 0);
+
+    result = protocol_find_key(value, &protocol_key_result);
+    ck_assert_ptr_ne(result, NULL);
+    ck_assert_int_eq(protocol_get_int(result), 3);
+
+    ck_assert_ptr_eq(protocol_find_key(value, &protocol_key_error), NULL);
+    ck_assert_ptr_eq(protocol_find_key(result, &protocol_key_result), NULL);
+    ck_assert_ptr_eq(protocol_find_key(NULL, &protocol_key_result), NULL);
+    protocol_free_parse(value);
+}
+END_TEST
+
 START_TEST(protocol_type_test)
 {
     int r;
@@ -289,6 +310,36 @@ START_TEST(protocol_get_string_test)
 }
 END_TEST
 
+START_TEST(protocol_get_string_view_test)
+{
+    int r;
+    protocol_value_t* value;
+    protocol_string_t view;
+    char buf[4];
+    char* str = "\"foobar\"";
+
+    r = protocol_parse(&value, str, strlen(str));
+    ck_assert_int_eq(r, 0);
+
+    r = protocol_get_string_view(value, &view);
+    ck_assert_int_eq(r, 0);
+    ck_assert_int_eq(view.len, 6);
+    ck_assert_int_eq(protocol_string_equals(&view, "foobar"), 1);
+    ck_assert_int_eq(protocol_string_equals(&view, "foo"), 0);
+
+    r = protocol_copy_string(value, buf, sizeof(buf));
+    ck_assert_int_eq(r, EBNDS);
+    ck_assert_str_eq(buf, "foo");
+    protocol_free_parse(value);
+
+    r = protocol_parse(&value, "1", 1);
+    ck_assert_int_eq(r, 0);
+    r = protocol_get_string_view(value, &view);
+    ck_assert_int_eq(r, EPTCL);
+    protocol_free_parse(value);
+}
+END_TEST
+
 START_TEST(protocol_get_bool_test)
 {
     int r;
@@ -457,8 +508,8 @@ START_TEST(protocol_get_response_error_test)
     protocol_value_t* err;
     char* error_name = "Error";
     char* error_msg = "An error occurred";
-    char name_result[28];
-    char msg_result[28];
+    char name_result[PROTOCOL_ERROR_NAME_LEN];
+    char msg_result[PROTOCOL_ERROR_MESSAGE_LEN];
 
     r = protocol_build_response_error(&err, error_name, error_msg);
     ck_assert_int_eq(r, 0);
@@ -485,6 +536,97 @@ START_TEST(protocol_get_devices_test)
 }
 END_TEST
 
+START_TEST(protocol_get_events_test)
+{
+    int r;
+    protocol_value_t* protocol;
+    char* single = "\"00000000-0000-0000-0000-00000000000a\"";
+    char* batch = "[\"00000000-0000-0000-0000-00000000000a\", "
+        "\"00000000-0000-0000-0000-00000000000b\", "
+        "\"00000000-0000-0000-0000-00000000000c\"]";
+    protocol_event_t events[3];
+
+    r = protocol_parse(&protocol, single, strlen(single));
+    ck_assert_int_eq(r, 0);
+    r = protocol_get_events(protocol, events, 3);
+    ck_assert_int_eq(r, 1);
+    ck_assert_int_eq(events[0].bytes[15], 0x0a);
+    protocol_free_parse(protocol);
+
+    r = protocol_parse(&protocol, batch, strlen(batch));
+    ck_assert_int_eq(r, 0);
+    r = protocol_get_events(protocol, events, 3);
+    ck_assert_int_eq(r, 3);
+    ck_assert_int_eq(events[2].bytes[15], 0x0c);
+    r = protocol_get_events(protocol, events, 2);
+    ck_assert_int_eq(r, EBNDS);
+    protocol_free_parse(protocol);
+
+    r = protocol_parse(&protocol, "\"a\"", 3);
+    ck_assert_int_eq(r, 0);
+    r = protocol_get_events(protocol, events, 3);
+    ck_assert_int_eq(r, EPTCL);
+    protocol_free_parse(protocol);
+}
+END_TEST
+
+START_TEST(protocol_event_test)
+{
+    protocol_event_t event;
+    char buf[PROTOCOL_EVENT_STR_LEN];
+    char* uuid = "0F8C2B4E-6d1a-4c3b-9e2f-7a5d8b1c3e60";
+
+    ck_assert_int_eq(protocol_parse_event(uuid, strlen(uuid), &event), 0);
+    ck_assert_int_eq(event.bytes[0], 0x0f);
+    ck_assert_int_eq(event.bytes[15], 0x60);
+
+    protocol_format_event(&event, buf);
+    ck_assert_str_eq(buf, "0f8c2b4e-6d1a-4c3b-9e2f-7a5d8b1c3e60");
+
+    ck_assert_int_eq(protocol_parse_event(uuid, 35, &event), EPTCL);
+    ck_assert_int_eq(protocol_parse_event("0f8c2b4e-6d1a-4c3b-9e2f+7a5d8b1c3e60", 36, &event), EPTCL);
+    ck_assert_int_eq(protocol_parse_event("0f8c2b4e-6d1a-4c3b-9e2f-7a5d8b1c3e6g", 36, &event), EPTCL);
+}
+END_TEST
+
+START_TEST(protocol_scan_result_test)
+{
+    protocol_scalar_t scalar;
+    char* status = " {\"result\": -12} ";
+    char* event = "{\"id\": 3, \"result\": \"0f8c2b4e-6d1a-4c3b-9e2f-7a5d8b1c3e60\"}";
+    char* batch = "{\"result\": [\"a\"]}";
+    char* error = "{\"error\": {\"name\": \"EventError\", \"args\": []}}";
+    char* uuid = "{\"result\": \"0f8c2b4e-6d1a-4c3b-9e2f-7a5d8b1c3e60\"}";
+    char* escaped = "{\"result\": \"0f8c2b4e-6d1a-4c3b-9e2f\\\"7a5d8b1c3e60\"}";
+    char* control = "{\"result\": \"0f8c2b4e-6d1a-4c3b-9e2f-\x01\"}";
+    protocol_event_t events[1];
+
+    ck_assert_int_eq(protocol_scan_result(status, strlen(status), &scalar), 0);
+    ck_assert_int_eq(scalar.type, PROTOCOL_SCALAR_INT);
+    ck_assert_int_eq(protocol_get_result_int(NULL, &scalar), -12);
+
+    ck_assert_int_eq(protocol_scan_result(event, strlen(event), &scalar), 0);
+    ck_assert_int_eq(protocol_has_result(NULL, &scalar), 1);
+    ck_assert_int_eq(protocol_get_result_events(NULL, &scalar, events, 1), 1);
+    ck_assert_int_eq(events[0].bytes[0], 0x0f);
+
+    // left to the parser
+    ck_assert_int_eq(protocol_scan_result(batch, strlen(batch), &scalar), ENSCL);
+    ck_assert_int_eq(scalar.type, PROTOCOL_SCALAR_NONE);
+    ck_assert_int_eq(protocol_scan_result(error, strlen(error), &scalar), ENSCL);
+    ck_assert_int_eq(protocol_scan_result("{\"result\": 1.5}", 15, &scalar), ENSCL);
+    ck_assert_int_eq(protocol_scan_result("{\"result\": 1", 12, &scalar), ENSCL);
+    ck_assert_int_eq(protocol_scan_result("{\"result\": \"a\\n\"}", 17, &scalar), ENSCL);
+    ck_assert_int_eq(protocol_scan_result("{\"result\": 1} x", 15, &scalar), ENSCL);
+
+    // the end of strings longer than a vector
+    ck_assert_int_eq(protocol_scan_result(uuid, strlen(uuid), &scalar), 0);
+    ck_assert_str_eq(scalar.string, "0f8c2b4e-6d1a-4c3b-9e2f-7a5d8b1c3e60");
+    ck_assert_int_eq(protocol_scan_result(escaped, strlen(escaped), &scalar), ENSCL);
+    ck_assert_int_eq(protocol_scan_result(control, strlen(control), &scalar), ENSCL);
+}
+END_TEST
+
 START_TEST(protocol_to_json_test)
 {
     int r;
@@ -500,6 +642,105 @@ START_TEST(protocol_to_json_test)
 }
 END_TEST
 
+START_TEST(protocol_serialize_test)
+{
+    int r;
+    protocol_value_t* value;
+    char* strobj = "{\"method\":\"next_events\",\"args\":[8,true,null,\"a\\\"b\\n\"]}";
+    char buf[128];
+
+    r = protocol_parse(&value, strobj, strlen(strobj));
+    ck_assert_int_eq(r, 0);
+    r = protocol_serialize(value, (char*) &buf, sizeof(buf));
+    ck_assert_int_eq(r, strlen(strobj));
+    ck_assert_int_eq(strncmp(buf, strobj, r), 0);
+    r = protocol_serialize(value, (char*) &buf, 10);
+    ck_assert_int_eq(r, EBNDS);
+    protocol_free_parse(value);
+}
+END_TEST
+
+START_TEST(protocol_msgpack_test)
+{
+    int r;
+    int len;
+    protocol_value_t* value;
+    protocol_value_t* copy;
+    char* strobj = "{\"result\":[0,-1,200,-200,70000,-5000000000,1.5,false,null,\"abc\",{}]}";
+    char buf[128];
+    char json[128];
+
+    r = protocol_parse(&value, strobj, strlen(strobj));
+    ck_assert_int_eq(r, 0);
+    len = protocol_serialize_msgpack(value, (char*) &buf, sizeof(buf));
+    ck_assert_int_gt(len, 0);
+    ck_assert_int_eq(protocol_serialize_msgpack(value, (char*) &buf, 10), EBNDS);
+
+    r = protocol_parse_msgpack(&copy, buf, len, NULL);
+    ck_assert_int_eq(r, 0);
+    r = protocol_serialize(copy, (char*) &json, sizeof(json));
+    ck_assert_int_eq(r, strlen(strobj));
+    ck_assert_int_eq(strncmp(json, strobj, r), 0);
+    protocol_free_parse(copy);
+
+    ck_assert_int_eq(protocol_parse_msgpack(&copy, buf, len - 1, NULL), EMPCK);
+    ck_assert_int_eq(protocol_parse_msgpack(&copy, "\xc1", 1, NULL), EMPCK);
+
+    protocol_free_parse(value);
+}
+END_TEST
+
+START_TEST(protocol_parse_indexed_test)
+{
+    int r;
+    protocol_value_t* value;
+    protocol_value_t* result;
+    protocol_value_t* device;
+    protocol_value_t* item;
+    protocol_string_t name;
+    arena_t arena;
+    char* buf = malloc(4 * PROTOCOL_INDEX_MIN_LEN);
+    size_t len = sprintf(buf, "{\"result\": [");
+
+    // long enough to be parsed from the index, with values across blocks
+    for (int i = 0; i < 100; ++i) {
+        len += sprintf(buf + len, "%s[\"127.0.0.%d\", %d]", i > 0 ? ", " : "", i, 5000 + i);
+    }
+
+    len += sprintf(buf + len, "], \"name\": \"a\\\"b\\\\c\\n\\u00e9\", \"x\": [{}, [], -1.5, true, null]}");
+    ck_assert_int_ge(len, PROTOCOL_INDEX_MIN_LEN);
+
+    r = protocol_parse(&value, buf, len);
+    ck_assert_int_eq(r, 0);
+    ck_assert_int_eq(protocol_get_key(value, &result, "result"), 0);
+    ck_assert_int_eq(protocol_get_length(result), 100);
+    ck_assert_int_eq(protocol_get_at(result, &device, 99), 0);
+    ck_assert_int_eq(protocol_get_at(device, &item, 1), 0);
+    ck_assert_int_eq(protocol_get_int(item), 5099);
+    ck_assert_int_eq(protocol_get_at(device, &item, 0), 0);
+    ck_assert_int_eq(protocol_get_string_view(item, &name), 0);
+    ck_assert_str_eq(name.ptr, "127.0.0.99");
+    ck_assert_int_eq(protocol_get_key(value, &item, "name"), 0);
+    ck_assert_int_eq(protocol_get_string_view(item, &name), 0);
+    ck_assert_str_eq(name.ptr, "a\"b\\c\n\xc3\xa9");
+    ck_assert_int_eq(protocol_get_key(value, &item, "x"), 0);
+    ck_assert_int_eq(protocol_get_length(item), 5);
+    protocol_free_parse(value);
+
+    arena_init(&arena);
+    ck_assert_int_eq(protocol_parse_arena(&value, buf, len, &arena), 0);
+    ck_assert_int_eq(protocol_get_key(value, &result, "result"), 0);
+    ck_assert_int_eq(protocol_get_length(result), 100);
+    arena_free(&arena);
+
+    ck_assert_int_eq(protocol_parse(&value, buf, len - 1), EJSON);
+    buf[len - 2] = '}';
+    ck_assert_int_eq(protocol_parse(&value, buf, len), EJSON);
+
+    free(buf);
+}
+END_TEST
+
 Suite* protocol_suite()
 {
     Suite* s = suite_create("protocol");
@@ -509,11 +750,14 @@ Suite* protocol_suite()
 
     tcase_add_test(parse_case, protocol_parse_success_test);
     tcase_add_test(parse_case, protocol_parse_fail_test);
+    tcase_add_test(parse_case, protocol_parse_indexed_test);
     tcase_add_test(parse_case, protocol_has_key_test);
+    tcase_add_test(parse_case, protocol_find_key_test);
     tcase_add_test(parse_case, protocol_type_test);
     tcase_add_test(parse_case, protocol_get_length_test);
     tcase_add_test(parse_case, protocol_get_at_test);
     tcase_add_test(parse_case, protocol_get_string_test);
+    tcase_add_test(parse_case, protocol_get_string_view_test);
     tcase_add_test(parse_case, protocol_get_bool_test);
     tcase_add_test(parse_case, protocol_get_int_test);
     tcase_add_test(build_case, protocol_build_string_test);
@@ -524,7 +768,12 @@ Suite* protocol_suite()
     tcase_add_test(build_case, protocol_build_response_error_test);
     tcase_add_test(build_case, protocol_get_response_error_test);
     tcase_add_test(build_case, protocol_get_devices_test);
+    tcase_add_test(build_case, protocol_get_events_test);
+    tcase_add_test(build_case, protocol_event_test);
+    tcase_add_test(build_case, protocol_scan_result_test);
     tcase_add_test(serialize_case, protocol_to_json_test);
+    tcase_add_test(serialize_case, protocol_serialize_test);
+    tcase_add_test(serialize_case, protocol_msgpack_test);
 
     suite_add_tcase(s, parse_case);
     suite_add_tcase(s, build_case);
@@ -0,0 +1,79 @@
+#include "test.h"
+#include "log.h"
+#include "err.h"
+#include "ring.h"
+
+START_TEST(ring_find_test)
+{
+    ring_t ring;
+
+    ring_init(&ring);
+    ck_assert_int_eq(ring_find(&ring, '\n', 0), -1);
+
+    ring_write(&ring, "{}\n[]", 5);
+    ck_assert_int_eq(ring_find(&ring, '\n', 0), 2);
+    ck_assert_int_eq(ring_find(&ring, '\n', 3), -1);
+
+    ring_consume(&ring, 3);
+    ring_write(&ring, "\n", 1);
+    ck_assert_int_eq(ring_find(&ring, '\n', 0), 2);
+    ck_assert_int_eq(strncmp(ring_linear(&ring, 2), "[]", 2), 0);
+
+    ring_free(&ring);
+}
+END_TEST
+
+START_TEST(ring_wrap_test)
+{
+    ring_t ring;
+    char data[RING_MIN_SIZE];
+
+    memset(data, 'a', sizeof(data));
+    ring_init(&ring);
+
+    // move the head close to the end, then write across it
+    ring_write(&ring, data, RING_MIN_SIZE - 2);
+    ring_consume(&ring, RING_MIN_SIZE - 2);
+    ring_write(&ring, "abcd\n", 5);
+
+    ck_assert_int_eq(ring.size, RING_MIN_SIZE);
+    ck_assert_int_eq(ring_find(&ring, '\n', 0), 4);
+    ck_assert_int_eq(strncmp(ring_linear(&ring, 4), "abcd", 4), 0);
+
+    ring_free(&ring);
+}
+END_TEST
+
+START_TEST(ring_grow_test)
+{
+    ring_t ring;
+    char data[RING_MIN_SIZE];
+
+    memset(data, 'a', sizeof(data));
+    ring_init(&ring);
+
+    ring_write(&ring, "b", 1);
+    ring_write(&ring, data, sizeof(data));
+
+    ck_assert_int_eq(ring.size, 2 * RING_MIN_SIZE);
+    ck_assert_int_eq(ring.len, RING_MIN_SIZE + 1);
+    ck_assert_int_eq(ring_linear(&ring, 1)[0], 'b');
+    ck_assert_int_eq(ring_write(&ring, data, RING_MAX_SIZE), EBNDS);
+
+    ring_free(&ring);
+}
+END_TEST
+
+Suite* ring_suite()
+{
+    Suite* s = suite_create("ring");
+    TCase* tc = tcase_create("framing");
+
+    tcase_add_test(tc, ring_find_test);
+    tcase_add_test(tc, ring_wrap_test);
+    tcase_add_test(tc, ring_grow_test);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -1,22 +1,23 @@
 #include "test.h"
 #include "log.h"
 #include "state.h"
+#include "err.h"
 
-void __start(state_t* state, void* payload)
+void __start(const state_t* state, void* payload)
 {
-    state_run_next(state, "e1", payload);
-    state_run_next(state, "e2", payload);
-    state_run_next(state, "e3", payload);
+    state_run_next(state, STATE_EDGE_START, payload);
+    state_run_next(state, STATE_EDGE_CONNECT, payload);
+    state_run_next(state, STATE_EDGE_DONE, payload);
 }
 
-void __end(state_t* state, void* payload)
+void __end(const state_t* state, void* payload)
 {
     ck_assert_int_eq(*((int*) payload), 1);
 }
 
 START_TEST(state_machine_build_test)
 {
-    state_t* state;
+    const state_t* state;
     state_lookup_t lookup;
 
     const state_initializer_t si[] = {
@@ -24,9 +25,9 @@ START_TEST(state_machine_build_test)
         { .name = "end", .callback = __end }
     };
     const edge_initializer_t ei[] = {
-        { .name = "e1", .from = "start", .to = "end" },
-        { .name = "e2", .from = "start", .to = "end" },
-        { .name = "e3", .from = "start", .to = "end" }
+        { .edge = STATE_EDGE_START, .from = "start", .to = "end" },
+        { .edge = STATE_EDGE_CONNECT, .from = "start", .to = "end" },
+        { .edge = STATE_EDGE_DONE, .from = "start", .to = "end" }
     };
     const int nsi = sizeof(si) / sizeof(si[0]);
     const int nei = sizeof(ei) / sizeof(ei[0]);
@@ -40,7 +41,7 @@ START_TEST(state_machine_build_test)
 }
 END_TEST
 
-void __start_cycle(state_t* state, void* payload)
+void __start_cycle(const state_t* state, void* payload)
 {
     int* i = (int*) payload;
 
@@ -48,17 +49,48 @@ void __start_cycle(state_t* state, void* payload)
         return;
     }
 
-    state_run_next(state, "next", i);
+    state_run_next(state, STATE_EDGE_NEXT, i);
 }
 
-void __end_cycle(state_t* state, void* payload)
+void __end_cycle(const state_t* state, void* payload)
 {
-    state_run_next(state, "next", payload);
+    state_run_next(state, STATE_EDGE_NEXT, payload);
 }
 
+#define TEST_MACHINE(XX) \
+    XX(test_start, __start_cycle, STATE_TO(NEXT, test_end)) \
+    XX(test_end, __end_cycle, STATE_TO(NEXT, test_start))
+
+enum {
+    TEST_STATES_BASE = STATE_BASE_TEST - 1,
+    TEST_MACHINE(STATE_ID)
+    TEST_STATES
+};
+
+_Static_assert(TEST_STATES <= STATE_STATIC_STATES, "more test states than test state ids");
+
+TEST_MACHINE(STATE_DECLARE)
+TEST_MACHINE(STATE_DEFINE)
+
+START_TEST(state_define_test)
+{
+    const state_t* next = NULL;
+    int i = 0;
+
+    ck_assert_str_eq(test_start.name, "test_start");
+    ck_assert_int_eq(test_start.id, STATE_BASE_TEST);
+    ck_assert_int_eq(test_end.id, STATE_ID_test_end);
+    ck_assert_ptr_eq(test_start.next[STATE_EDGE_NEXT], &test_end);
+    ck_assert_int_eq(state_next(&test_end, &next, STATE_EDGE_DONE), ENFND);
+
+    state_machine_run(&test_start, &i);
+    ck_assert_int_eq(i, 11);
+}
+END_TEST
+
 START_TEST(state_machine_cycle_test)
 {
-    state_t* state;
+    const state_t* state;
     state_lookup_t lookup;
 
     const state_initializer_t si[] = {
@@ -66,8 +98,8 @@ START_TEST(state_machine_cycle_test)
         { .name = "end", .callback = __end_cycle }
     };
     const edge_initializer_t ei[] = {
-        { .name = "next", .from = "start", .to = "end" },
-        { .name = "next", .from = "end", .to = "start" },
+        { .edge = STATE_EDGE_NEXT, .from = "start", .to = "end" },
+        { .edge = STATE_EDGE_NEXT, .from = "end", .to = "start" },
     };
     const int nsi = sizeof(si) / sizeof(si[0]);
     const int nei = sizeof(ei) / sizeof(ei[0]);
@@ -82,6 +114,166 @@ START_TEST(state_machine_cycle_test)
 }
 END_TEST
 
+START_TEST(state_next_test)
+{
+    const state_t* state;
+    const state_t* next = NULL;
+    state_lookup_t lookup;
+
+    const state_initializer_t si[] = {
+        { .name = "start", .callback = __start_cycle },
+        { .name = "end", .callback = __end_cycle }
+    };
+    const edge_initializer_t ei[] = {
+        { .edge = STATE_EDGE_DONE, .from = "start", .to = "end" }
+    };
+    const int nsi = sizeof(si) / sizeof(si[0]);
+    const int nei = sizeof(ei) / sizeof(ei[0]);
+
+    lookup_init(&lookup);
+    state = state_machine_build(si, nsi, ei, nei, &lookup);
+    lookup_clear(&lookup);
+
+    ck_assert_int_eq(state_next(state, &next, STATE_EDGE_DONE), 0);
+    ck_assert_str_eq(next->name, "end");
+    ck_assert_int_eq(state_next(next, &next, STATE_EDGE_DONE), ENFND);
+    ck_assert_int_eq(state_next(state, &next, STATE_EDGE_NONE), ENFND);
+    ck_assert_int_eq(state_next(state, &next, STATE_EDGE_MAX), ENFND);
+    ck_assert_str_eq(state_edge_name(STATE_EDGE_STATUS_NOT_OK), "status_not_ok");
+}
+END_TEST
+
+struct __run_depth_s {
+    int i;
+    int nesting;
+    int max_nesting;
+};
+
+void __run_depth(const state_t* state, void* payload)
+{
+    struct __run_depth_s* depth = (struct __run_depth_s*) payload;
+
+    if (++depth->nesting > depth->max_nesting) {
+        depth->max_nesting = depth->nesting;
+    }
+
+    if (++depth->i < 1000) {
+        state_run_next(state, STATE_EDGE_NEXT, depth);
+    }
+
+    --depth->nesting;
+}
+
+START_TEST(state_run_next_depth_test)
+{
+    const state_t* state;
+    state_lookup_t lookup;
+    struct __run_depth_s depth = { 0, 0, 0 };
+
+    const state_initializer_t si[] = {
+        { .name = "start", .callback = __run_depth }
+    };
+    const edge_initializer_t ei[] = {
+        { .edge = STATE_EDGE_NEXT, .from = "start", .to = "start" }
+    };
+    const int nsi = sizeof(si) / sizeof(si[0]);
+    const int nei = sizeof(ei) / sizeof(ei[0]);
+
+    lookup_init(&lookup);
+    state = state_machine_build(si, nsi, ei, nei, &lookup);
+    lookup_clear(&lookup);
+
+    state_machine_run(state, &depth);
+    ck_assert_int_eq(depth.i, 1000);
+    // every state runs once the one before it has returned
+    ck_assert_int_eq(depth.max_nesting, 1);
+}
+END_TEST
+
+START_TEST(state_stats_test)
+{
+    const state_t* start;
+    const state_t* end = NULL;
+    state_lookup_t lookup;
+    state_stats_t before;
+    state_stats_t after;
+    unsigned long long buckets = 0;
+
+    const state_initializer_t si[] = {
+        { .name = "start", .callback = __start_cycle },
+        { .name = "end", .callback = __end_cycle }
+    };
+    const edge_initializer_t ei[] = {
+        { .edge = STATE_EDGE_NEXT, .from = "start", .to = "end" },
+        { .edge = STATE_EDGE_NEXT, .from = "end", .to = "start" },
+    };
+    const int nsi = sizeof(si) / sizeof(si[0]);
+    const int nei = sizeof(ei) / sizeof(ei[0]);
+
+    lookup_init(&lookup);
+    start = state_machine_build(si, nsi, ei, nei, &lookup);
+    lookup_clear(&lookup);
+    state_next(start, &end, STATE_EDGE_NEXT);
+
+    ck_assert_ptr_eq(state_get_by_id(start->id), start);
+    ck_assert_ptr_eq(state_get_by_id(STATE_MAX_STATES), NULL);
+
+    state_stats_enable();
+    state_stats_collect(&before);
+
+    int i = 0;
+    state_machine_run(start, &i);
+    state_stats_collect(&after);
+
+    ck_assert_int_eq(after.entries[start->id] - before.entries[start->id], 11);
+    ck_assert_int_eq(after.entries[end->id] - before.entries[end->id], 10);
+    ck_assert_int_eq(after.transitions[start->id][STATE_EDGE_NEXT] - before.transitions[start->id][STATE_EDGE_NEXT], 10);
+    ck_assert_int_eq(after.transitions[end->id][STATE_EDGE_NEXT] - before.transitions[end->id][STATE_EDGE_NEXT], 10);
+
+    for (int j = 0; j < STATE_STATS_BUCKETS; ++j) {
+        buckets += after.histogram[start->id][j] - before.histogram[start->id][j];
+    }
+
+    ck_assert_int_eq(buckets, 11);
+}
+END_TEST
+
+START_TEST(lookup_test)
+{
+    state_lookup_t lookup;
+    state_t states[1000];
+    char names[1000][16];
+    char name[16];
+
+    lookup_init(&lookup);
+    lookup_reserve(&lookup, 10);
+    ck_assert_int_eq(lookup.size, LOOKUP_SIZE);
+    ck_assert_ptr_eq(lookup_search(&lookup, "state0"), NULL);
+
+    for (int i = 0; i < 1000; ++i) {
+        sprintf(names[i], "state%d", i);
+        states[i].name = names[i];
+        lookup_insert(&lookup, &states[i]);
+    }
+
+    lookup_insert(&lookup, &states[0]);
+    ck_assert_int_eq(lookup.len, 1000);
+    ck_assert_int_ge(lookup.size, 2 * lookup.len);
+
+    // names are compared by content, not by pointer
+    for (int i = 0; i < 1000; ++i) {
+        sprintf(name, "state%d", i);
+        ck_assert_ptr_eq(lookup_search(&lookup, name), &states[i]);
+    }
+
+    ck_assert_int_eq(lookup_has(&lookup, "state1000"), 0);
+
+    lookup_clear(&lookup);
+    ck_assert_ptr_eq(lookup.table, NULL);
+    ck_assert_int_eq(lookup_has(&lookup, "state0"), 0);
+}
+END_TEST
+
 Suite* state_suite()
 {
     Suite* s = suite_create("state");
@@ -89,6 +281,11 @@ Suite* state_suite()
 
     tcase_add_test(tc, state_machine_build_test);
     tcase_add_test(tc, state_machine_cycle_test);
+    tcase_add_test(tc, state_define_test);
+    tcase_add_test(tc, state_next_test);
+    tcase_add_test(tc, state_run_next_depth_test);
+    tcase_add_test(tc, state_stats_test);
+    tcase_add_test(tc, lookup_test);
 
     suite_add_tcase(s, tc);
 
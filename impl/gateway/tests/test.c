@@ -11,6 +11,13 @@ int main()
     srunner_add_suite(sr, conf_suite());
     srunner_add_suite(sr, state_suite());
     srunner_add_suite(sr, event_handler_suite());
+    srunner_add_suite(sr, pool_suite());
+    srunner_add_suite(sr, ring_suite());
+    srunner_add_suite(sr, arena_suite());
+    srunner_add_suite(sr, net_suite());
+#ifdef GATEWAY_URING
+    srunner_add_suite(sr, uring_suite());
+#endif
 
     srunner_run_all(sr, CK_NORMAL);
 
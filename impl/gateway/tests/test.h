@@ -8,5 +8,12 @@ extern Suite* protocol_suite();
 extern Suite* conf_suite();
 extern Suite* state_suite();
 extern Suite* event_handler_suite();
+extern Suite* pool_suite();
+extern Suite* ring_suite();
+extern Suite* arena_suite();
+extern Suite* net_suite();
+#ifdef GATEWAY_URING
+extern Suite* uring_suite();
+#endif
 
 #endif
@@ -0,0 +1,54 @@
+#ifdef GATEWAY_URING
+
+#include "test.h"
+#include "log.h"
+#include "uring.h"
+
+START_TEST(uring_nop_test)
+{
+    int r;
+    uring_t ring;
+    struct io_uring_sqe* sqe;
+    struct io_uring_cqe* cqe;
+
+    r = uring_init(&ring, 4);
+    ck_assert_int_eq(r, 0);
+
+    for (int i = 0; i < 4; ++i) {
+        sqe = uring_get_sqe(&ring);
+        ck_assert_ptr_ne(sqe, NULL);
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = i;
+    }
+
+    ck_assert_ptr_eq(uring_get_sqe(&ring), NULL);
+
+    r = uring_submit(&ring, 4);
+    ck_assert_int_eq(r, 0);
+
+    for (int i = 0; i < 4; ++i) {
+        cqe = uring_peek_cqe(&ring);
+        ck_assert_ptr_ne(cqe, NULL);
+        ck_assert_int_eq(cqe->user_data, i);
+        ck_assert_int_eq(cqe->res, 0);
+        uring_cqe_seen(&ring);
+    }
+
+    ck_assert_ptr_eq(uring_peek_cqe(&ring), NULL);
+    uring_free(&ring);
+}
+END_TEST
+
+Suite* uring_suite()
+{
+    Suite* s = suite_create("uring");
+    TCase* tc = tcase_create("submit");
+
+    tcase_add_test(tc, uring_nop_test);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+#endif
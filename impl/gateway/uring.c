@@ -0,0 +1,166 @@
+#ifdef GATEWAY_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+#include "log.h"
+
+/**
+ * Sets up a ring with room for entries submissions and maps its queues.
+ */
+int uring_init(uring_t* ring, unsigned entries)
+{
+    log_verbose("uring_init:ring=%p, entries=%u", ring, entries);
+
+    struct io_uring_params params;
+    char* sq;
+    char* cq;
+
+    memset(ring, 0, sizeof(uring_t));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+
+    if (ring->fd < 0) {
+        return -errno;
+    }
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if (ring->sq_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -errno;
+    }
+
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -errno;
+    }
+
+    sq = ring->sq_ptr;
+    cq = ring->cq_ptr;
+
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * Registers iovecs as fixed buffers, to be used by index with
+ * IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED.
+ */
+int uring_register_buffers(uring_t* ring, struct iovec* iovecs, unsigned len)
+{
+    log_verbose("uring_register_buffers:ring=%p, iovecs=%p, len=%u", ring, iovecs, len);
+
+    int r = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovecs, len);
+
+    return r < 0 ? -errno : 0;
+}
+
+/**
+ * Returns a cleared submission entry, or NULL if the submission queue is full
+ * and has to be submitted first. The entry is queued for the next
+ * uring_submit.
+ */
+struct io_uring_sqe* uring_get_sqe(uring_t* ring)
+{
+    log_verbose("uring_get_sqe:ring=%p", ring);
+
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe;
+
+    if (tail - head > *ring->sq_mask) {
+        return NULL;
+    }
+
+    // without a polling thread the kernel only reads the queue in
+    // uring_submit, so the entry can be filled in after the tail moves
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++(ring->to_submit);
+
+    return sqe;
+}
+
+/**
+ * Submits the queued entries and waits for at least wait_nr completions, all
+ * with one system call.
+ */
+int uring_submit(uring_t* ring, unsigned wait_nr)
+{
+    log_verbose("uring_submit:ring=%p, wait_nr=%u", ring, wait_nr);
+
+    int r;
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    do {
+        r = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr, flags, NULL, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        return -errno;
+    }
+
+    ring->to_submit -= r;
+
+    return 0;
+}
+
+/**
+ * Returns the next completion, or NULL if there is none.
+ */
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * Hands the completion returned by uring_peek_cqe back to the kernel.
+ */
+void uring_cqe_seen(uring_t* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_free(uring_t* ring)
+{
+    log_verbose("uring_free:ring=%p", ring);
+
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef __URING_h__
+#define __URING_h__
+
+#ifdef GATEWAY_URING
+
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024
+
+typedef struct uring_s uring_t;
+
+/**
+ * An io_uring instance set up with raw system calls. The submission and
+ * completion queues are shared with the kernel through mmap.
+ */
+struct uring_s {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned to_submit;
+};
+
+int uring_init(uring_t* ring, unsigned entries);
+
+int uring_register_buffers(uring_t* ring, struct iovec* iovecs, unsigned len);
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+
+int uring_submit(uring_t* ring, unsigned wait_nr);
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+
+void uring_cqe_seen(uring_t* ring);
+
+void uring_free(uring_t* ring);
+
+#endif
+
+#endif